@@ -0,0 +1,30 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+////////////////////// SCRATCH ARENA //////////////////////
+
+// a bump allocator on a single anonymous mapping, for the scratch memory of an operation that is dropped all at once
+// the mapping is kept between the uses and only grows, nothing but mmap / munmap is called (it can be used in a signal handler)
+
+typedef struct arena_t {
+    char*   base;
+    size_t  size;
+    size_t  used;
+} arena_t;
+
+// the allocations are rounded up to this, enough for any scalar type
+#define ARENA_ALIGN 8
+#define arena_rounded(size) (((size) + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1))
+
+void arena_init(arena_t* arena);
+// drops the previous allocations and makes room for at least size bytes (the mapping is replaced if it is smaller)
+// returns 1 if the memory couldn't be mapped (errno is set)
+int arena_reset(arena_t* arena, size_t size);
+// NULL if the arena is full
+void* arena_alloc(arena_t* arena, size_t size);
+void arena_destroy(arena_t* arena);
+
+#endif // ARENA_H
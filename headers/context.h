@@ -0,0 +1,41 @@
+#ifndef CONTEXT_H
+#define CONTEXT_H
+
+#include <stddef.h>
+
+// By default the context switch is a small hand written routine that saves only what the ABI requires a callee to preserve
+// (callee-saved registers, the stack pointer and the FP control words). It doesn't touch the signal mask, so it doesn't need a syscall.
+// Compile with -DULT_USE_UCONTEXT (make CONTEXT=ucontext) to fall back to getcontext/makecontext/swapcontext.
+// The fallback is also used automatically on architectures that don't have a hand written routine.
+
+#if !defined(ULT_USE_UCONTEXT) && !defined(__x86_64__) && !defined(__aarch64__)
+#define ULT_USE_UCONTEXT
+#endif
+
+#ifdef ULT_USE_UCONTEXT
+
+#include <ucontext.h>
+
+typedef struct ult_context_t {
+    ucontext_t  uc;
+} ult_context_t;
+
+#else
+
+typedef struct ult_context_t {
+    void*       sp; // everything else is saved on the stack of the suspended thread
+} ult_context_t;
+
+#endif
+
+typedef void (*ult_context_entry)(void);
+
+// prepares a context that will start executing entry on the given stack the first time it is switched to
+// entry must never return (there is nowhere to return to)
+void ult_context_make(ult_context_t* context, void* stack, size_t stack_size, ult_context_entry entry);
+
+// saves the current execution state in from and resumes the state saved in to
+// returns when some other thread switches back to from
+void ult_context_switch(ult_context_t* from, ult_context_t* to);
+
+#endif // CONTEXT_H
@@ -0,0 +1,36 @@
+#ifndef HEAP_H
+#define HEAP_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+////////////////////// USER LEVEL THREAD MIN HEAP //////////////////////
+
+// binary min heap of threads ordered by their wake_time (or another uint64_t field of the thread)
+// every thread remembers its position in the heap (heap_index), so it can be removed from the middle in O(log n)
+// a thread can be in more heaps at the same time if they keep the position in different fields
+
+#define NOT_IN_HEAP SIZE_MAX // the heap_index of a thread that was popped or removed
+
+typedef struct ult_t ult_t;
+
+typedef struct {
+    ult_t**     items;
+    size_t      size;
+    size_t      capacity;
+    size_t      key_offset;     // where the uint64_t key is in the thread structure
+    size_t      index_offset;   // where the size_t position is in the thread structure
+} ult_heap_t;
+
+// ordered by wake_time, the position is kept in heap_index
+void init_ult_heap(ult_heap_t* heap);
+// ordered by the field at key_offset, the position is kept in the field at index_offset (use offsetof)
+void init_ult_heap_keyed(ult_heap_t* heap, size_t key_offset, size_t index_offset);
+void ult_heap_push(ult_heap_t* heap, ult_t* ult);
+ult_t* ult_heap_top(ult_heap_t* heap);  // NULL if the heap is empty
+ult_t* ult_heap_pop(ult_heap_t* heap);  // NULL if the heap is empty
+// make sure that the thread is part of this heap
+void ult_heap_remove(ult_heap_t* heap, ult_t* ult);
+void destroy_ult_heap(ult_heap_t* heap);
+
+#endif // HEAP_H
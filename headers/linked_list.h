@@ -14,10 +14,29 @@ typedef struct generic_node_t {
     struct generic_node_t*    prev;
 } generic_node_t;
 
+// hands out nodes from chunks allocated in bulk and keeps the freed ones for reuse, after warming up a list doesn't call malloc anymore
+// the pool can belong to a single list or be shared by more lists
+// it is not synchronized, the lists that share a pool must be protected by the same lock
+typedef struct node_pool_chunk_t {
+    struct node_pool_chunk_t*   next;
+    generic_node_t              nodes[];
+} node_pool_chunk_t;
+
+typedef struct {
+    generic_node_t*     free_nodes;         // linked through next
+    node_pool_chunk_t*  chunks;
+    size_t              nodes_per_chunk;
+} node_pool_t;
+
+void init_node_pool(node_pool_t* pool, size_t nodes_per_chunk);
+// all the lists using the pool must be destroyed before
+void destroy_node_pool(node_pool_t* pool);
+
 typedef struct {
     generic_node_t*     head;
     generic_node_t*     tail;
     size_t              size;
+    node_pool_t*        pool;   // NULL if the nodes come from malloc
 } generic_linked_list_t;
 
 // assuming that *list points to a valid memory location
@@ -25,6 +44,7 @@ typedef struct {
 // also assuming that the condition function is not NULL
 
 void init_linked_list(generic_linked_list_t* list);
+void init_linked_list_with_pool(generic_linked_list_t* list, node_pool_t* pool);
 void insert_first(generic_linked_list_t* list, void* data);
 void insert_last(generic_linked_list_t* list, void* data);
 generic_node_t* find_node(generic_linked_list_t* list, filter_func condition);
@@ -62,6 +82,32 @@ void delete_ult_last(ult_linked_list_t* list);
 void rotate_ult_front_to_back(ult_linked_list_t* list);
 void destroy_ult_list(ult_linked_list_t* list);
 
+////////////////////// INTRUSIVE USER LEVEL THREAD QUEUE //////////////////////
+
+// the links live inside the ult structure, so putting a thread in a queue or taking it out never allocates
+// a link can be part of a single queue at a time, a thread that has to be in more queues at once needs more links
+
+typedef struct ult_link_t {
+    ult_t*                ult;  // the thread that owns the link
+    struct ult_link_t*    next;
+    struct ult_link_t*    prev;
+} ult_link_t;
+
+typedef struct {
+    ult_link_t*     head;
+    ult_link_t*     tail;
+    size_t          size;
+} ult_queue_t;
+
+void init_ult_link(ult_link_t* link, ult_t* ult);
+void init_ult_queue(ult_queue_t* queue);
+void ult_queue_push_first(ult_queue_t* queue, ult_link_t* link);
+void ult_queue_push_last(ult_queue_t* queue, ult_link_t* link);
+// make sure that the link is part of this queue, same as for delete_node
+void ult_queue_remove(ult_queue_t* queue, ult_link_t* link);
+// returns NULL if the queue is empty
+ult_t* ult_queue_pop_first(ult_queue_t* queue);
+
 ////////////////////// MUTEX LIST //////////////////////
 
 typedef struct ult_mutex_t ult_mutex_t;
@@ -0,0 +1,33 @@
+#ifndef STACK_H
+#define STACK_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+////////////////////// USER LEVEL THREAD STACK //////////////////////
+
+// a stack is either memory given by the user or a mmap-ed region owned by the library
+// the mmap-ed stacks have a PROT_NONE guard page below them, so an overflow stops with SIGSEGV instead of corrupting the neighbouring memory
+// the pages of a mmap-ed stack are only backed by physical memory after they are touched
+
+typedef struct ult_stack_t {
+    char*       base;           // lowest usable address, the stack grows down from base + size
+    size_t      size;
+    char*       mapping;        // the start of the guard page, NULL if the memory belongs to the user
+    size_t      mapping_size;   // includes the guard page
+    unsigned    valgrind_id;
+} ult_stack_t;
+
+// the stacks of the finished threads are cached and reused by the new threads with the same stack size
+// up to warm_stacks per size keep their memory, the next cold_stacks per size give their memory back to the system but keep the mapping
+// the ones above both limits are unmapped
+// the callers of the functions below must be inside a protected zone (they take the cache lock)
+void ult_stack_cache_limits(size_t warm_stacks, size_t cold_stacks);
+
+// returns 0 on success, 1 if the memory couldn't be mapped (errno is set)
+int ult_stack_map(ult_stack_t* stack, size_t size);
+void ult_stack_use(ult_stack_t* stack, void* buffer, size_t size);
+// caches or unmaps a mmap-ed stack, the user memory is left alone
+void ult_stack_release(ult_stack_t* stack);
+
+#endif // STACK_H
@@ -0,0 +1,63 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+////////////////////// EVENT TRACE RING //////////////////////
+
+// a fixed size ring of binary events, written by a single carrier without locks or atomics
+// when the ring is full the oldest events are overwritten, the ring keeps the last ones
+// the times are raw cycle counter values, they are converted only when the trace is written out
+
+typedef enum {
+    TRACE_RUN,      // the carrier switched to the thread
+    TRACE_STOP,     // the thread left the carrier, detail says why (TRACE_STOP_*), object is the block reason of a blocked thread
+    TRACE_WAKE,     // the thread was made ready after blocking, detail is the block reason, object is the thread that woke it (0 for the runtime)
+    TRACE_CREATE,   // the thread created object
+    TRACE_EXIT,     // the thread finished
+    TRACE_LOCK,     // the thread took mutex object, detail is 1 if it had to wait
+    TRACE_UNLOCK    // the thread released mutex object
+} trace_type;
+
+// the reasons of TRACE_STOP, the same values as the runnable argument of the scheduler
+#define TRACE_STOP_BLOCK 0
+#define TRACE_STOP_YIELD 1
+#define TRACE_STOP_PREEMPT 2
+
+typedef struct trace_event_t {
+    uint64_t    time;
+    uint64_t    thread;
+    uint64_t    object;     // another thread, a mutex, a block reason (depends on the type)
+    uint8_t     type;
+    uint8_t     detail;
+} trace_event_t;
+
+typedef struct trace_ring_t {
+    trace_event_t*  events;
+    uint64_t        mask;   // the size is a power of 2
+    uint64_t        head;   // how many events were written since the ring was cleared
+} trace_ring_t;
+
+// the size is rounded up to a power of 2, returns 1 if the memory couldn't be allocated
+int trace_ring_init(trace_ring_t* ring, size_t events);
+void trace_ring_destroy(trace_ring_t* ring);
+
+static inline void trace_ring_record(trace_ring_t* ring, uint64_t time, uint8_t type, uint8_t detail, uint64_t thread, uint64_t object) {
+    trace_event_t* event = &(ring->events[ring->head & ring->mask]);
+
+    event->time = time;
+    event->thread = thread;
+    event->object = object;
+    event->type = type;
+    event->detail = detail;
+
+    ring->head += 1;
+}
+
+// merges the rings of all the carriers (ring i belongs to carrier i) and writes them as Chrome trace event JSON
+// (chrome://tracing, ui.perfetto.dev): a track per thread with the time it ran, waited in a run queue and was blocked, and a track per carrier
+// returns 1 if the file couldn't be written (errno is set)
+int trace_write_json(const char* path, trace_ring_t* rings, uint32_t ring_count, double cycles_per_us);
+
+#endif // TRACE_H
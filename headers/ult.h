@@ -2,12 +2,37 @@
 #define ULT_H
 
 #include <stdint.h>
-#include <ucontext.h>
+#include <stdatomic.h>
 #include <time.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
 
+#include "context.h"
 #include "linked_list.h"
+#include "stack.h"
 
 #define DEFAULT_ULT_STACK_SIZE 0x4000
+#define MIN_ULT_STACK_SIZE 0x2000 // the signal handlers run on the stack of the interrupted thread, they need some room too
+
+// every priority has its own run queue, the threads with a higher priority run first
+#define ULT_PRIORITY_LEVELS 8
+#define ULT_PRIORITY_MIN 0
+#define ULT_PRIORITY_MAX (ULT_PRIORITY_LEVELS - 1)
+#define ULT_PRIORITY_DEFAULT 4
+
+// how long a thread runs before it is preempted, if there is another thread to run
+#define ULT_TIME_SLICE_MIN_NS 100000
+#define ULT_TIME_SLICE_MAX_NS 50000000
+#define ULT_TIME_SLICE_DEFAULT_NS 1000000
+
+// with the fair policy a thread with twice the weight gets twice the cpu time
+#define ULT_WEIGHT_MIN 1
+#define ULT_WEIGHT_MAX 1048576
+#define ULT_WEIGHT_DEFAULT 1024
+
+// the read locks a thread holds are remembered for the deadlock check, up to this many at a time (the waits on the others are assumed to end)
+#define ULT_TRACKED_READ_LOCKS 4
 
 #define BAIL(msg) \
     do { \
@@ -28,48 +53,306 @@ typedef enum {
     FINISHED
 } ult_status;
 
+// why a thread was blocked, the time is counted separately for each reason
+typedef enum {
+    ULT_BLOCK_MUTEX,
+    ULT_BLOCK_COND,
+    ULT_BLOCK_JOIN,
+    ULT_BLOCK_SLEEP,
+    ULT_BLOCK_IO,       // ult_wait_fd (and the socket operations) and the file operations
+    ULT_BLOCK_RWLOCK,
+    ULT_BLOCK_SYNC,     // semaphores, barriers and wait groups
+    ULT_BLOCK_CHAN,
+    ULT_BLOCK_PARK,     // ult_park
+    ULT_BLOCK_REASONS
+} ult_block_reason;
+
+typedef struct ult_stats_t {
+    uint64_t    run_ns;                         // the time the thread ran on a carrier
+    uint64_t    voluntary_switches;             // the thread blocked, yielded or finished
+    uint64_t    involuntary_switches;           // the timer preempted the thread
+    uint64_t    wakeups;                        // the thread was made ready after blocking
+    uint64_t    blocked_ns[ULT_BLOCK_REASONS];  // from blocking until it was made ready, per reason
+} ult_stats_t;
+
+// bucket 0 of the hold time histogram counts the holds under 1 us, bucket b the holds in [2^(b-1), 2^b) us, the last one everything longer
+#define ULT_LOCK_HOLD_BUCKETS 16
+
+// collected by the lock profiler (ult_set_lock_profiling), only the sampled acquisitions are counted
+typedef struct ult_lock_stats_t {
+    uint64_t    acquisitions;                           // the sampled lock and trylock calls
+    uint64_t    contended;                              // the sampled acquisitions that had to wait for the mutex
+    uint64_t    wait_ns;                                // the total wait of the sampled acquisitions
+    uint64_t    max_wait_ns;
+    void*       max_wait_site;                          // the code that called lock when the longest wait happened
+    uint64_t    hold_histogram[ULT_LOCK_HOLD_BUCKETS];  // how long the sampled acquisitions held the mutex
+    uint32_t    max_waiters;                            // the peak length of the waiting queue (every wait is counted)
+} ult_lock_stats_t;
+
+typedef struct ult_cond_stats_t {
+    uint64_t    waits;
+    uint64_t    wakes;          // the threads woken by signal and broadcast
+    uint32_t    max_waiters;    // the peak length of the waiting queue
+} ult_cond_stats_t;
+
+// the profiler's record of a mutex or a cond, allocated the first time the profiler counts something about it
+struct ult_lock_profile_t;
+
+#define MUTEX_WAITERS ((uintptr_t) 1)
+
 typedef struct ult_mutex_t {
-    uint64_t            id;
-    ult_t*              owner;
-    ult_linked_list_t   waiting;
+    uint64_t                            id;
+    _Atomic uintptr_t                   owner;      // the owner thread, the lowest bit (MUTEX_WAITERS) is set if there are threads in the waiting queue
+    ult_queue_t                         waiting;    // protected by the scheduler lock
+    _Atomic(struct ult_lock_profile_t*) profile;    // NULL if the profiler hasn't seen the mutex
 } ult_mutex_t;
 
+#define mutex_owner(mutex) ((ult_t*) (atomic_load_explicit(&((mutex)->owner), memory_order_relaxed) & ~MUTEX_WAITERS))
+
 typedef struct ult_cond_t {
-    uint64_t            id;
-    ult_linked_list_t   waiting;
+    uint64_t                            id;
+    ult_queue_t                         waiting;
+    _Atomic(struct ult_lock_profile_t*) profile;    // NULL if the profiler hasn't seen the cond
+    uint32_t                            deadlock_stage; // the deadlock check that numbered the cond last
+    uint32_t                            deadlock_group; // the waiters of the cond in the wait-for graph of that check
 }ult_cond_t;
 
+typedef enum {
+    ULT_RWLOCK_PREFER_READERS,  // a reader joins the ones holding the lock even if writers wait, the writers can starve (the default)
+    ULT_RWLOCK_PREFER_WRITERS   // a reader waits while a writer waits, the writers get the lock as soon as the readers before them are done
+} ult_rwlock_preference;
+
+typedef struct ult_rwlock_t {
+    uint64_t                            id;
+    _Atomic uint64_t                    state;          // the readers holding the lock, the writer bit and the waiters bit (see ult.c)
+    struct ult_t*                       writer;         // the thread holding the lock exclusively, NULL if it is shared or free
+    ult_queue_t                         waiting;        // protected by the scheduler lock
+    uint32_t                            waiting_writers;
+    uint8_t                             prefer_writers;
+    uint32_t                            deadlock_stage; // the deadlock check that numbered the rwlock last
+    uint32_t                            deadlock_group; // the node of the rwlock in the wait-for graph of that check
+} ult_rwlock_t;
+
+// the semaphores, barriers and wait groups keep their waiting threads in the queue of a cond of their own, any thread can wake them up like with a cond
+// so the timers and the deadlock check (which reports them by the id of that cond) treat them the same way
+
+typedef struct ult_sem_t {
+    _Atomic uint64_t    state;      // the value and the waiters bit (see ult.c)
+    ult_cond_t          waiters;
+} ult_sem_t;
+
+// returned by ult_barrier_wait to one of the threads, the others get 0
+#define ULT_BARRIER_SERIAL_THREAD (-1)
+
+typedef struct ult_barrier_t {
+    uint32_t            count;      // the threads that have to arrive before all of them go on
+    uint32_t            arrived;    // protected by the scheduler lock
+    ult_cond_t          waiters;
+} ult_barrier_t;
+
+typedef struct ult_waitgroup_t {
+    _Atomic int64_t     counter;
+    ult_cond_t          waiters;
+} ult_waitgroup_t;
+
+// a bounded queue of pointers between threads, the blocked senders and receivers are woken like the waiters of a cond
+typedef struct ult_chan_t {
+    void**              buffer;     // a ring of capacity items, NULL for a rendezvous channel
+    size_t              capacity;
+    size_t              head;       // the oldest item
+    size_t              count;
+    uint8_t             closed;
+    atomic_flag         lock;       // protects the channel and its two waiting queues, the scheduler lock is only taken to publish a wait for the deadlock check
+    ult_cond_t          senders;    // the threads waiting for room, only the queue and the deadlock check fields are used
+    ult_cond_t          receivers;  // the threads waiting for items, only while the buffer is empty
+} ult_chan_t;
+
 typedef struct ult_t{
     uint64_t                        id;
     ult_status                      status;
     void*                           result;
     void*                           arg;
 
-    struct timespec                 sleep_time;
-    uint64_t                        sleep_amount_nsec;
+    uint64_t                        wake_time;       // when a SLEEPING thread should wake up, or a timed wait times out (nanoseconds)
+    size_t                          heap_index;      // the position of a SLEEPING thread in the timer heap
+    int                             waiting_fd;      // the fd a thread waits for in ult_wait_fd, -1 otherwise
+    uint32_t                        io_revents;      // the events that woke it up, 0 if the wait timed out
 
     struct ult_t*                   joined_by;       // the thread that waits after the current thread
     struct ult_t*                   waiting_to_join; // the thread that is waited by the current thread
     ult_mutex_t*                    waiting_mutex;   // the mutex that is being waited
     ult_cond_t*                     waiting_cond;    // the condition wariable that is being waited
-    uint32_t                        deadlock_explore_counter;
+    ult_rwlock_t*                   waiting_rwlock;  // the rwlock that is being waited
+    uint8_t                         rwlock_exclusive; // the rwlock is waited for writing
+    ult_rwlock_t*                   read_locks[ULT_TRACKED_READ_LOCKS]; // the rwlocks the thread reads, NULL in the free slots
+    uint32_t                        untracked_read_locks; // the read locks that didn't fit in the slots
+    void*                           chan_transfer;   // the items a thread blocked in a channel sends or receives (on its stack)
+    _Atomic uint32_t*               park_address;    // the word a parked thread waits on, NULL otherwise
+    uint8_t                         timed_wait;      // the wait for the mutex / cond / rwlock / join has a timeout, the thread is in the timer heap too
+    uint8_t                         timed_out;       // set by the timer when it ended the wait
+    uint32_t                        deadlock_stage;  // the deadlock check that numbered the thread last
+    uint32_t                        deadlock_node;   // the node of the thread in the wait-for graph of that check
+    _Atomic uint8_t                 on_carrier;      // set while a carrier executes the thread or is still saving its context
+    volatile uint32_t               preempt_depth;   // how many protected zones the thread is in, it is not switched out by the timer while this is not 0
+    volatile uint8_t                preempt_pending; // the timer expired inside a protected zone, the thread yields when it leaves the outermost one
+    volatile uint8_t                priority;        // the run queue the thread goes to when it becomes ready
+    volatile uint32_t               weight;          // the share of cpu time with the fair policy
+    uint64_t                        vruntime;        // the time the thread ran (nanoseconds), scaled by ULT_WEIGHT_DEFAULT / weight
+    uint64_t                        run_start;       // when the thread was switched in last time, with the fair policy
+    size_t                          run_index;       // the position of a ready thread in the fair run queue of a carrier
+
+    ult_link_t                      all_link;        // links the thread in the list of not finished threads
+    ult_link_t                      queue_link;      // links the thread in the overflow run queue or in the waiting queue of a mutex / cond / rwlock (only one at a time)
 
     voidptr_arg_voidptr_ret_func    start_routine;
-    ucontext_t                      context;
-    char                            stack[DEFAULT_ULT_STACK_SIZE];
+    ult_context_t                   context;
+    ult_stack_t                     stack;
+
+    ult_stats_t                     stats;           // the times are counted in cycles of the cheap clock, ult_get_stats converts them
+    uint64_t                        blocked_at;      // when the thread blocked (cycles)
+    uint8_t                         block_reason;    // ULT_BLOCK_REASONS while the thread is not blocked
+    uint32_t                        lock_samples;    // the lock calls since the last one sampled by the lock profiler
 }ult_t;
 
+typedef struct ult_attr_t {
+    size_t      stack_size;
+    void*       stack;          // memory provided by the user, NULL if the library should map the stack
+    int         priority;
+    uint32_t    weight;
+} ult_attr_t;
+
+typedef enum {
+    ULT_SCHED_PRIORITY, // round robin inside every priority, the higher priorities first (the default)
+    ULT_SCHED_FAIR      // the ready thread that ran the least (relative to its weight) runs next, the priorities are ignored
+} ult_sched_policy;
+
+// it must be called before any other function of the library, like ult_set_concurrency
+int ult_set_sched_policy(ult_sched_policy policy);
+ult_sched_policy ult_get_sched_policy();
+
+// sets the number of kernel threads (carriers) that execute the user level threads, 0 means one for every online CPU (the default)
+// it must be called before any other function of the library
+int ult_set_concurrency(uint32_t carriers);
+uint32_t ult_get_concurrency();
+
+// can be changed at any time, the running threads get the new slice when the timer of their carrier is armed again
+// a thread is only preempted while it runs the program's own code, a thread stopped inside libc could leave a libc lock taken for the other threads of its carrier
+// when the slice ends inside libc the thread yields at its next call into the library, or when one of a few quick retries of the timer finds it in the program's code,
+// a thread that spends whole slices inside libc (a long computation in libm) can keep the carrier for several slices
+// returns 1 if the slice is not between ULT_TIME_SLICE_MIN_NS and ULT_TIME_SLICE_MAX_NS
+int ult_set_time_slice(uint64_t nsec);
+uint64_t ult_get_time_slice();
+
+// the stacks mapped by the library are kept after join and reused by the next threads with the same stack size
+// up to warm_stacks per stack size stay resident (64 by default), the next cold_stacks (1024 by default) only keep the mapping
+int ult_set_stack_cache(size_t warm_stacks, size_t cold_stacks);
+
+// while it is on, ult_mutex_lock, ult_rwlock_rdlock / wrlock and ult_join return EDEADLK instead of blocking when the wait would close a cycle of threads waiting for each other
+// only the chain of mutex owners, rwlock writers and joined threads is followed, so the check costs the length of the chain (a thread waiting for a cond or for rwlock readers ends it)
+// off by default, it can be changed at any time
+int ult_set_deadlock_avoidance(uint8_t enabled);
+uint8_t ult_get_deadlock_avoidance();
+
+// the engine that runs the file operations (ult_pread, ult_pwrite, ult_fsync, ult_openat and ult_read / ult_write on regular files)
+typedef enum {
+    ULT_IO_URING,   // the operations go through an io_uring ring shared by the carriers (the default)
+    ULT_IO_THREAD   // helper kernel threads do the blocking calls, used when the kernel doesn't allow io_uring
+} ult_io_engine;
+
+// it must be called before any other function of the library, like ult_set_concurrency
+int ult_set_io_engine(ult_io_engine engine);
+// the engine in use, ULT_IO_THREAD if io_uring was asked for but isn't available
+ult_io_engine ult_get_io_engine();
+
+// the default attributes: a DEFAULT_ULT_STACK_SIZE stack mapped by the library, ULT_PRIORITY_DEFAULT and ULT_WEIGHT_DEFAULT
+int ult_attr_init(ult_attr_t* attr);
+// the library maps a stack of this size (rounded up to pages) with a guard page under it, returns 1 if the size is smaller than MIN_ULT_STACK_SIZE
+int ult_attr_setstacksize(ult_attr_t* attr, size_t stack_size);
+// the thread runs on the given memory, it must stay valid until the thread is joined, returns 1 if the size is smaller than MIN_ULT_STACK_SIZE
+// there is no guard page, an overflow will corrupt the memory under the buffer
+int ult_attr_setstack(ult_attr_t* attr, void* stack, size_t stack_size);
+// returns 1 if the priority is not between ULT_PRIORITY_MIN and ULT_PRIORITY_MAX
+int ult_attr_setpriority(ult_attr_t* attr, int priority);
+// returns 1 if the weight is not between ULT_WEIGHT_MIN and ULT_WEIGHT_MAX
+int ult_attr_setweight(ult_attr_t* attr, uint32_t weight);
+
 int ult_create(ult_t* thread, voidptr_arg_voidptr_ret_func start_routine, void* arg);
+// attr can be NULL for the default attributes, it can be reused or destroyed right after the call
+// returns 1 if the stack couldn't be mapped
+int ult_create_with_attr(ult_t* thread, const ult_attr_t* attr, voidptr_arg_voidptr_ret_func start_routine, void* arg);
+// returns EINVAL if another thread already joins the thread (or joined it), EDEADLK if the deadlock avoidance is on and the join would close a cycle of waits
 int ult_join(ult_t* thread, void** retval);
+// like ult_join, returns ETIMEDOUT if the thread didn't finish in sec + nsec (it can be joined again later)
+int ult_join_timeout(ult_t* thread, void** retval, uint64_t sec, uint64_t nsec);
+
+// the threads that wait in lower priority queues are moved up a level from time to time, so a steady stream of higher priority work can't starve them
+// thread can be NULL for the calling thread, a thread that is already in a run queue gets the new priority the next time it becomes ready
+// returns 1 if the priority is not between ULT_PRIORITY_MIN and ULT_PRIORITY_MAX
+int ult_set_priority(ult_t* thread, int priority);
+int ult_get_priority(ult_t* thread);
+// thread can be NULL for the calling thread, the time it already ran is not scaled again
+// returns 1 if the weight is not between ULT_WEIGHT_MIN and ULT_WEIGHT_MAX
+int ult_set_weight(ult_t* thread, uint32_t weight);
+uint32_t ult_get_weight(ult_t* thread);
+
+// thread can be NULL for the calling thread, the counters of a thread running on another carrier keep changing while they are read
+// the counters are updated at every switch with the cycle counter of the cpu (the time stamp counter on x86_64)
+int ult_get_stats(ult_t* thread, ult_stats_t* stats);
+// the sum of the counters of all the threads, the joined ones included
+int ult_get_runtime_stats(ult_stats_t* stats);
 
 void ult_sleep(uint64_t sec, uint64_t nsec);
+void ult_yield();
 uint64_t ult_get_id();
 
 void ult_exit(void* retval);
 
+// blocks the calling thread (not the carrier) until the fd has one of the events (POLLIN, POLLOUT, ...) or the timeout expires
+// timeout_ms < 0 waits forever, returns the events that happened (like poll's revents), 0 on timeout and -1 on error (errno is set)
+// only one thread can wait for an fd at a time, the others get EBUSY
+int ult_wait_fd(int fd, short events, int timeout_ms);
+// the fd is switched to non blocking mode, the calling thread waits in the library while the operation would block
+// regular files and block devices are never ready in that sense, their reads and writes go through the io engine instead
+ssize_t ult_read(int fd, void* buf, size_t count);
+ssize_t ult_write(int fd, const void* buf, size_t count);
+int ult_accept(int fd, struct sockaddr* addr, socklen_t* addrlen);
+int ult_connect(int fd, const struct sockaddr* addr, socklen_t addrlen);
+
+// the file operations block the calling thread (not the carrier) until the io engine completes them
+// they return like the system calls with the same names, -1 with errno set on error
+ssize_t ult_pread(int fd, void* buf, size_t count, off_t offset);
+ssize_t ult_pwrite(int fd, const void* buf, size_t count, off_t offset);
+int ult_fsync(int fd);
+int ult_openat(int dirfd, const char* path, int flags, mode_t mode);
+
+// the lock profiler samples one in sample_period lock / trylock calls (of every thread) and counts every wait on a mutex or cond, 0 turns it off (the default)
+// a profiled mutex or cond must be destroyed before its memory is reused, the records of the destroyed ones are dropped
+// the first call waits a few milliseconds if the library started right before it (the cycle counter is calibrated)
+int ult_set_lock_profiling(uint32_t sample_period);
+// the stats are zero if the profiler hasn't seen the mutex / cond
+int ult_mutex_get_stats(ult_mutex_t* mutex, ult_lock_stats_t* stats);
+int ult_cond_get_stats(ult_cond_t* cond, ult_cond_stats_t* stats);
+// prints the top mutexes by total wait time and the top conds by waits, with the code that waited the longest for every mutex
+void ult_print_lock_report(uint32_t top);
+
+// every carrier records the switches, wakeups, creations, exits and mutex operations in its own ring of events_per_carrier binary events (the last ones are kept)
+// the rings are allocated on the first call (or when the size changes) and cleared on the next ones
+// returns 1 if tracing is already on or the rings couldn't be allocated
+int ult_trace_start(size_t events_per_carrier);
+void ult_trace_stop();
+// stops tracing and writes the rings as Chrome trace event JSON (chrome://tracing, ui.perfetto.dev), returns 1 if the file couldn't be written
+// the events recorded by the carriers that were in the middle of an operation when tracing stopped might be cut, dump after the traced work is done
+int ult_trace_dump(const char* path);
+
 int ult_mutex_init(ult_mutex_t* mutex);
 int ult_mutex_destroy(ult_mutex_t* mutex);
+// a free mutex is taken and released with a single compare and swap, the runtime is only entered if there are other threads waiting
+// returns EDEADLK if the deadlock avoidance is on and the owner waits (through other mutexes or joins) for the calling thread, the mutex is not taken
 int ult_mutex_lock(ult_mutex_t* mutex);
+// like ult_mutex_lock, returns ETIMEDOUT if the mutex couldn't be taken in sec + nsec
+int ult_mutex_timedlock(ult_mutex_t* mutex, uint64_t sec, uint64_t nsec);
+// returns 1 if the mutex is held by another thread
+int ult_mutex_trylock(ult_mutex_t* mutex);
 int ult_mutex_unlock(ult_mutex_t* mutex);
 
 int ult_cond_init(ult_cond_t* cond);
@@ -77,6 +360,83 @@ int ult_cond_destroy(ult_cond_t* cond);
 int ult_cond_wait(ult_cond_t* cond, ult_mutex_t* mutex);
 int ult_cond_signal(ult_cond_t* cond);
 int ult_cond_broadcast(ult_cond_t* cond);
-// int ult_cond_timewait(ult_cond_t* cond, ult_mutex_t* mutex, uint64_t sec, uint64_t nsec);
+// like ult_cond_wait, returns ETIMEDOUT if the cond wasn't signaled in sec + nsec (the mutex is taken back anyway)
+int ult_cond_timedwait(ult_cond_t* cond, ult_mutex_t* mutex, uint64_t sec, uint64_t nsec);
+
+int ult_rwlock_init(ult_rwlock_t* rwlock, ult_rwlock_preference preference);
+// returns 1 if the rwlock is held or waited
+int ult_rwlock_destroy(ult_rwlock_t* rwlock);
+// a free or read rwlock is taken for reading with a single compare and swap while nobody waits for it
+// the locks are not recursive, taking it again while writing it or for writing while reading it returns EDEADLK with the deadlock avoidance on (and never returns without it)
+int ult_rwlock_rdlock(ult_rwlock_t* rwlock);
+int ult_rwlock_wrlock(ult_rwlock_t* rwlock);
+// return 1 if the rwlock can't be taken right away
+int ult_rwlock_tryrdlock(ult_rwlock_t* rwlock);
+int ult_rwlock_trywrlock(ult_rwlock_t* rwlock);
+// return ETIMEDOUT if the rwlock couldn't be taken in sec + nsec
+int ult_rwlock_timedrdlock(ult_rwlock_t* rwlock, uint64_t sec, uint64_t nsec);
+int ult_rwlock_timedwrlock(ult_rwlock_t* rwlock, uint64_t sec, uint64_t nsec);
+// releases the lock held for reading or writing, returns 1 if the calling thread doesn't hold it
+// (a thread that reads more than ULT_TRACKED_READ_LOCKS rwlocks at once can only be checked for the first ones)
+int ult_rwlock_unlock(ult_rwlock_t* rwlock);
+
+int ult_sem_init(ult_sem_t* sem, uint32_t value);
+// returns 1 if threads wait for the semaphore
+int ult_sem_destroy(ult_sem_t* sem);
+// while nobody waits, the value is changed with a single compare and swap
+int ult_sem_wait(ult_sem_t* sem);
+// returns 1 if the value is 0
+int ult_sem_trywait(ult_sem_t* sem);
+// returns ETIMEDOUT if the value stayed 0 for sec + nsec
+int ult_sem_timedwait(ult_sem_t* sem, uint64_t sec, uint64_t nsec);
+int ult_sem_post(ult_sem_t* sem);
+// adds n to the value, the first n waiting threads (or all of them if there are fewer) take one each and are woken up, the rest is added to the value
+int ult_sem_post_n(ult_sem_t* sem, uint32_t n);
+uint32_t ult_sem_getvalue(ult_sem_t* sem);
+
+// returns 1 if count is 0
+int ult_barrier_init(ult_barrier_t* barrier, uint32_t count);
+// returns 1 if threads wait at the barrier
+int ult_barrier_destroy(ult_barrier_t* barrier);
+// the last of count threads to arrive wakes the others up and gets ULT_BARRIER_SERIAL_THREAD, the barrier is ready for the next round right away
+int ult_barrier_wait(ult_barrier_t* barrier);
+
+int ult_waitgroup_init(ult_waitgroup_t* group);
+// returns 1 if threads wait for the group
+int ult_waitgroup_destroy(ult_waitgroup_t* group);
+// returns 1 if the counter would go below 0, when it gets to 0 the waiting threads are woken up
+int ult_waitgroup_add(ult_waitgroup_t* group, int64_t delta);
+int ult_waitgroup_done(ult_waitgroup_t* group);
+// returns as soon as the counter is 0
+int ult_waitgroup_wait(ult_waitgroup_t* group);
+
+// capacity 0 makes a rendezvous channel, every send waits for a receiver, returns 1 if the buffer couldn't be allocated
+int ult_chan_init(ult_chan_t* chan, size_t capacity);
+// returns 1 if threads wait in the channel, the items still in the buffer are dropped
+int ult_chan_destroy(ult_chan_t* chan);
+// a receiver that waits gets the item straight from the sender, otherwise it goes to the buffer if there is room or the sender waits
+// returns EPIPE if the channel is closed
+int ult_chan_send(ult_chan_t* chan, void* item);
+// returns EPIPE if the channel is closed and there is nothing left to receive
+int ult_chan_recv(ult_chan_t* chan, void** item);
+// return 1 instead of waiting
+int ult_chan_try_send(ult_chan_t* chan, void* item);
+int ult_chan_try_recv(ult_chan_t* chan, void** item);
+// sends all the items in order, waiting for room as many times as needed, returns how many were sent (fewer only if the channel was closed)
+size_t ult_chan_send_n(ult_chan_t* chan, void** items, size_t n);
+// waits until there is at least one item and receives up to n, returns how many (0 if the channel is closed and there is nothing left)
+size_t ult_chan_recv_n(ult_chan_t* chan, void** items, size_t n);
+// the waiting senders get EPIPE (the items they didn't hand over stay with them), the receivers get what is left and then EPIPE
+// returns 1 if the channel was already closed
+int ult_chan_close(ult_chan_t* chan);
+
+// the building block for objects of a single word: the calling thread sleeps if *address still holds expected, until ult_unpark is called on the address
+// the check and the sleep are atomic with respect to ult_unpark, the sleeping threads are kept in a table hashed by address so the word needs nothing else
+// returns 1 if *address didn't hold expected (the thread didn't sleep), 0 when it was woken up
+int ult_park(_Atomic uint32_t* address, uint32_t expected);
+// returns ETIMEDOUT if nobody woke the thread up in sec + nsec
+int ult_park_timeout(_Atomic uint32_t* address, uint32_t expected, uint64_t sec, uint64_t nsec);
+// wakes up to n threads parked on the address, in the order they parked, returns how many
+uint32_t ult_unpark(_Atomic uint32_t* address, uint32_t n);
 
 #endif // ULT_H
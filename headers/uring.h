@@ -0,0 +1,57 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <linux/io_uring.h>
+
+////////////////////// IO_URING RING //////////////////////
+
+// a minimal io_uring ring on top of the raw system calls (no liburing)
+// the entries are prepared in the submission queue and handed to the kernel in batches by uring_submit,
+// the completions are read straight from the shared memory, without a system call
+// the ring is not synchronized, the callers must serialize the access to it
+
+typedef struct uring_t {
+    int                     fd;
+
+    // submission queue
+    _Atomic uint32_t*       sq_head;        // moved by the kernel
+    _Atomic uint32_t*       sq_tail;
+    uint32_t                sq_mask;
+    uint32_t                sq_entries;
+    uint32_t*               sq_array;
+    struct io_uring_sqe*    sqes;
+    uint32_t                sq_prepared;    // local tail, the entries up to it are published by the next submit
+
+    // completion queue
+    _Atomic uint32_t*       cq_head;
+    _Atomic uint32_t*       cq_tail;        // moved by the kernel
+    uint32_t                cq_mask;
+    struct io_uring_cqe*    cqes;
+
+    void*                   sq_ring;
+    size_t                  sq_ring_size;
+    void*                   cq_ring;        // the same as sq_ring if the kernel maps both queues together
+    size_t                  cq_ring_size;
+    size_t                  sqes_size;
+} uring_t;
+
+// returns 0 on success, -1 if the kernel doesn't have io_uring (or doesn't allow it) and errno is set
+int uring_init(uring_t* ring, uint32_t entries);
+void uring_destroy(uring_t* ring);
+
+// returns a zeroed entry to fill in, NULL if the submission queue is full (submit first)
+struct io_uring_sqe* uring_get_sqe(uring_t* ring);
+// the number of entries prepared and not consumed by the kernel yet
+uint32_t uring_pending(uring_t* ring);
+// hands the prepared entries to the kernel with a single system call, returns how many were consumed or -1 (errno is set)
+int uring_submit(uring_t* ring);
+
+// the first completion that was not consumed yet, NULL if there is none
+struct io_uring_cqe* uring_peek_cqe(uring_t* ring);
+// gives the completion back to the kernel, the cqe can't be used after this
+void uring_cqe_seen(uring_t* ring);
+
+#endif // URING_H
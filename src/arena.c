@@ -0,0 +1,53 @@
+#include <stdio.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include "arena.h"
+
+void arena_init(arena_t* arena) {
+    arena->base = NULL;
+    arena->size = 0;
+    arena->used = 0;
+}
+
+int arena_reset(arena_t* arena, size_t size) {
+    arena->used = 0;
+
+    if (size <= arena->size) {
+        return 0;
+    }
+
+    arena_destroy(arena);
+
+    // the pages are only touched as far as they are used
+    void* base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) {
+        return 1;
+    }
+
+    arena->base = (char*) base;
+    arena->size = size;
+
+    return 0;
+}
+
+void* arena_alloc(arena_t* arena, size_t size) {
+    size = arena_rounded(size);
+
+    if (size > arena->size - arena->used) {
+        return NULL;
+    }
+
+    void* memory = arena->base + arena->used;
+    arena->used += size;
+
+    return memory;
+}
+
+void arena_destroy(arena_t* arena) {
+    if (arena->base != NULL) {
+        munmap(arena->base, arena->size);
+    }
+
+    arena_init(arena);
+}
@@ -0,0 +1,168 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+
+#include "context.h"
+#include "ult.h"
+
+#ifdef ULT_USE_UCONTEXT
+
+void ult_context_make(ult_context_t* context, void* stack, size_t stack_size, ult_context_entry entry) {
+    if (getcontext(&(context->uc)) != 0)
+        BAIL("Get Context");
+
+    context->uc.uc_stack.ss_sp = stack;
+    context->uc.uc_stack.ss_size = stack_size;
+    context->uc.uc_link = NULL;
+
+    makecontext(&(context->uc), entry, 0);
+}
+
+void ult_context_switch(ult_context_t* from, ult_context_t* to) {
+    if (swapcontext(&(from->uc), &(to->uc)) != 0)
+        BAIL("Swapcontext");
+}
+
+#elif defined(__x86_64__)
+
+// the suspended stack looks like this (growing downwards):
+//      return address
+//      rbp, rbx, r12, r13, r14, r15
+//      fpu control word (upper half) | mxcsr (lower half)   <- saved sp
+// rdi = from, rsi = to
+
+__asm__ (
+    ".text\n"
+    ".globl ult_context_switch\n"
+    ".type ult_context_switch, @function\n"
+    "ult_context_switch:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    subq $8, %rsp\n"
+    "    stmxcsr (%rsp)\n"
+    "    fnstcw 4(%rsp)\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq (%rsi), %rsp\n"
+    "    ldmxcsr (%rsp)\n"
+    "    fldcw 4(%rsp)\n"
+    "    addq $8, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".size ult_context_switch, .-ult_context_switch\n"
+
+    // first 'return' of a new context lands here with the entry point in r12 and an aligned stack
+    ".type ult_context_trampoline, @function\n"
+    "ult_context_trampoline:\n"
+    "    callq *%r12\n"
+    "    ud2\n"
+    ".size ult_context_trampoline, .-ult_context_trampoline\n"
+);
+
+extern void ult_context_trampoline(void);
+
+void ult_context_make(ult_context_t* context, void* stack, size_t stack_size, ult_context_entry entry) {
+    uint32_t mxcsr;
+    uint16_t fpu_cw;
+
+    // the new thread inherits the floating point settings of its creator, like getcontext would do
+    __asm__ volatile ("stmxcsr %0" : "=m" (mxcsr));
+    __asm__ volatile ("fnstcw %0" : "=m" (fpu_cw));
+
+    // after the ret in ult_context_switch the stack pointer must be 16 byte aligned so the call in the trampoline respects the ABI
+    uintptr_t top = ((uintptr_t) stack + stack_size) & ~((uintptr_t) 15);
+    uint64_t* frame = (uint64_t*) (top - 80);
+
+    frame[0] = (uint64_t) mxcsr | ((uint64_t) fpu_cw << 32);
+    frame[1] = 0;                                   // r15
+    frame[2] = 0;                                   // r14
+    frame[3] = 0;                                   // r13
+    frame[4] = (uint64_t) (uintptr_t) entry;        // r12
+    frame[5] = 0;                                   // rbx
+    frame[6] = 0;                                   // rbp, zero terminates the frame chain for debuggers
+    frame[7] = (uint64_t) (uintptr_t) ult_context_trampoline;
+    frame[8] = 0;
+    frame[9] = 0;
+
+    context->sp = frame;
+}
+
+#elif defined(__aarch64__)
+
+// the suspended stack holds x19-x30, d8-d15 and fpcr (176 bytes, keeps sp 16 byte aligned)
+// x0 = from, x1 = to
+
+__asm__ (
+    ".text\n"
+    ".globl ult_context_switch\n"
+    ".type ult_context_switch, %function\n"
+    "ult_context_switch:\n"
+    "    sub sp, sp, #176\n"
+    "    stp x19, x20, [sp, #0]\n"
+    "    stp x21, x22, [sp, #16]\n"
+    "    stp x23, x24, [sp, #32]\n"
+    "    stp x25, x26, [sp, #48]\n"
+    "    stp x27, x28, [sp, #64]\n"
+    "    stp x29, x30, [sp, #80]\n"
+    "    stp d8, d9, [sp, #96]\n"
+    "    stp d10, d11, [sp, #112]\n"
+    "    stp d12, d13, [sp, #128]\n"
+    "    stp d14, d15, [sp, #144]\n"
+    "    mrs x9, fpcr\n"
+    "    str x9, [sp, #160]\n"
+    "    mov x9, sp\n"
+    "    str x9, [x0]\n"
+    "    ldr x9, [x1]\n"
+    "    mov sp, x9\n"
+    "    ldr x9, [sp, #160]\n"
+    "    msr fpcr, x9\n"
+    "    ldp x19, x20, [sp, #0]\n"
+    "    ldp x21, x22, [sp, #16]\n"
+    "    ldp x23, x24, [sp, #32]\n"
+    "    ldp x25, x26, [sp, #48]\n"
+    "    ldp x27, x28, [sp, #64]\n"
+    "    ldp x29, x30, [sp, #80]\n"
+    "    ldp d8, d9, [sp, #96]\n"
+    "    ldp d10, d11, [sp, #112]\n"
+    "    ldp d12, d13, [sp, #128]\n"
+    "    ldp d14, d15, [sp, #144]\n"
+    "    add sp, sp, #176\n"
+    "    ret\n"
+    ".size ult_context_switch, .-ult_context_switch\n"
+
+    // first 'return' of a new context lands here with the entry point in x19
+    ".type ult_context_trampoline, %function\n"
+    "ult_context_trampoline:\n"
+    "    blr x19\n"
+    "    brk #0\n"
+    ".size ult_context_trampoline, .-ult_context_trampoline\n"
+);
+
+extern void ult_context_trampoline(void);
+
+void ult_context_make(ult_context_t* context, void* stack, size_t stack_size, ult_context_entry entry) {
+    uint64_t fpcr;
+    __asm__ volatile ("mrs %0, fpcr" : "=r" (fpcr));
+
+    uintptr_t top = ((uintptr_t) stack + stack_size) & ~((uintptr_t) 15);
+    uint64_t* frame = (uint64_t*) (top - 176);
+
+    memset(frame, 0, 176);
+    frame[0]  = (uint64_t) (uintptr_t) entry;                   // x19
+    frame[11] = (uint64_t) (uintptr_t) ult_context_trampoline;  // x30 (lr)
+    frame[20] = fpcr;
+
+    context->sp = frame;
+}
+
+#endif
@@ -0,0 +1,141 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <errno.h>
+#include <string.h>
+
+#include "heap.h"
+#include "ult.h"
+
+#define INITIAL_HEAP_CAPACITY 64
+
+////////////////////// USER LEVEL THREAD MIN HEAP //////////////////////
+
+static inline uint64_t key(ult_heap_t* heap, ult_t* ult) {
+    return *(uint64_t*) ((char*) ult + heap->key_offset);
+}
+
+static inline size_t* position(ult_heap_t* heap, ult_t* ult) {
+    return (size_t*) ((char*) ult + heap->index_offset);
+}
+
+static inline void place(ult_heap_t* heap, size_t index, ult_t* ult) {
+    heap->items[index] = ult;
+    *position(heap, ult) = index;
+}
+
+static void sift_up(ult_heap_t* heap, size_t index) {
+    ult_t* ult = heap->items[index];
+
+    while (index > 0) {
+        size_t parent = (index - 1) / 2;
+
+        if (key(heap, heap->items[parent]) <= key(heap, ult)) {
+            break;
+        }
+
+        place(heap, index, heap->items[parent]);
+        index = parent;
+    }
+
+    place(heap, index, ult);
+}
+
+static void sift_down(ult_heap_t* heap, size_t index) {
+    ult_t* ult = heap->items[index];
+
+    while (1) {
+        size_t smallest = 2 * index + 1;
+
+        if (smallest >= heap->size) {
+            break;
+        }
+
+        if (smallest + 1 < heap->size && key(heap, heap->items[smallest + 1]) < key(heap, heap->items[smallest])) {
+            smallest += 1;
+        }
+
+        if (key(heap, ult) <= key(heap, heap->items[smallest])) {
+            break;
+        }
+
+        place(heap, index, heap->items[smallest]);
+        index = smallest;
+    }
+
+    place(heap, index, ult);
+}
+
+void init_ult_heap(ult_heap_t* heap) {
+    init_ult_heap_keyed(heap, offsetof(ult_t, wake_time), offsetof(ult_t, heap_index));
+}
+
+void init_ult_heap_keyed(ult_heap_t* heap, size_t key_offset, size_t index_offset) {
+    heap->items = NULL;
+    heap->size = 0;
+    heap->capacity = 0;
+    heap->key_offset = key_offset;
+    heap->index_offset = index_offset;
+}
+
+void ult_heap_push(ult_heap_t* heap, ult_t* ult) {
+    if (heap->size == heap->capacity) {
+        size_t new_capacity = heap->capacity == 0 ? INITIAL_HEAP_CAPACITY : heap->capacity * 2;
+        ult_t** new_items = (ult_t**) realloc(heap->items, new_capacity * sizeof(ult_t*));
+
+        if (new_items == NULL) {
+            BAIL("Grow heap");
+        }
+
+        heap->items = new_items;
+        heap->capacity = new_capacity;
+    }
+
+    heap->size += 1;
+    place(heap, heap->size - 1, ult);
+    sift_up(heap, heap->size - 1);
+}
+
+ult_t* ult_heap_top(ult_heap_t* heap) {
+    return heap->size > 0 ? heap->items[0] : NULL;
+}
+
+ult_t* ult_heap_pop(ult_heap_t* heap) {
+    if (heap->size == 0) {
+        return NULL;
+    }
+
+    ult_t* top = heap->items[0];
+    ult_heap_remove(heap, top);
+
+    return top;
+}
+
+void ult_heap_remove(ult_heap_t* heap, ult_t* ult) {
+    size_t index = *position(heap, ult);
+    ult_t* last = heap->items[heap->size - 1];
+
+    heap->size -= 1;
+    *position(heap, ult) = NOT_IN_HEAP;
+
+    if (index == heap->size) {
+        return; // the removed thread was the last one
+    }
+
+    // move the last thread in the hole and restore the order in whichever direction is broken
+    place(heap, index, last);
+
+    if (index > 0 && key(heap, heap->items[(index - 1) / 2]) > key(heap, last)) {
+        sift_up(heap, index);
+    }
+    else {
+        sift_down(heap, index);
+    }
+}
+
+void destroy_ult_heap(ult_heap_t* heap) {
+    free(heap->items);
+
+    heap->items = NULL;
+    heap->size = 0;
+    heap->capacity = 0;
+}
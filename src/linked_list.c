@@ -2,14 +2,79 @@
 
 ////////////////////// GENERIC LIST //////////////////////
 
+void init_node_pool(node_pool_t* pool, size_t nodes_per_chunk) {
+    pool->free_nodes = NULL;
+    pool->chunks = NULL;
+    pool->nodes_per_chunk = nodes_per_chunk > 0 ? nodes_per_chunk : 64;
+}
+
+void destroy_node_pool(node_pool_t* pool) {
+    node_pool_chunk_t* current = pool->chunks;
+
+    while (current != NULL) {
+        node_pool_chunk_t* temp = current;
+        current = current->next;
+        free(temp);
+    }
+
+    pool->free_nodes = NULL;
+    pool->chunks = NULL;
+}
+
+static generic_node_t* alloc_node(generic_linked_list_t* list) {
+    node_pool_t* pool = list->pool;
+
+    if (pool == NULL) {
+        return (generic_node_t*) malloc(sizeof(generic_node_t));
+    }
+
+    if (pool->free_nodes == NULL) {
+        // out of nodes, carve a new chunk
+        node_pool_chunk_t* chunk = (node_pool_chunk_t*) malloc(sizeof(node_pool_chunk_t) + pool->nodes_per_chunk * sizeof(generic_node_t));
+        if (chunk == NULL) {
+            return NULL;
+        }
+
+        chunk->next = pool->chunks;
+        pool->chunks = chunk;
+
+        for (size_t i = 0; i < pool->nodes_per_chunk; i++) {
+            chunk->nodes[i].next = pool->free_nodes;
+            pool->free_nodes = &(chunk->nodes[i]);
+        }
+    }
+
+    generic_node_t* node = pool->free_nodes;
+    pool->free_nodes = node->next;
+
+    return node;
+}
+
+static void free_node(generic_linked_list_t* list, generic_node_t* node) {
+    node_pool_t* pool = list->pool;
+
+    if (pool == NULL) {
+        free(node);
+        return;
+    }
+
+    node->next = pool->free_nodes;
+    pool->free_nodes = node;
+}
+
 void init_linked_list(generic_linked_list_t* list) {
+    init_linked_list_with_pool(list, NULL);
+}
+
+void init_linked_list_with_pool(generic_linked_list_t* list, node_pool_t* pool) {
     list->head = NULL;
     list->tail = NULL;
     list->size = 0;
+    list->pool = pool;
 }
 
 void insert_first(generic_linked_list_t* list, void* data) {
-    generic_node_t* new_node = (generic_node_t*) malloc(sizeof(generic_node_t));
+    generic_node_t* new_node = alloc_node(list);
     new_node->data = data;
     new_node->next = list->head;
     new_node->prev = NULL;
@@ -28,7 +93,7 @@ void insert_first(generic_linked_list_t* list, void* data) {
 }
 
 void insert_last(generic_linked_list_t* list, void* data) {
-    generic_node_t* new_node = (generic_node_t*)malloc(sizeof(generic_node_t));
+    generic_node_t* new_node = alloc_node(list);
     new_node->data = data;
     new_node->next = NULL;
     new_node->prev = list->tail;
@@ -75,7 +140,7 @@ void delete_node(generic_linked_list_t* list, generic_node_t* node) {
         list->tail = node->prev;
     }
 
-    free(node);
+    free_node(list, node);
 
     list->size -= 1;
 }
@@ -95,7 +160,7 @@ void delete_first(generic_linked_list_t* list) {
         list->tail = NULL;
     }
 
-    free(temp);
+    free_node(list, temp);
     list->size -= 1;
 }
 
@@ -114,7 +179,7 @@ void delete_last(generic_linked_list_t* list) {
         list->head = NULL; // list is now empty
     }
 
-    free(temp);
+    free_node(list, temp);
     list->size -= 1;
 }
 
@@ -148,7 +213,7 @@ int delete_by_condition(generic_linked_list_t* list, filter_func condition) {
                 
             }
 
-            free(current);
+            free_node(list, current);
             nodes_deleted += 1;
             list->size -= 1;
         }
@@ -195,7 +260,7 @@ void destroy_list(generic_linked_list_t* list) {
     while (current != NULL) {
         generic_node_t* temp = current;
         current = current->next;
-        free(temp);
+        free_node(list, temp);
     }
 
     list->head = NULL;
@@ -338,6 +403,86 @@ void destroy_ult_list(ult_linked_list_t* list) {
     list->size = 0;
 }
 
+////////////////////// INTRUSIVE USER LEVEL THREAD QUEUE //////////////////////
+
+void init_ult_link(ult_link_t* link, ult_t* ult) {
+    link->ult = ult;
+    link->next = NULL;
+    link->prev = NULL;
+}
+
+void init_ult_queue(ult_queue_t* queue) {
+    queue->head = NULL;
+    queue->tail = NULL;
+    queue->size = 0;
+}
+
+void ult_queue_push_first(ult_queue_t* queue, ult_link_t* link) {
+    link->next = queue->head;
+    link->prev = NULL;
+
+    if (queue->head != NULL) {
+        queue->head->prev = link;
+    }
+
+    queue->head = link;
+
+    if (queue->tail == NULL) { // empty queue
+        queue->tail = link;
+    }
+
+    queue->size += 1;
+}
+
+void ult_queue_push_last(ult_queue_t* queue, ult_link_t* link) {
+    link->next = NULL;
+    link->prev = queue->tail;
+
+    if (queue->tail != NULL) {
+        queue->tail->next = link;
+    }
+
+    queue->tail = link;
+
+    if (queue->head == NULL) { // empty queue
+        queue->head = link;
+    }
+
+    queue->size += 1;
+}
+
+void ult_queue_remove(ult_queue_t* queue, ult_link_t* link) {
+    if (link->prev != NULL) {
+        link->prev->next = link->next;
+    }
+    else {
+        queue->head = link->next;
+    }
+
+    if (link->next != NULL) {
+        link->next->prev = link->prev;
+    }
+    else {
+        queue->tail = link->prev;
+    }
+
+    link->next = NULL;
+    link->prev = NULL;
+
+    queue->size -= 1;
+}
+
+ult_t* ult_queue_pop_first(ult_queue_t* queue) {
+    if (queue->size == 0) {
+        return NULL;
+    }
+
+    ult_link_t* link = queue->head;
+    ult_queue_remove(queue, link);
+
+    return link->ult;
+}
+
 ////////////////////// MUTEX LIST //////////////////////
 
 void init_mutex_linked_list(mutex_linked_list_t* list) {
@@ -1,6 +1,14 @@
+#define _GNU_SOURCE // O_DIRECT
+
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include "ult.h"
 
@@ -286,11 +294,95 @@ void deadlock_test2() {
     ult_join(&deadlock_main, NULL);
 }
 
+///////////////// Deadlock avoidance test //////////////////
+
+#define AVOIDANCE_ROUNDS 100
+
+typedef struct avoidance_arg {
+    ult_mutex_t*    first;
+    ult_mutex_t*    second;
+    uint64_t        backoffs;   // how many times the second lock was refused
+} avoidance_arg;
+
+void* avoidance_worker(void* args) {
+    avoidance_arg* arg = (avoidance_arg*) args;
+
+    for (int i = 0; i < AVOIDANCE_ROUNDS; i++) {
+        while (1) {
+            ult_mutex_lock(arg->first);
+            ult_yield(); // let the neighbour take its first mutex too
+
+            if (ult_mutex_lock(arg->second) == 0) {
+                break;
+            }
+
+            // taking the second one would close the ring, give the first one back and try again a bit later
+            arg->backoffs += 1;
+            ult_mutex_unlock(arg->first);
+            ult_sleep(0, 10000 * (ult_get_id() % 8 + 1));
+        }
+
+        ult_mutex_unlock(arg->second);
+        ult_mutex_unlock(arg->first);
+    }
+
+    return NULL;
+}
+
+void* avoidance_self_join(void* thread) {
+    return (void*) (intptr_t) ult_join((ult_t*) thread, NULL);
+}
+
+// thread_num threads in a ring, every one locks its mutex and then the next one (the classic dining philosophers)
+// without the avoidance the ring deadlocks, with it the lock that would close the ring returns EDEADLK and the thread backs off
+void deadlock_avoidance_test(int thread_num) {
+    ult_t* threads = (ult_t*) malloc(thread_num * sizeof(ult_t));
+    ult_mutex_t* mutexes = (ult_mutex_t*) malloc(thread_num * sizeof(ult_mutex_t));
+    avoidance_arg* args = (avoidance_arg*) malloc(thread_num * sizeof(avoidance_arg));
+
+    ult_set_deadlock_avoidance(1);
+
+    for (int i = 0; i < thread_num; i++) {
+        ult_mutex_init(&mutexes[i]);
+    }
+
+    for (int i = 0; i < thread_num; i++) {
+        args[i].first = &mutexes[i];
+        args[i].second = &mutexes[(i + 1) % thread_num];
+        args[i].backoffs = 0;
+        ult_create(&threads[i], avoidance_worker, &args[i]);
+    }
+
+    uint64_t backoffs = 0;
+    for (int i = 0; i < thread_num; i++) {
+        ult_join(&threads[i], NULL);
+        backoffs += args[i].backoffs;
+    }
+
+    printf("deadlock avoidance: %d threads x %d rounds done, %lu locks refused\n", thread_num, AVOIDANCE_ROUNDS, backoffs);
+
+    // a thread joining itself is the shortest cycle
+    ult_t self;
+    void* result;
+    ult_create(&self, avoidance_self_join, &self);
+    ult_join(&self, &result);
+    printf("self join: %s\n", (intptr_t) result == EDEADLK ? "EDEADLK" : "not refused");
+
+    for (int i = 0; i < thread_num; i++) {
+        ult_mutex_destroy(&mutexes[i]);
+    }
+
+    ult_set_deadlock_avoidance(0);
+    free(args);
+    free(mutexes);
+    free(threads);
+}
 
 //////////////// Producer-Consumer ///////////////////
 
 typedef struct prod_cons_arg {
     generic_linked_list_t list;
+    node_pool_t pool;       // only this list uses it, the list and the pool are both protected by the mutex
     ult_mutex_t mutex;
     ult_cond_t  prod_cond;
     ult_cond_t  cons_cond;
@@ -304,10 +396,6 @@ void* producer(void* args) {
 
     const int to_add = 10;
 
-    ult_mutex_lock(&(arg->mutex));
-    arg->running_producers += 1;
-    ult_mutex_unlock(&(arg->mutex));
-
     for (uint64_t i = id * to_add; i < (id + 1) * to_add; i++) {
         ult_mutex_lock(&(arg->mutex));
 
@@ -357,10 +445,6 @@ void* consumer(void* args) {
     uint64_t val = 1;
     uint64_t id = ult_get_id();
 
-    ult_mutex_lock(&(arg->mutex));
-    arg->running_consumers += 1;
-    ult_mutex_unlock(&(arg->mutex));
-
     while (val != 0) {
         ult_mutex_lock(&(arg->mutex));
 
@@ -396,10 +480,12 @@ void producer_consumer(int producers, int consumers) {
     ult_t* threads = (ult_t*) malloc((producers + consumers) * sizeof(ult_t));
     prod_cons_arg arg;  
 
-    arg.running_consumers = 0;
-    arg.running_producers = 0;
+    // counted before the threads start, a thread that registered itself after the last producer finished would never get its end marker
+    arg.running_consumers = consumers;
+    arg.running_producers = producers;
 
-    init_linked_list(&(arg.list));
+    init_node_pool(&(arg.pool), 64);
+    init_linked_list_with_pool(&(arg.list), &(arg.pool));
     ult_mutex_init(&(arg.mutex));
     ult_cond_init(&(arg.prod_cond));
     ult_cond_init(&(arg.cons_cond));
@@ -417,6 +503,7 @@ void producer_consumer(int producers, int consumers) {
     }
 
     destroy_list(&(arg.list));
+    destroy_node_pool(&(arg.pool));
     ult_mutex_destroy(&(arg.mutex));
     ult_cond_destroy(&(arg.prod_cond));
     ult_cond_destroy(&(arg.cons_cond));
@@ -471,6 +558,1761 @@ void prod_cons_deadlock() {
     ult_cond_destroy(&(arg.cond));
 }
 
+//////////////////////////// I/O ///////////////////////////////////
+
+#define IO_SOCKET_PATH "/tmp/ult_io_test.sock"
+#define IO_MESSAGES 100
+
+void* echo_handler(void* arg) {
+    int fd = (int) (intptr_t) arg;
+    char buffer[64];
+    ssize_t length;
+
+    while ((length = ult_read(fd, buffer, sizeof(buffer))) > 0) {
+        ult_write(fd, buffer, length);
+    }
+
+    close(fd);
+    return NULL;
+}
+
+// one thread per connection
+void* echo_server(void* arg) {
+    int clients = (int) (intptr_t) arg;
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un address = { .sun_family = AF_UNIX, .sun_path = IO_SOCKET_PATH };
+
+    unlink(IO_SOCKET_PATH);
+    if (bind(listener, (struct sockaddr*) &address, sizeof(address)) == -1 || listen(listener, clients) == -1) {
+        perror("listen");
+        return NULL;
+    }
+
+    ult_t* handlers = (ult_t*) malloc(clients * sizeof(ult_t));
+
+    for (int i = 0; i < clients; i++) {
+        int connection = ult_accept(listener, NULL, NULL);
+        ult_create(&handlers[i], echo_handler, (void*) (intptr_t) connection);
+    }
+
+    for (int i = 0; i < clients; i++) {
+        ult_join(&handlers[i], NULL);
+    }
+
+    close(listener);
+    unlink(IO_SOCKET_PATH);
+    free(handlers);
+
+    return NULL;
+}
+
+void* echo_client(void* arg) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un address = { .sun_family = AF_UNIX, .sun_path = IO_SOCKET_PATH };
+    uint64_t errors = 0;
+
+    while (ult_connect(fd, (struct sockaddr*) &address, sizeof(address)) == -1) {
+        ult_sleep(0, 1000000); // the server is not listening yet
+    }
+
+    for (uint64_t i = 0; i < IO_MESSAGES; i++) {
+        uint64_t sent = ult_get_id() * 1000 + i, received = 0;
+
+        ult_write(fd, &sent, sizeof(sent));
+        if (ult_read(fd, &received, sizeof(received)) != sizeof(received) || received != sent) {
+            errors += 1;
+        }
+    }
+
+    close(fd);
+    return (void*) errors;
+}
+
+void* pipe_writer(void* arg) {
+    int fd = (int) (intptr_t) arg;
+    char message[] = "hello";
+
+    ult_sleep(0, 200000000); // the reader blocks meanwhile, the other threads keep running
+    ult_write(fd, message, sizeof(message));
+
+    return NULL;
+}
+
+void io_test(int clients) {
+    int pipe_fds[2];
+    char buffer[16] = {0};
+    ult_t writer, server;
+    ult_t* client_threads = (ult_t*) malloc(clients * sizeof(ult_t));
+
+    if (pipe(pipe_fds) == -1) {
+        perror("pipe");
+        return;
+    }
+
+    printf("wait with timeout: %d (0 means timed out)\n", ult_wait_fd(pipe_fds[0], POLLIN, 50)); fflush(NULL);
+
+    ult_create(&writer, pipe_writer, (void*) (intptr_t) pipe_fds[1]);
+    ult_read(pipe_fds[0], buffer, sizeof(buffer));
+    printf("read from pipe: %s\n", buffer); fflush(NULL);
+    ult_join(&writer, NULL);
+
+    ult_create(&server, echo_server, (void*) (intptr_t) clients);
+    for (int i = 0; i < clients; i++) {
+        ult_create(&client_threads[i], echo_client, NULL);
+    }
+
+    uint64_t errors = 0;
+    for (int i = 0; i < clients; i++) {
+        void* client_errors;
+        ult_join(&client_threads[i], &client_errors);
+        errors += (uint64_t) client_errors;
+    }
+    ult_join(&server, NULL);
+
+    printf("%d clients exchanged %d messages each, %lu errors\n", clients, IO_MESSAGES, errors); fflush(NULL);
+
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    free(client_threads);
+}
+
+//////////////////////////// Context switch benchmark ///////////////////////////////////
+
+#ifndef SWITCH_ROUNDS
+#define SWITCH_ROUNDS 1000000
+#endif
+
+void* yield_worker(void* arg) {
+    for (uint64_t i = 0; i < SWITCH_ROUNDS; i++) {
+        ult_yield();
+    }
+
+    return NULL;
+}
+
+// two threads yield to each other, main waits in join so every yield is a switch
+void context_switch_benchmark() {
+    ult_t t[2];
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (int i = 0; i < 2; i++) {
+        ult_create(&t[i], yield_worker, NULL);
+    }
+
+    for (int i = 0; i < 2; i++) {
+        ult_join(&t[i], NULL);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double elapsed_ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+    printf("%d switches, %.1lf ns per switch\n", 2 * SWITCH_ROUNDS, elapsed_ns / (2 * SWITCH_ROUNDS)); fflush(NULL);
+}
+
+volatile int benchmark_running = 1;
+
+void* idle_sleeper(void* arg) {
+    while (benchmark_running) {
+        ult_sleep(1, 0);
+    }
+
+    return NULL;
+}
+
+// the same benchmark with a lot of sleeping threads around, their number should not change the cost of a switch
+void sleepers_switch_benchmark(int sleepers) {
+    ult_t* threads = (ult_t*) malloc(sleepers * sizeof(ult_t));
+
+    for (int i = 0; i < sleepers; i++) {
+        ult_create(&threads[i], idle_sleeper, NULL);
+    }
+
+    ult_sleep(0, 10000000); // let all of them fall asleep
+    context_switch_benchmark();
+
+    benchmark_running = 0;
+    for (int i = 0; i < sleepers; i++) {
+        ult_join(&threads[i], NULL);
+    }
+
+    free(threads);
+}
+
+//////////////////////////// CPU scaling benchmark ///////////////////////////////////
+
+void* cpu_worker(void* arg) {
+    do_long_work((uint64_t) arg);
+    return NULL;
+}
+
+// CPU bound threads, the time should drop with the number of carriers (see ult_set_concurrency)
+void cpu_scaling_benchmark(int thread_num) {
+    ult_t* threads = (ult_t*) malloc(thread_num * sizeof(ult_t));
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (int i = 0; i < thread_num; i++) {
+        ult_create(&threads[i], cpu_worker, (void*) 1);
+    }
+
+    for (int i = 0; i < thread_num; i++) {
+        ult_join(&threads[i], NULL);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%d threads on %u carriers: %.3lfs\n", thread_num, ult_get_concurrency(), elapsed); fflush(NULL);
+
+    free(threads);
+}
+
+//////////////////////////// Stacks ///////////////////////////////////
+
+uint64_t recurse(uint64_t depth) {
+    volatile char frame[256];
+    frame[0] = (char) depth;
+
+    if (depth == 0) {
+        return frame[0];
+    }
+
+    return recurse(depth - 1) + frame[0];
+}
+
+void* stack_worker(void* arg) {
+    uint64_t depth = (uint64_t) arg;
+    printf("[%lu] recursing %lu levels\n", ult_get_id(), depth); fflush(NULL);
+    recurse(depth);
+    return NULL;
+}
+
+long resident_kib() {
+    long pages = 0, resident = 0;
+    FILE* statm = fopen("/proc/self/statm", "r");
+
+    if (statm != NULL) {
+        if (fscanf(statm, "%ld %ld", &pages, &resident) != 2) {
+            resident = 0;
+        }
+        fclose(statm);
+    }
+
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// threads with different stacks: a small mapped one, one on a user buffer and a big one for deep recursion
+// then a lot of idle threads, only the touched pages of their stacks should be resident
+void stack_test(int thread_num) {
+    static char buffer[0x8000];
+    ult_t small, user, big;
+    ult_attr_t attr;
+
+    ult_attr_init(&attr);
+    ult_attr_setstacksize(&attr, MIN_ULT_STACK_SIZE);
+    ult_create_with_attr(&small, &attr, stack_worker, (void*) 8);
+
+    ult_attr_setstack(&attr, buffer, sizeof(buffer));
+    ult_create_with_attr(&user, &attr, stack_worker, (void*) 64);
+
+    ult_attr_setstacksize(&attr, 0x100000);
+    ult_create_with_attr(&big, &attr, stack_worker, (void*) 2048);
+
+    ult_join(&small, NULL);
+    ult_join(&user, NULL);
+    ult_join(&big, NULL);
+
+    ult_t* threads = (ult_t*) malloc(thread_num * sizeof(ult_t));
+    long before = resident_kib();
+
+    ult_attr_setstacksize(&attr, 0x100000);
+    for (int i = 0; i < thread_num; i++) {
+        ult_create_with_attr(&threads[i], &attr, idle_sleeper, NULL);
+    }
+
+    ult_sleep(0, 100000000); // let all of them run once
+    printf("%d threads with 1 MiB stacks: %ld KiB resident\n", thread_num, resident_kib() - before); fflush(NULL);
+
+    benchmark_running = 0;
+    for (int i = 0; i < thread_num; i++) {
+        ult_join(&threads[i], NULL);
+    }
+
+    free(threads);
+}
+
+//////////////////////////// Create / join benchmark ///////////////////////////////////
+
+#ifndef CREATE_ROUNDS
+#define CREATE_ROUNDS 100000
+#endif
+
+void* empty_worker(void* arg) {
+    return arg;
+}
+
+// short lived threads created and joined in batches
+void create_join_benchmark() {
+    const int batch = 64;
+    ult_t threads[64];
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (int i = 0; i < CREATE_ROUNDS; i += batch) {
+        for (int j = 0; j < batch; j++) {
+            ult_create(&threads[j], empty_worker, NULL);
+        }
+
+        for (int j = 0; j < batch; j++) {
+            ult_join(&threads[j], NULL);
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%d creates, %.0lf creates/sec\n", CREATE_ROUNDS, CREATE_ROUNDS / elapsed); fflush(NULL);
+}
+
+//////////////////////////// Mutex benchmark ///////////////////////////////////
+
+#ifndef MUTEX_ROUNDS
+#define MUTEX_ROUNDS 10000000
+#endif
+
+typedef struct mutex_bench_arg {
+    ult_mutex_t mutex;
+    uint64_t    counter;
+    uint64_t    rounds;
+} mutex_bench_arg;
+
+void* mutex_bench_worker(void* args) {
+    mutex_bench_arg* arg = (mutex_bench_arg*) args;
+
+    for (uint64_t i = 0; i < arg->rounds; i++) {
+        ult_mutex_lock(&(arg->mutex));
+        arg->counter += 1;
+        ult_mutex_unlock(&(arg->mutex));
+    }
+
+    return NULL;
+}
+
+double elapsed_ns(struct timespec* start, struct timespec* end) {
+    return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+// uncontended lock / unlock and trylock / unlock pairs from one thread, then thread_num threads fighting for the same mutex
+void mutex_benchmark(int thread_num) {
+    mutex_bench_arg arg;
+    struct timespec start, end;
+
+    ult_mutex_init(&(arg.mutex));
+    arg.counter = 0;
+    arg.rounds = MUTEX_ROUNDS;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    mutex_bench_worker(&arg);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("uncontended lock + unlock: %.1lf ns\n", elapsed_ns(&start, &end) / MUTEX_ROUNDS); fflush(NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (uint64_t i = 0; i < MUTEX_ROUNDS; i++) {
+        if (ult_mutex_trylock(&(arg.mutex)) == 0) {
+            ult_mutex_unlock(&(arg.mutex));
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("uncontended trylock + unlock: %.1lf ns\n", elapsed_ns(&start, &end) / MUTEX_ROUNDS); fflush(NULL);
+
+    ult_t* threads = (ult_t*) malloc(thread_num * sizeof(ult_t));
+    arg.counter = 0;
+    arg.rounds = MUTEX_ROUNDS / 10;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < thread_num; i++) {
+        ult_create(&threads[i], mutex_bench_worker, &arg);
+    }
+    for (int i = 0; i < thread_num; i++) {
+        ult_join(&threads[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    printf("%d threads: %.1lf ns per lock + unlock, counter %lu (expected %lu)\n", thread_num,
+        elapsed_ns(&start, &end) / (thread_num * arg.rounds), arg.counter, thread_num * arg.rounds); fflush(NULL);
+
+    ult_mutex_destroy(&(arg.mutex));
+    free(threads);
+}
+
+//////////////////////////// List node pool benchmark ///////////////////////////////////
+
+#ifndef LIST_ROUNDS
+#define LIST_ROUNDS 10000000
+#endif
+
+// queue like usage: the list stays around a constant size while elements are added at the back and removed from the front
+double list_ops_per_sec(generic_linked_list_t* list) {
+    struct timespec start, end;
+    const uint64_t batch = 16;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (uint64_t i = 0; i < LIST_ROUNDS; i += batch) {
+        for (uint64_t j = 0; j < batch; j++) {
+            insert_last(list, (void*) (i + j));
+        }
+
+        for (uint64_t j = 0; j < batch; j++) {
+            delete_first(list);
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    return 2 * LIST_ROUNDS / elapsed;
+}
+
+void list_pool_benchmark() {
+    generic_linked_list_t list;
+    node_pool_t pool;
+
+    init_linked_list(&list);
+    printf("malloc: %.0lf ops/sec\n", list_ops_per_sec(&list)); fflush(NULL);
+    destroy_list(&list);
+
+    init_node_pool(&pool, 64);
+    init_linked_list_with_pool(&list, &pool);
+    printf("pool:   %.0lf ops/sec\n", list_ops_per_sec(&list)); fflush(NULL);
+    destroy_list(&list);
+    destroy_node_pool(&pool);
+}
+
+//////////////////////////// File io benchmark ///////////////////////////////////
+
+#ifndef FILE_IO_SIZE
+#define FILE_IO_SIZE (64 << 20)
+#endif
+
+#ifndef FILE_IO_READS
+#define FILE_IO_READS 20000 // per thread, from the page cache
+#endif
+
+#ifndef FILE_IO_DIRECT_READS
+#define FILE_IO_DIRECT_READS 200 // per thread, from the device
+#endif
+
+#define FILE_IO_BLOCK 4096
+
+typedef struct file_io_arg {
+    int         fd;
+    int         blocking;   // plain pread instead of ult_pread
+    int         reads;
+    uint64_t    seed;
+    uint64_t    bytes;
+} file_io_arg;
+
+void* file_io_worker(void* args) {
+    file_io_arg* arg = (file_io_arg*) args;
+    char* buffer = (char*) aligned_alloc(FILE_IO_BLOCK, FILE_IO_BLOCK); // O_DIRECT needs aligned buffers
+
+    for (int i = 0; i < arg->reads; i++) {
+        // xorshift, every thread reads its own sequence of random blocks
+        arg->seed ^= arg->seed << 13;
+        arg->seed ^= arg->seed >> 7;
+        arg->seed ^= arg->seed << 17;
+        off_t offset = (off_t) (arg->seed % (FILE_IO_SIZE / FILE_IO_BLOCK)) * FILE_IO_BLOCK;
+
+        ssize_t result = arg->blocking ? pread(arg->fd, buffer, FILE_IO_BLOCK, offset) : ult_pread(arg->fd, buffer, FILE_IO_BLOCK, offset);
+        if (result != FILE_IO_BLOCK) {
+            printf("read failed: %ld\n", result); fflush(NULL);
+            break;
+        }
+
+        arg->bytes += result;
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+double file_io_run(int fd, int thread_num, int blocking, int reads) {
+    ult_t* threads = (ult_t*) malloc(thread_num * sizeof(ult_t));
+    file_io_arg* args = (file_io_arg*) malloc(thread_num * sizeof(file_io_arg));
+    struct timespec start, end;
+    uint64_t bytes = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < thread_num; i++) {
+        args[i] = (file_io_arg) { .fd = fd, .blocking = blocking, .reads = reads, .seed = 88172645463325252ull + i, .bytes = 0 };
+        ult_create(&threads[i], file_io_worker, &args[i]);
+    }
+    for (int i = 0; i < thread_num; i++) {
+        ult_join(&threads[i], NULL);
+        bytes += args[i].bytes;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    free(threads);
+    free(args);
+
+    return bytes / (elapsed_ns(&start, &end) / 1e9) / (1 << 20);
+}
+
+// random 4 KiB reads from a file by thread_num threads, with the blocking pread (which stalls the carrier) and with ult_pread
+// the file is written with ult_pwrite first, so the first round reads from the page cache and shows the cost of the calls,
+// the second round opens it with O_DIRECT (if the file system allows it) and shows what happens when the reads wait for the device
+void file_io_benchmark(int thread_num) {
+    char path[] = "/var/tmp/ult_file_io_XXXXXX"; // /tmp is often a tmpfs, without O_DIRECT
+    int fd = mkstemp(path);
+    if (fd == -1) {
+        printf("mkstemp failed\n"); fflush(NULL);
+        return;
+    }
+    close(fd);
+
+    fd = ult_openat(AT_FDCWD, path, O_RDWR, 0);
+    int direct_fd = ult_openat(AT_FDCWD, path, O_RDONLY | O_DIRECT, 0);
+    unlink(path);
+    if (fd == -1) {
+        printf("ult_openat failed\n"); fflush(NULL);
+        return;
+    }
+
+    char* block = (char*) malloc(1 << 20);
+    memset(block, 'x', 1 << 20);
+    for (off_t offset = 0; offset < FILE_IO_SIZE; offset += 1 << 20) {
+        if (ult_pwrite(fd, block, 1 << 20, offset) != 1 << 20) {
+            printf("ult_pwrite failed\n"); fflush(NULL);
+        }
+    }
+    free(block);
+
+    if (ult_fsync(fd) != 0) {
+        printf("ult_fsync failed\n"); fflush(NULL);
+    }
+
+    const char* engine = ult_get_io_engine() == ULT_IO_URING ? "io_uring" : "helper threads";
+    double blocking = file_io_run(fd, thread_num, 1, FILE_IO_READS);
+    double engine_rate = file_io_run(fd, thread_num, 0, FILE_IO_READS);
+
+    printf("%d threads, %u carriers, cached: blocking pread %.0lf MiB/s, ult_pread (%s) %.0lf MiB/s\n",
+        thread_num, ult_get_concurrency(), blocking, engine, engine_rate); fflush(NULL);
+
+    if (direct_fd != -1) {
+        blocking = file_io_run(direct_fd, thread_num, 1, FILE_IO_DIRECT_READS);
+        engine_rate = file_io_run(direct_fd, thread_num, 0, FILE_IO_DIRECT_READS);
+
+        printf("%d threads, %u carriers, O_DIRECT: blocking pread %.0lf MiB/s, ult_pread (%s) %.0lf MiB/s\n",
+            thread_num, ult_get_concurrency(), blocking, engine, engine_rate); fflush(NULL);
+
+        close(direct_fd);
+    }
+
+    close(fd);
+}
+
+//////////////////////////// Priority test ///////////////////////////////////
+
+#define PRIORITY_ROUNDS 20
+
+volatile int priority_stop = 0;
+
+void* batch_worker(void* arg) {
+    uint64_t* progress = (uint64_t*) arg;
+
+    while (!priority_stop) {
+        do_work(1000);
+        *progress += 1;
+    }
+
+    return NULL;
+}
+
+// sleeps 1 ms PRIORITY_ROUNDS times and returns the average delay (in microseconds) between the wake up time and actually running
+void* latency_worker(void* arg) {
+    struct timespec start, end;
+    double* late_us = (double*) arg;
+
+    for (int i = 0; i < PRIORITY_ROUNDS; i++) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        ult_sleep(0, 1000000);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        *late_us += (elapsed_ns(&start, &end) - 1000000) / 1000 / PRIORITY_ROUNDS;
+    }
+
+    return NULL;
+}
+
+// batch_num CPU bound threads with the default priority, a thread that wakes up every millisecond and a thread with the lowest priority
+// the latency of the waking thread is measured with the default priority and with the highest one
+// the lowest priority thread only makes progress because of aging
+void priority_test(int batch_num) {
+    ult_t* threads = (ult_t*) malloc(batch_num * sizeof(ult_t));
+    uint64_t* progress = (uint64_t*) calloc(batch_num + 1, sizeof(uint64_t));
+    ult_t latency_thread, low_thread;
+    ult_attr_t attr;
+
+    ult_attr_init(&attr);
+
+    for (int i = 0; i < batch_num; i++) {
+        ult_create_with_attr(&threads[i], &attr, batch_worker, &progress[i]);
+    }
+
+    ult_attr_setpriority(&attr, ULT_PRIORITY_MIN);
+    ult_create_with_attr(&low_thread, &attr, batch_worker, &progress[batch_num]);
+
+    // the main thread waits in join, it doesn't compete with the workers
+    for (int priority = ULT_PRIORITY_DEFAULT; priority <= ULT_PRIORITY_MAX; priority += ULT_PRIORITY_MAX - ULT_PRIORITY_DEFAULT) {
+        double late_us = 0;
+
+        ult_attr_setpriority(&attr, priority);
+        ult_create_with_attr(&latency_thread, &attr, latency_worker, &late_us);
+        ult_join(&latency_thread, NULL);
+
+        printf("%d batch threads, wake up thread with priority %d: %.0lf us late on average\n", batch_num, priority, late_us); fflush(NULL);
+    }
+
+    priority_stop = 1;
+    for (int i = 0; i < batch_num; i++) {
+        ult_join(&threads[i], NULL);
+    }
+    ult_join(&low_thread, NULL);
+
+    printf("progress of a batch thread: %lu, of the lowest priority thread: %lu\n", progress[0], progress[batch_num]); fflush(NULL);
+
+    free(threads);
+    free(progress);
+}
+
+//////////////////////////// Fair policy test ///////////////////////////////////
+
+#define FAIR_TEST_SECONDS 2
+
+typedef struct fair_arg {
+    uint64_t    progress;
+    int         interactive;    // works a little and sleeps a little, instead of running all the time
+} fair_arg;
+
+void* fair_worker(void* args) {
+    fair_arg* arg = (fair_arg*) args;
+
+    while (!priority_stop) {
+        do_work(1000);
+        arg->progress += 1;
+
+        if (arg->interactive && arg->progress % 10 == 0) {
+            ult_sleep(0, 100000);
+        }
+    }
+
+    return NULL;
+}
+
+// hogs CPU bound threads, half of them with twice the default weight, and a thread that sleeps 100 us after every few units of work
+// with the fair policy (ult_set_sched_policy(ULT_SCHED_FAIR) at the start of main) the heavy threads get twice the cpu time
+// and the sleeping thread gets the cpu as soon as it wakes up, with the default policy all of them wait for their turn in the same queue
+void fair_test(int hogs) {
+    ult_t* threads = (ult_t*) malloc((hogs + 1) * sizeof(ult_t));
+    fair_arg* args = (fair_arg*) calloc(hogs + 1, sizeof(fair_arg));
+    ult_attr_t attr;
+
+    priority_stop = 0;
+
+    for (int i = 0; i <= hogs; i++) {
+        ult_attr_init(&attr);
+        ult_attr_setweight(&attr, i < hogs / 2 ? 2 * ULT_WEIGHT_DEFAULT : ULT_WEIGHT_DEFAULT);
+
+        args[i].interactive = i == hogs;
+        ult_create_with_attr(&threads[i], &attr, fair_worker, &args[i]);
+    }
+
+    ult_sleep(FAIR_TEST_SECONDS, 0);
+    priority_stop = 1;
+
+    uint64_t heavy = 0, light = 0;
+    for (int i = 0; i <= hogs; i++) {
+        ult_join(&threads[i], NULL);
+
+        if (i < hogs / 2) {
+            heavy += args[i].progress;
+        }
+        else if (i < hogs) {
+            light += args[i].progress;
+        }
+    }
+
+    printf("%s policy: weight %d threads %lu, weight %d threads %lu (ratio %.2lf), sleeping thread %lu\n",
+        ult_get_sched_policy() == ULT_SCHED_FAIR ? "fair" : "priority",
+        2 * ULT_WEIGHT_DEFAULT, heavy / (hogs / 2), ULT_WEIGHT_DEFAULT, light / (hogs - hogs / 2),
+        (double) heavy / (hogs / 2) / (light / (hogs - hogs / 2)), args[hogs].progress); fflush(NULL);
+
+    free(threads);
+    free(args);
+}
+
+//////////////////////////// Time slice test ///////////////////////////////////
+
+#define SLICE_TEST_NS 1000000000 // how long every thread runs
+
+typedef struct slice_arg {
+    uint64_t    progress;
+    double      max_gap_us; // the longest time the thread didn't run
+} slice_arg;
+
+void* slice_worker(void* args) {
+    slice_arg* arg = (slice_arg*) args;
+    struct timespec last, now, start;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    last = start;
+
+    // every thread stops by itself, a sleeping main thread would need the timer too
+    while (elapsed_ns(&start, &last) < SLICE_TEST_NS) {
+        do_work(100);
+        arg->progress += 1;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        double gap_us = elapsed_ns(&last, &now) / 1000;
+        if (gap_us > arg->max_gap_us) {
+            arg->max_gap_us = gap_us;
+        }
+        last = now;
+    }
+
+    return NULL;
+}
+
+// runs hogs CPU bound threads with a few time slices, a shorter slice means a shorter wait for the cpu and more switches
+// with a single thread the timer is not armed at all, its progress doesn't depend on the time slice
+void time_slice_test(int hogs) {
+    ult_t* threads = (ult_t*) malloc(hogs * sizeof(ult_t));
+    slice_arg* args = (slice_arg*) malloc(hogs * sizeof(slice_arg));
+    uint64_t slices[] = { ULT_TIME_SLICE_MIN_NS, ULT_TIME_SLICE_DEFAULT_NS, 10 * ULT_TIME_SLICE_DEFAULT_NS };
+    uint64_t old_slice = ult_get_time_slice();
+
+    for (int s = 0; s < sizeof(slices) / sizeof(slices[0]); s++) {
+        ult_set_time_slice(slices[s]);
+
+        for (int count = 1; count <= hogs; count = count == 1 ? hogs : hogs + 1) {
+            memset(args, 0, hogs * sizeof(slice_arg));
+
+            for (int i = 0; i < count; i++) {
+                ult_create(&threads[i], slice_worker, &args[i]);
+            }
+
+            uint64_t progress = 0;
+            double max_gap_us = 0;
+            for (int i = 0; i < count; i++) {
+                ult_join(&threads[i], NULL);
+                progress += args[i].progress;
+                max_gap_us += args[i].max_gap_us / count;
+            }
+
+            printf("time slice %lu us, %d threads: %lu units of work, longest wait for the cpu %.0lf us on average\n",
+                slices[s] / 1000, count, progress, max_gap_us); fflush(NULL);
+        }
+    }
+
+    ult_set_time_slice(old_slice);
+
+    free(threads);
+    free(args);
+}
+
+//////////////////////////// Stats test ///////////////////////////////////
+
+#define STATS_ROUNDS 200
+
+void* stats_worker(void* args) {
+    mutex_bench_arg* arg = (mutex_bench_arg*) args;
+
+    for (uint64_t i = 0; i < STATS_ROUNDS; i++) {
+        ult_mutex_lock(&(arg->mutex));
+        do_work(100000); // long enough to be preempted with the mutex held now and then
+        arg->counter += 1;
+        ult_mutex_unlock(&(arg->mutex));
+
+        if (i % 10 == 0) {
+            ult_sleep(0, 100000);
+        }
+        else {
+            do_work(100000);
+        }
+    }
+
+    return NULL;
+}
+
+void print_stats(const char* name, ult_stats_t* stats) {
+    printf("%s: ran %.2lf ms, %lu voluntary / %lu involuntary switches, %lu wakeups, blocked on mutex %.2lf ms, cond %.2lf ms, join %.2lf ms, sleep %.2lf ms, io %.2lf ms, rwlock %.2lf ms, sync %.2lf ms, chan %.2lf ms, park %.2lf ms\n",
+        name, stats->run_ns / 1e6, stats->voluntary_switches, stats->involuntary_switches, stats->wakeups,
+        stats->blocked_ns[ULT_BLOCK_MUTEX] / 1e6, stats->blocked_ns[ULT_BLOCK_COND] / 1e6, stats->blocked_ns[ULT_BLOCK_JOIN] / 1e6,
+        stats->blocked_ns[ULT_BLOCK_SLEEP] / 1e6, stats->blocked_ns[ULT_BLOCK_IO] / 1e6, stats->blocked_ns[ULT_BLOCK_RWLOCK] / 1e6,
+        stats->blocked_ns[ULT_BLOCK_SYNC] / 1e6, stats->blocked_ns[ULT_BLOCK_CHAN] / 1e6, stats->blocked_ns[ULT_BLOCK_PARK] / 1e6); fflush(NULL);
+}
+
+// thread_num threads sharing a mutex, working and sleeping, the stats of one of them and of the whole runtime
+void stats_test(int thread_num) {
+    ult_t* threads = (ult_t*) malloc(thread_num * sizeof(ult_t));
+    mutex_bench_arg arg;
+    ult_stats_t stats;
+
+    ult_mutex_init(&(arg.mutex));
+    arg.counter = 0;
+
+    for (int i = 0; i < thread_num; i++) {
+        ult_create(&threads[i], stats_worker, &arg);
+    }
+    for (int i = 0; i < thread_num; i++) {
+        ult_join(&threads[i], NULL);
+    }
+
+    // the counters stay in the thread structure after join
+    ult_get_stats(&threads[0], &stats);
+    print_stats("first worker", &stats);
+
+    ult_get_stats(NULL, &stats);
+    print_stats("main thread", &stats);
+
+    ult_get_runtime_stats(&stats);
+    print_stats("all threads", &stats);
+
+    ult_mutex_destroy(&(arg.mutex));
+    free(threads);
+}
+
+//////////////////////////// Lock profiler test ///////////////////////////////////
+
+#define PROFILE_ROUNDS 2000
+#define PROFILE_SAMPLE_PERIOD 4
+
+typedef struct profile_arg {
+    ult_mutex_t hot;        // held long, by every thread
+    ult_mutex_t cold;       // held briefly
+    ult_mutex_t queue_lock;
+    ult_cond_t  queue_cond;
+    uint64_t    queued;
+    uint64_t    items;      // how many the consumer takes
+} profile_arg;
+
+void* profile_worker(void* args) {
+    profile_arg* arg = (profile_arg*) args;
+
+    for (int i = 0; i < PROFILE_ROUNDS; i++) {
+        ult_mutex_lock(&(arg->hot));
+        do_work(10000);
+        ult_mutex_unlock(&(arg->hot));
+
+        ult_mutex_lock(&(arg->cold));
+        ult_mutex_unlock(&(arg->cold));
+
+        if (i % 100 == 0) {
+            ult_mutex_lock(&(arg->queue_lock));
+            arg->queued += 1;
+            ult_cond_signal(&(arg->queue_cond));
+            ult_mutex_unlock(&(arg->queue_lock));
+        }
+    }
+
+    return NULL;
+}
+
+void* profile_consumer(void* args) {
+    profile_arg* arg = (profile_arg*) args;
+
+    ult_mutex_lock(&(arg->queue_lock));
+    for (uint64_t taken = 0; taken < arg->items; taken++) {
+        while (arg->queued == 0) {
+            ult_cond_wait(&(arg->queue_cond), &(arg->queue_lock));
+        }
+        arg->queued -= 1;
+    }
+    ult_mutex_unlock(&(arg->queue_lock));
+
+    return NULL;
+}
+
+// thread_num threads fighting for a mutex they hold long, taking another one briefly and feeding a consumer through a cond
+// the report ranks the mutexes by the time the threads waited for them
+void lock_profile_test(int thread_num) {
+    ult_t* threads = (ult_t*) malloc(thread_num * sizeof(ult_t));
+    ult_t consumer;
+    profile_arg arg;
+
+    ult_set_lock_profiling(PROFILE_SAMPLE_PERIOD);
+
+    ult_mutex_init(&(arg.hot));
+    ult_mutex_init(&(arg.cold));
+    ult_mutex_init(&(arg.queue_lock));
+    ult_cond_init(&(arg.queue_cond));
+
+    arg.queued = 0;
+    arg.items = (uint64_t) thread_num * (PROFILE_ROUNDS / 100);
+    ult_create(&consumer, profile_consumer, &arg);
+
+    for (int i = 0; i < thread_num; i++) {
+        ult_create(&threads[i], profile_worker, &arg);
+    }
+    for (int i = 0; i < thread_num; i++) {
+        ult_join(&threads[i], NULL);
+    }
+    ult_join(&consumer, NULL);
+
+    ult_print_lock_report(10);
+
+    ult_cond_destroy(&(arg.queue_cond));
+    ult_mutex_destroy(&(arg.queue_lock));
+    ult_mutex_destroy(&(arg.cold));
+    ult_mutex_destroy(&(arg.hot));
+
+    ult_set_lock_profiling(0);
+    free(threads);
+}
+
+//////////////////////////// Trace test ///////////////////////////////////
+
+#define TRACE_EVENTS 65536
+#define TRACE_PATH "/tmp/ult_trace.json"
+
+// the lock profiler workload with the event trace on, the file opens in chrome://tracing or ui.perfetto.dev
+void trace_test(int thread_num) {
+    ult_t* threads = (ult_t*) malloc(thread_num * sizeof(ult_t));
+    ult_t consumer;
+    profile_arg arg;
+
+    if (ult_trace_start(TRACE_EVENTS) != 0) {
+        printf("Couldn't start the trace\n");
+        free(threads);
+        return;
+    }
+
+    ult_mutex_init(&(arg.hot));
+    ult_mutex_init(&(arg.cold));
+    ult_mutex_init(&(arg.queue_lock));
+    ult_cond_init(&(arg.queue_cond));
+
+    arg.queued = 0;
+    arg.items = (uint64_t) thread_num * (PROFILE_ROUNDS / 100);
+    ult_create(&consumer, profile_consumer, &arg);
+
+    for (int i = 0; i < thread_num; i++) {
+        ult_create(&threads[i], profile_worker, &arg);
+    }
+    for (int i = 0; i < thread_num; i++) {
+        ult_join(&threads[i], NULL);
+    }
+    ult_join(&consumer, NULL);
+
+    if (ult_trace_dump(TRACE_PATH) != 0) {
+        printf("Couldn't write %s\n", TRACE_PATH);
+    }
+    else {
+        printf("Trace written to %s\n", TRACE_PATH);
+    }
+
+    ult_cond_destroy(&(arg.queue_cond));
+    ult_mutex_destroy(&(arg.queue_lock));
+    ult_mutex_destroy(&(arg.cold));
+    ult_mutex_destroy(&(arg.hot));
+
+    free(threads);
+}
+
+//////////////////////////// Timed wait test ///////////////////////////////////
+
+#define TIMEOUT_NS 20000000
+#define TIMED_ROUNDS 200
+
+typedef struct timed_arg {
+    ult_mutex_t mutex;
+    ult_cond_t  cond;
+    uint64_t    counter;    // only changed with the mutex held
+    uint64_t    inside;     // the threads holding the mutex, more than 1 means a timed out lock still took it
+    uint64_t    taken;
+    uint64_t    timeouts;
+} timed_arg;
+
+void* timed_lock_worker(void* args) {
+    timed_arg* arg = (timed_arg*) args;
+
+    for (int i = 0; i < TIMED_ROUNDS; i++) {
+        if (ult_mutex_timedlock(&(arg->mutex), 0, 50000) == ETIMEDOUT) {
+            __atomic_fetch_add(&(arg->timeouts), 1, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        if (++(arg->inside) != 1) {
+            printf("[%lu] the mutex is held twice\n", ult_get_id());
+        }
+        arg->counter += 1;
+        arg->taken += 1;
+        do_work(20000);
+        arg->inside -= 1;
+
+        ult_mutex_unlock(&(arg->mutex));
+    }
+
+    return NULL;
+}
+
+void* timed_lock_once(void* args) {
+    timed_arg* arg = (timed_arg*) args;
+    int err = ult_mutex_timedlock(&(arg->mutex), 0, TIMEOUT_NS);
+
+    if (err == 0) {
+        ult_mutex_unlock(&(arg->mutex));
+    }
+
+    return (void*) (intptr_t) err;
+}
+
+void* long_sleeper(void*) {
+    ult_sleep(0, 5 * TIMEOUT_NS);
+    return (void*) 42;
+}
+
+// every timed wait once with a timeout that fires and once with one that doesn't, then thread_num threads fighting for a mutex with short timeouts
+void timed_wait_test(int thread_num) {
+    ult_t* threads = (ult_t*) malloc(thread_num * sizeof(ult_t));
+    ult_t other;
+    timed_arg arg;
+    struct timespec start, end;
+    void* result;
+    int err;
+
+    ult_mutex_init(&(arg.mutex));
+    ult_cond_init(&(arg.cond));
+    arg.counter = arg.inside = arg.taken = arg.timeouts = 0;
+
+    // the mutex is held by main for longer than the timeout
+    ult_mutex_lock(&(arg.mutex));
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ult_create(&other, timed_lock_once, &arg);
+    ult_join(&other, &result);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("mutex timedlock on a held mutex: %s after %.3lf ms\n", (intptr_t) result == ETIMEDOUT ? "ETIMEDOUT" : "taken", elapsed_ns(&start, &end) / 1e6);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    err = ult_cond_timedwait(&(arg.cond), &(arg.mutex), 0, TIMEOUT_NS);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("cond timedwait without a signal: %s after %.3lf ms, mutex %s\n", err == ETIMEDOUT ? "ETIMEDOUT" : "signaled",
+        elapsed_ns(&start, &end) / 1e6, mutex_owner(&(arg.mutex)) != NULL ? "held" : "not held");
+    ult_mutex_unlock(&(arg.mutex));
+
+    // the mutex is free now
+    ult_create(&other, timed_lock_once, &arg);
+    ult_join(&other, &result);
+    printf("mutex timedlock on a free mutex: %s\n", (intptr_t) result == 0 ? "taken" : "ETIMEDOUT");
+
+    ult_create(&other, long_sleeper, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    err = ult_join_timeout(&other, &result, 0, TIMEOUT_NS);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("join timeout on a sleeping thread: %s after %.3lf ms\n", err == ETIMEDOUT ? "ETIMEDOUT" : "joined", elapsed_ns(&start, &end) / 1e6);
+    err = ult_join_timeout(&other, &result, 1, 0);
+    printf("join timeout again: %s, result %ld\n", err == 0 ? "joined" : "ETIMEDOUT", (long) (intptr_t) result);
+
+    for (int i = 0; i < thread_num; i++) {
+        ult_create(&threads[i], timed_lock_worker, &arg);
+    }
+    for (int i = 0; i < thread_num; i++) {
+        ult_join(&threads[i], NULL);
+    }
+    printf("%d threads x %d timed locks: %lu taken, %lu timed out, counter %lu\n", thread_num, TIMED_ROUNDS, arg.taken, arg.timeouts, arg.counter);
+
+    ult_cond_destroy(&(arg.cond));
+    ult_mutex_destroy(&(arg.mutex));
+    free(threads);
+}
+
+//////////////////////////// Rwlock benchmark ///////////////////////////////////
+
+#ifndef RW_ROUNDS
+#define RW_ROUNDS 200000
+#endif
+#define RW_TABLE_SIZE 64
+#define RW_WRITE_EVERY 20 // one operation in 20 writes, the rest read
+
+typedef struct rw_bench_arg {
+    ult_mutex_t     mutex;
+    ult_rwlock_t    rwlock;
+    uint8_t         use_rwlock;
+    uint64_t        table[RW_TABLE_SIZE];   // a write adds 1 to every entry, a read checks that they are equal
+    _Atomic uint64_t torn_reads;
+} rw_bench_arg;
+
+static inline void rw_bench_read(rw_bench_arg* arg) {
+    uint64_t first = arg->table[0];
+    for (int i = 1; i < RW_TABLE_SIZE; i++) {
+        if (arg->table[i] != first) {
+            atomic_fetch_add(&(arg->torn_reads), 1);
+            return;
+        }
+    }
+}
+
+void* rw_bench_worker(void* args) {
+    rw_bench_arg* arg = (rw_bench_arg*) args;
+
+    for (uint64_t i = 0; i < RW_ROUNDS; i++) {
+        uint8_t write = i % RW_WRITE_EVERY == 0;
+
+        if (arg->use_rwlock && write) {
+            ult_rwlock_wrlock(&(arg->rwlock));
+        }
+        else if (arg->use_rwlock) {
+            ult_rwlock_rdlock(&(arg->rwlock));
+        }
+        else {
+            ult_mutex_lock(&(arg->mutex));
+        }
+
+        if (write) {
+            for (int j = 0; j < RW_TABLE_SIZE; j++) {
+                arg->table[j] += 1;
+            }
+        }
+        else {
+            rw_bench_read(arg);
+        }
+
+        if (arg->use_rwlock) {
+            ult_rwlock_unlock(&(arg->rwlock));
+        }
+        else {
+            ult_mutex_unlock(&(arg->mutex));
+        }
+    }
+
+    return NULL;
+}
+
+void* rw_timed_reader(void* args) {
+    rw_bench_arg* arg = (rw_bench_arg*) args;
+
+    int err = ult_rwlock_timedrdlock(&(arg->rwlock), 0, 10000000);
+    if (err == 0) {
+        ult_rwlock_unlock(&(arg->rwlock));
+    }
+
+    return (void*) (intptr_t) err;
+}
+
+// ops per second of thread_num threads sharing the table, the reads that saw half a write are counted in torn_reads
+double rw_ops_per_sec(rw_bench_arg* arg, int thread_num, uint64_t* torn_reads) {
+    ult_t* threads = (ult_t*) malloc(thread_num * sizeof(ult_t));
+    struct timespec start, end;
+
+    memset(arg->table, 0, sizeof(arg->table));
+    atomic_store(&(arg->torn_reads), 0);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < thread_num; i++) {
+        ult_create(&threads[i], rw_bench_worker, arg);
+    }
+    for (int i = 0; i < thread_num; i++) {
+        ult_join(&threads[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    free(threads);
+
+    *torn_reads = atomic_load(&(arg->torn_reads));
+    return thread_num * (double) RW_ROUNDS / (elapsed_ns(&start, &end) / 1e9);
+}
+
+// thread_num threads doing 95% reads and 5% writes of a shared table, behind a mutex and behind a rwlock with both preferences
+// every write touches the whole table, so a read that overlapped one is seen as torn
+void rwlock_benchmark(int thread_num) {
+    rw_bench_arg arg;
+    uint64_t torn_reads, expected = thread_num * (uint64_t) ((RW_ROUNDS + RW_WRITE_EVERY - 1) / RW_WRITE_EVERY);
+
+    ult_mutex_init(&(arg.mutex));
+
+    arg.use_rwlock = 0;
+    double ops = rw_ops_per_sec(&arg, thread_num, &torn_reads);
+    printf("mutex: %.0lf ops/sec, %lu torn reads, %lu writes (expected %lu)\n", ops, torn_reads, arg.table[0], expected); fflush(NULL);
+
+    arg.use_rwlock = 1;
+    ult_rwlock_init(&(arg.rwlock), ULT_RWLOCK_PREFER_READERS);
+    ops = rw_ops_per_sec(&arg, thread_num, &torn_reads);
+    printf("rwlock preferring readers: %.0lf ops/sec, %lu torn reads, %lu writes (expected %lu)\n", ops, torn_reads, arg.table[0], expected); fflush(NULL);
+    ult_rwlock_destroy(&(arg.rwlock));
+
+    ult_rwlock_init(&(arg.rwlock), ULT_RWLOCK_PREFER_WRITERS);
+    ops = rw_ops_per_sec(&arg, thread_num, &torn_reads);
+    printf("rwlock preferring writers: %.0lf ops/sec, %lu torn reads, %lu writes (expected %lu)\n", ops, torn_reads, arg.table[0], expected); fflush(NULL);
+
+    // a held rwlock can't be taken for writing, with or without a timeout
+    ult_rwlock_rdlock(&(arg.rwlock));
+    printf("trywrlock on a read rwlock: %s, tryrdlock: %s\n", ult_rwlock_trywrlock(&(arg.rwlock)) == 0 ? "taken" : "busy",
+        ult_rwlock_tryrdlock(&(arg.rwlock)) == 0 ? "taken" : "busy");
+    ult_rwlock_unlock(&(arg.rwlock));
+    ult_rwlock_unlock(&(arg.rwlock));
+
+    ult_rwlock_wrlock(&(arg.rwlock));
+    ult_t reader;
+    void* result;
+    ult_create(&reader, rw_timed_reader, &arg);
+    ult_join(&reader, &result);
+    printf("timedrdlock on a written rwlock: %s\n", (intptr_t) result == ETIMEDOUT ? "ETIMEDOUT" : "taken"); fflush(NULL);
+    ult_rwlock_unlock(&(arg.rwlock));
+
+    ult_rwlock_destroy(&(arg.rwlock));
+    ult_mutex_destroy(&(arg.mutex));
+}
+
+// a reader of the rwlock waits for a mutex held by a thread that waits to write the rwlock, and main joins the reader
+// send DEADLOCK_SIG (SIGUSR2) to see the cycle through the rwlock, the program doesn't end by itself
+void* rw_deadlock_reader(void* args) {
+    rw_bench_arg* arg = (rw_bench_arg*) args;
+
+    ult_rwlock_rdlock(&(arg->rwlock));
+    ult_sleep(0, 10000000);
+    ult_mutex_lock(&(arg->mutex));
+
+    return NULL;
+}
+
+void* rw_deadlock_writer(void* args) {
+    rw_bench_arg* arg = (rw_bench_arg*) args;
+
+    ult_mutex_lock(&(arg->mutex));
+    ult_sleep(0, 10000000);
+    ult_rwlock_wrlock(&(arg->rwlock));
+
+    return NULL;
+}
+
+void rwlock_deadlock_test() {
+    rw_bench_arg arg;
+    ult_t reader, writer;
+
+    ult_mutex_init(&(arg.mutex));
+    ult_rwlock_init(&(arg.rwlock), ULT_RWLOCK_PREFER_WRITERS);
+
+    ult_create(&reader, rw_deadlock_reader, &arg);
+    ult_create(&writer, rw_deadlock_writer, &arg);
+
+    ult_join(&reader, NULL);
+}
+
+//////////////////////////// Semaphores, barriers and wait groups ///////////////////////////////////
+
+#define SYNC_ITEMS 100000   // per producer
+#define SYNC_SLOTS 64
+#define SYNC_PHASES 1000
+
+typedef struct sync_arg {
+    ult_sem_t           free_slots;
+    ult_sem_t           full_slots;
+    ult_mutex_t         mutex;          // the positions in the ring
+    uint64_t            ring[SYNC_SLOTS];
+    uint64_t            head, tail;
+    _Atomic uint64_t    claimed;        // the items the consumers took a turn for, they stop when all are claimed
+    uint64_t            total;
+    _Atomic uint64_t    sum;
+    ult_waitgroup_t     producers;
+    ult_barrier_t       barrier;
+    uint64_t*           phases;         // the phases every thread finished
+    uint64_t            serial;         // how many times a thread got ULT_BARRIER_SERIAL_THREAD
+    uint64_t            bad_phases;     // the phases some thread wasn't done with when the barrier opened
+} sync_arg;
+
+typedef struct sync_phase_arg {
+    sync_arg*   shared;
+    int         index;
+} sync_phase_arg;
+
+void* sync_producer(void* args) {
+    sync_arg* arg = (sync_arg*) args;
+
+    for (uint64_t i = 1; i <= SYNC_ITEMS; i++) {
+        ult_sem_wait(&(arg->free_slots));
+
+        ult_mutex_lock(&(arg->mutex));
+        arg->ring[arg->tail % SYNC_SLOTS] = i;
+        arg->tail += 1;
+        ult_mutex_unlock(&(arg->mutex));
+
+        ult_sem_post(&(arg->full_slots));
+    }
+
+    ult_waitgroup_done(&(arg->producers));
+    return NULL;
+}
+
+void* sync_consumer(void* args) {
+    sync_arg* arg = (sync_arg*) args;
+
+    // every turn claimed is backed by an item, no end markers are needed
+    while (atomic_fetch_add(&(arg->claimed), 1) < arg->total) {
+        ult_sem_wait(&(arg->full_slots));
+
+        ult_mutex_lock(&(arg->mutex));
+        uint64_t item = arg->ring[arg->head % SYNC_SLOTS];
+        arg->head += 1;
+        ult_mutex_unlock(&(arg->mutex));
+
+        ult_sem_post(&(arg->free_slots));
+        atomic_fetch_add(&(arg->sum), item);
+    }
+
+    return NULL;
+}
+
+void* sync_phase_worker(void* args) {
+    sync_phase_arg* phase_arg = (sync_phase_arg*) args;
+    sync_arg* arg = phase_arg->shared;
+    int thread_num = (int) arg->barrier.count;
+
+    for (uint64_t phase = 1; phase <= SYNC_PHASES; phase++) {
+        arg->phases[phase_arg->index] = phase;
+
+        if (ult_barrier_wait(&(arg->barrier)) == ULT_BARRIER_SERIAL_THREAD) {
+            arg->serial += 1;
+            for (int i = 0; i < thread_num; i++) {
+                if (arg->phases[i] != phase) {
+                    arg->bad_phases += 1;
+                    break;
+                }
+            }
+        }
+
+        // nobody starts the next phase before the check is done
+        ult_barrier_wait(&(arg->barrier));
+    }
+
+    return NULL;
+}
+
+// a bounded buffer between thread_num producers and thread_num consumers with two semaphores, the end of the producers seen through a wait group,
+// then thread_num threads going through phases in lockstep behind a barrier
+void sync_test(int thread_num) {
+    ult_t* threads = (ult_t*) malloc(2 * thread_num * sizeof(ult_t));
+    sync_phase_arg* phase_args = (sync_phase_arg*) malloc(thread_num * sizeof(sync_phase_arg));
+    sync_arg arg;
+    struct timespec start, end;
+
+    ult_sem_init(&(arg.free_slots), SYNC_SLOTS);
+    ult_sem_init(&(arg.full_slots), 0);
+    ult_mutex_init(&(arg.mutex));
+    ult_waitgroup_init(&(arg.producers));
+    arg.head = arg.tail = 0;
+    arg.total = thread_num * (uint64_t) SYNC_ITEMS;
+    atomic_store(&(arg.claimed), 0);
+    atomic_store(&(arg.sum), 0);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ult_waitgroup_add(&(arg.producers), thread_num);
+    for (int i = 0; i < thread_num; i++) {
+        ult_create(&threads[i], sync_producer, &arg);
+        ult_create(&threads[thread_num + i], sync_consumer, &arg);
+    }
+
+    ult_waitgroup_wait(&(arg.producers));
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("%d producers done after %.2lf ms\n", thread_num, elapsed_ns(&start, &end) / 1e6); fflush(NULL);
+
+    for (int i = 0; i < 2 * thread_num; i++) {
+        ult_join(&threads[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    uint64_t expected = thread_num * (uint64_t) SYNC_ITEMS * (SYNC_ITEMS + 1) / 2;
+    printf("%lu items in %.2lf ms (%.0lf items/sec), sum %lu (expected %lu), %u free slots\n", arg.total, elapsed_ns(&start, &end) / 1e6,
+        arg.total / (elapsed_ns(&start, &end) / 1e9), atomic_load(&(arg.sum)), expected, ult_sem_getvalue(&(arg.free_slots))); fflush(NULL);
+
+    int err = ult_sem_timedwait(&(arg.full_slots), 0, 10000000);
+    printf("timedwait on an empty semaphore: %s\n", err == ETIMEDOUT ? "ETIMEDOUT" : "taken"); fflush(NULL);
+
+    arg.phases = (uint64_t*) calloc(thread_num, sizeof(uint64_t));
+    arg.serial = arg.bad_phases = 0;
+    ult_barrier_init(&(arg.barrier), thread_num);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < thread_num; i++) {
+        phase_args[i].shared = &arg;
+        phase_args[i].index = i;
+        ult_create(&threads[i], sync_phase_worker, &phase_args[i]);
+    }
+    for (int i = 0; i < thread_num; i++) {
+        ult_join(&threads[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    printf("%d threads x %d phases: %.1lf us per phase, %lu serial threads (expected %d), %lu phases opened early\n", thread_num, SYNC_PHASES,
+        elapsed_ns(&start, &end) / 1e3 / SYNC_PHASES, arg.serial, SYNC_PHASES, arg.bad_phases); fflush(NULL);
+
+    ult_barrier_destroy(&(arg.barrier));
+    ult_waitgroup_destroy(&(arg.producers));
+    ult_mutex_destroy(&(arg.mutex));
+    ult_sem_destroy(&(arg.full_slots));
+    ult_sem_destroy(&(arg.free_slots));
+    free(arg.phases);
+    free(phase_args);
+    free(threads);
+}
+
+//////////////////////////// Channel benchmark ///////////////////////////////////
+
+#ifndef CHAN_ITEMS
+#define CHAN_ITEMS 100000   // per producer, a multiple of CHAN_BATCH
+#endif
+#define CHAN_BATCH 10       // what the producers of producer_consumer add at a time
+#define CHAN_CAPACITY 20    // about what its list holds at most
+
+// producer_consumer without the prints: a list with a malloc per item, a mutex and two conds with broadcasts, and an end marker per consumer
+typedef struct list_bench_arg {
+    generic_linked_list_t   list;
+    ult_mutex_t             mutex;
+    ult_cond_t              prod_cond;
+    ult_cond_t              cons_cond;
+    int                     running_producers;
+    int                     consumers;
+    uint64_t                sum;
+} list_bench_arg;
+
+void* list_bench_producer(void* args) {
+    list_bench_arg* arg = (list_bench_arg*) args;
+
+    for (uint64_t i = 1; i <= CHAN_ITEMS; i += CHAN_BATCH) {
+        ult_mutex_lock(&(arg->mutex));
+
+        while (arg->list.size + CHAN_BATCH >= 2 * CHAN_BATCH) {
+            ult_cond_wait(&(arg->prod_cond), &(arg->mutex));
+        }
+
+        for (uint64_t j = 0; j < CHAN_BATCH; j++) {
+            insert_last(&(arg->list), (void*) (i + j));
+        }
+
+        ult_cond_broadcast(&(arg->cons_cond));
+        ult_mutex_unlock(&(arg->mutex));
+    }
+
+    ult_mutex_lock(&(arg->mutex));
+    arg->running_producers -= 1;
+    if (arg->running_producers == 0) {
+        for (int j = 0; j < arg->consumers; j++) {
+            insert_last(&(arg->list), 0);
+        }
+        ult_cond_broadcast(&(arg->cons_cond));
+    }
+    ult_mutex_unlock(&(arg->mutex));
+
+    return NULL;
+}
+
+void* list_bench_consumer(void* args) {
+    list_bench_arg* arg = (list_bench_arg*) args;
+    uint64_t val = 1;
+
+    while (val != 0) {
+        ult_mutex_lock(&(arg->mutex));
+
+        while (arg->list.size == 0) {
+            ult_cond_signal(&(arg->prod_cond));
+            ult_cond_wait(&(arg->cons_cond), &(arg->mutex));
+        }
+
+        val = (uint64_t) arg->list.head->data;
+        delete_first(&(arg->list));
+        arg->sum += val;
+
+        ult_mutex_unlock(&(arg->mutex));
+    }
+
+    return NULL;
+}
+
+typedef struct chan_bench_arg {
+    ult_chan_t          chan;
+    size_t              batch;      // the items of a send_n / recv_n, 1 uses send / recv
+    ult_waitgroup_t     producers;  // the channel is closed when they are done
+    _Atomic uint64_t    sum;
+} chan_bench_arg;
+
+void* chan_bench_producer(void* args) {
+    chan_bench_arg* arg = (chan_bench_arg*) args;
+    void* items[CHAN_BATCH];
+
+    for (uint64_t i = 1; i <= CHAN_ITEMS; i += arg->batch) {
+        if (arg->batch == 1) {
+            ult_chan_send(&(arg->chan), (void*) i);
+            continue;
+        }
+
+        for (uint64_t j = 0; j < arg->batch; j++) {
+            items[j] = (void*) (i + j);
+        }
+        ult_chan_send_n(&(arg->chan), items, arg->batch);
+    }
+
+    ult_waitgroup_done(&(arg->producers));
+    return NULL;
+}
+
+void* chan_bench_consumer(void* args) {
+    chan_bench_arg* arg = (chan_bench_arg*) args;
+    void* items[CHAN_BATCH];
+    uint64_t sum = 0;
+    size_t received;
+
+    // no end markers, recv fails once the channel is closed and empty
+    while ((received = ult_chan_recv_n(&(arg->chan), items, arg->batch)) > 0) {
+        for (size_t j = 0; j < received; j++) {
+            sum += (uint64_t) items[j];
+        }
+    }
+
+    atomic_fetch_add(&(arg->sum), sum);
+    return NULL;
+}
+
+// items per second through a channel of the given capacity, main closes it after the producers are done
+double chan_items_per_sec(int producers, int consumers, size_t capacity, size_t batch, uint64_t* sum) {
+    ult_t* threads = (ult_t*) malloc((producers + consumers) * sizeof(ult_t));
+    chan_bench_arg arg;
+    struct timespec start, end;
+
+    ult_chan_init(&(arg.chan), capacity);
+    ult_waitgroup_init(&(arg.producers));
+    arg.batch = batch;
+    atomic_store(&(arg.sum), 0);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ult_waitgroup_add(&(arg.producers), producers);
+    for (int i = 0; i < producers; i++) {
+        ult_create(&threads[i], chan_bench_producer, &arg);
+    }
+    for (int i = producers; i < producers + consumers; i++) {
+        ult_create(&threads[i], chan_bench_consumer, &arg);
+    }
+
+    ult_waitgroup_wait(&(arg.producers));
+    ult_chan_close(&(arg.chan));
+
+    for (int i = 0; i < producers + consumers; i++) {
+        ult_join(&threads[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    ult_waitgroup_destroy(&(arg.producers));
+    ult_chan_destroy(&(arg.chan));
+    free(threads);
+
+    *sum = atomic_load(&(arg.sum));
+    return producers * (double) CHAN_ITEMS / (elapsed_ns(&start, &end) / 1e9);
+}
+
+// the producer_consumer pattern (without its prints) against channels: buffered, buffered in batches and rendezvous
+void chan_benchmark(int producers, int consumers) {
+    ult_t* threads = (ult_t*) malloc((producers + consumers) * sizeof(ult_t));
+    list_bench_arg arg;
+    struct timespec start, end;
+    uint64_t sum, expected = producers * (uint64_t) CHAN_ITEMS * (CHAN_ITEMS + 1) / 2;
+
+    init_linked_list(&(arg.list));
+    ult_mutex_init(&(arg.mutex));
+    ult_cond_init(&(arg.prod_cond));
+    ult_cond_init(&(arg.cons_cond));
+    arg.running_producers = producers;
+    arg.consumers = consumers;
+    arg.sum = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < producers; i++) {
+        ult_create(&threads[i], list_bench_producer, &arg);
+    }
+    for (int i = producers; i < producers + consumers; i++) {
+        ult_create(&threads[i], list_bench_consumer, &arg);
+    }
+    for (int i = 0; i < producers + consumers; i++) {
+        ult_join(&threads[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    printf("list + mutex + conds: %.0lf items/sec, sum %lu (expected %lu)\n",
+        producers * (double) CHAN_ITEMS / (elapsed_ns(&start, &end) / 1e9), arg.sum, expected); fflush(NULL);
+
+    destroy_list(&(arg.list));
+    ult_mutex_destroy(&(arg.mutex));
+    ult_cond_destroy(&(arg.prod_cond));
+    ult_cond_destroy(&(arg.cons_cond));
+    free(threads);
+
+    double items = chan_items_per_sec(producers, consumers, CHAN_CAPACITY, 1, &sum);
+    printf("channel of %d: %.0lf items/sec, sum %lu (expected %lu)\n", CHAN_CAPACITY, items, sum, expected); fflush(NULL);
+
+    items = chan_items_per_sec(producers, consumers, CHAN_CAPACITY, CHAN_BATCH, &sum);
+    printf("channel of %d, batches of %d: %.0lf items/sec, sum %lu (expected %lu)\n", CHAN_CAPACITY, CHAN_BATCH, items, sum, expected); fflush(NULL);
+
+    items = chan_items_per_sec(producers, consumers, 0, 1, &sum);
+    printf("rendezvous channel: %.0lf items/sec, sum %lu (expected %lu)\n", items, sum, expected); fflush(NULL);
+}
+
+// objects of a single word built on ult_park / ult_unpark, they cost nothing but the word while nobody waits
+
+// 0 unlocked, 1 locked, 2 locked and somebody might be parked (the futex mutex of Drepper's "Futexes Are Tricky")
+typedef _Atomic uint32_t word_mutex_t;
+
+void word_mutex_lock(word_mutex_t* mutex) {
+    uint32_t state = 0;
+    if (atomic_compare_exchange_strong(mutex, &state, 1)) {
+        return;
+    }
+
+    // from now on the unlock can't know whether this thread parked, it always looks for someone to wake up
+    if (state != 2) {
+        state = atomic_exchange(mutex, 2);
+    }
+    while (state != 0) {
+        ult_park(mutex, 2);
+        state = atomic_exchange(mutex, 2);
+    }
+}
+
+void word_mutex_unlock(word_mutex_t* mutex) {
+    if (atomic_fetch_sub(mutex, 1) != 1) {
+        atomic_store(mutex, 0);
+        ult_unpark(mutex, 1);
+    }
+}
+
+// 0 not run, 1 running, 2 done
+typedef _Atomic uint32_t word_once_t;
+
+void word_once(word_once_t* once, void (*routine)(void)) {
+    uint32_t state = atomic_load(once);
+    if (state == 2) {
+        return;
+    }
+
+    if (state == 0 && atomic_compare_exchange_strong(once, &state, 1)) {
+        routine();
+        atomic_store(once, 2);
+        ult_unpark(once, UINT32_MAX);
+        return;
+    }
+
+    while (atomic_load(once) != 2) {
+        ult_park(once, 1);
+    }
+}
+
+// 0 not set, 1 set, it stays set
+typedef _Atomic uint32_t word_event_t;
+
+void word_event_wait(word_event_t* event) {
+    while (atomic_load(event) == 0) {
+        ult_park(event, 0);
+    }
+}
+
+void word_event_set(word_event_t* event) {
+    atomic_store(event, 1);
+    ult_unpark(event, UINT32_MAX);
+}
+
+#define PARK_ITERATIONS 100000
+
+typedef struct park_arg {
+    word_mutex_t    word_mutex;
+    ult_mutex_t     mutex;
+    uint64_t        counter;
+    word_once_t     once;
+    word_event_t    start;
+} park_arg;
+
+static _Atomic uint64_t park_once_runs = 0;
+
+void park_once_routine() {
+    ult_sleep(0, 1000000); // the others come while it runs
+    atomic_fetch_add(&park_once_runs, 1);
+}
+
+void* park_word_worker(void* args) {
+    park_arg* arg = (park_arg*) args;
+
+    word_event_wait(&(arg->start));
+    word_once(&(arg->once), park_once_routine);
+
+    for (int i = 0; i < PARK_ITERATIONS; i++) {
+        word_mutex_lock(&(arg->word_mutex));
+        arg->counter += 1;
+        word_mutex_unlock(&(arg->word_mutex));
+    }
+
+    return NULL;
+}
+
+void* park_mutex_worker(void* args) {
+    park_arg* arg = (park_arg*) args;
+
+    for (int i = 0; i < PARK_ITERATIONS; i++) {
+        ult_mutex_lock(&(arg->mutex));
+        arg->counter += 1;
+        ult_mutex_unlock(&(arg->mutex));
+    }
+
+    return NULL;
+}
+
+// thread_num threads held back by an event, going through a once-flag and then counting under a 1 word mutex, against the same count under ult_mutex_t
+void park_test(int thread_num) {
+    ult_t* threads = (ult_t*) malloc(thread_num * sizeof(ult_t));
+    park_arg arg;
+    struct timespec start, end;
+
+    atomic_store(&(arg.word_mutex), 0);
+    ult_mutex_init(&(arg.mutex));
+    atomic_store(&(arg.once), 0);
+    atomic_store(&(arg.start), 0);
+    arg.counter = 0;
+
+    for (int i = 0; i < thread_num; i++) {
+        ult_create(&threads[i], park_word_worker, &arg);
+    }
+    ult_sleep(0, 10000000); // they all park on the event
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    word_event_set(&(arg.start));
+    for (int i = 0; i < thread_num; i++) {
+        ult_join(&threads[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("word mutex (%zu bytes): counter %lu (expected %lu), once ran %lu times, %.2lf ms\n", sizeof(word_mutex_t), arg.counter,
+        thread_num * (uint64_t) PARK_ITERATIONS, atomic_load(&park_once_runs), elapsed_ns(&start, &end) / 1e6); fflush(NULL);
+
+    arg.counter = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < thread_num; i++) {
+        ult_create(&threads[i], park_mutex_worker, &arg);
+    }
+    for (int i = 0; i < thread_num; i++) {
+        ult_join(&threads[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("ult_mutex_t (%zu bytes): counter %lu (expected %lu), %.2lf ms\n", sizeof(ult_mutex_t), arg.counter,
+        thread_num * (uint64_t) PARK_ITERATIONS, elapsed_ns(&start, &end) / 1e6); fflush(NULL);
+
+    word_event_t never;
+    atomic_store(&never, 0);
+    int err = ult_park_timeout(&never, 0, 0, 10000000);
+    printf("park_timeout on an event nobody sets: %s, park on a changed word: %d\n", err == ETIMEDOUT ? "ETIMEDOUT" : "woken", ult_park(&never, 1)); fflush(NULL);
+
+    ult_mutex_destroy(&(arg.mutex));
+    free(threads);
+}
+
 int main() {
     // test1();
     // test2();
@@ -478,5 +2320,27 @@ int main() {
     // deadlock_test2();
     producer_consumer(3, 5);
     // prod_cons_deadlock();
+    // context_switch_benchmark();
+    // sleepers_switch_benchmark(1000);
+    // cpu_scaling_benchmark(16);
+    // list_pool_benchmark();
+    // stack_test(1000);
+    // create_join_benchmark();
+    // mutex_benchmark(4);
+    // io_test(8);
+    // file_io_benchmark(64);
+    // priority_test(100);
+    // fair_test(8); // after ult_set_sched_policy(ULT_SCHED_FAIR) to see the difference
+    // time_slice_test(8);
+    // stats_test(8);
+    // lock_profile_test(8);
+    // trace_test(8);
+    // deadlock_avoidance_test(5);
+    // timed_wait_test(8);
+    // rwlock_benchmark(8);
+    // rwlock_deadlock_test();
+    // sync_test(8);
+    // chan_benchmark(3, 5);
+    // park_test(8);
     return 0;
 }
@@ -0,0 +1,211 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+
+#include <valgrind/valgrind.h>
+
+#include "stack.h"
+#include "ult.h"
+
+#define STACK_CACHE_BUCKETS 8 // stacks of other sizes than the first few used are not cached
+#define DEFAULT_WARM_STACKS 64
+#define DEFAULT_COLD_STACKS 1024
+
+////////////////////// STACK CACHE //////////////////////
+
+// the finished threads leave their stacks here, the next threads of the same stack size take them back
+// this skips mmap, mprotect, munmap and the valgrind registration, and the warm stacks also skip faulting in (zeroed) pages again
+// the stack cache is linked through the lowest usable page of the cached stacks, the page farthest from where the thread starts
+
+typedef struct cached_stack_t {
+    struct cached_stack_t*  next;
+    ult_stack_t             stack;
+} cached_stack_t;
+
+typedef struct {
+    size_t              size;       // 0 if the bucket is not used yet
+    cached_stack_t*     warm;       // keep their pages
+    cached_stack_t*     cold;       // their pages were given back with MADV_DONTNEED, only the mapping is kept
+    size_t              warm_count;
+    size_t              cold_count;
+} stack_bucket_t;
+
+static stack_bucket_t buckets[STACK_CACHE_BUCKETS];
+static size_t warm_limit = DEFAULT_WARM_STACKS;
+static size_t cold_limit = DEFAULT_COLD_STACKS;
+static atomic_flag cache_lock = ATOMIC_FLAG_INIT; // the callers are inside a protected zone, they can't be preempted while holding it
+
+static inline void lock_cache() {
+    while (atomic_flag_test_and_set_explicit(&cache_lock, memory_order_acquire)) {
+        sched_yield();
+    }
+}
+
+static inline void unlock_cache() {
+    atomic_flag_clear_explicit(&cache_lock, memory_order_release);
+}
+
+// NULL if all the buckets are taken by other sizes, must be called with the cache lock held
+static stack_bucket_t* find_bucket(size_t size, uint8_t create) {
+    for (size_t i = 0; i < STACK_CACHE_BUCKETS; i++) {
+        if (buckets[i].size == size) {
+            return &buckets[i];
+        }
+
+        if (buckets[i].size == 0) {
+            if (!create) {
+                return NULL;
+            }
+
+            buckets[i].size = size;
+            return &buckets[i];
+        }
+    }
+
+    return NULL;
+}
+
+static inline cached_stack_t* pop_cached(cached_stack_t** list, size_t* count) {
+    cached_stack_t* cached = *list;
+
+    if (cached != NULL) {
+        *list = cached->next;
+        *count -= 1;
+    }
+
+    return cached;
+}
+
+static inline void push_cached(cached_stack_t** list, size_t* count, ult_stack_t* stack) {
+    cached_stack_t* cached = (cached_stack_t*) stack->base;
+
+    cached->stack = *stack;
+    cached->next = *list;
+    *list = cached;
+    *count += 1;
+}
+
+static int take_cached(ult_stack_t* stack, size_t size) {
+    lock_cache();
+
+    cached_stack_t* cached = NULL;
+    stack_bucket_t* bucket = find_bucket(size, 0);
+
+    if (bucket != NULL) {
+        cached = pop_cached(&(bucket->warm), &(bucket->warm_count));
+
+        if (cached == NULL) {
+            cached = pop_cached(&(bucket->cold), &(bucket->cold_count));
+        }
+    }
+
+    if (cached != NULL) {
+        *stack = cached->stack;
+    }
+
+    unlock_cache();
+
+    return cached != NULL;
+}
+
+// returns 0 if the cache is full and the stack should be unmapped
+static int give_cached(ult_stack_t* stack) {
+    lock_cache();
+
+    stack_bucket_t* bucket = find_bucket(stack->size, 1);
+    int cached = 0;
+
+    if (bucket != NULL) {
+        if (bucket->warm_count < warm_limit) {
+            push_cached(&(bucket->warm), &(bucket->warm_count), stack);
+            cached = 1;
+        }
+        else if (bucket->cold_count < cold_limit) {
+            // above the high water mark the memory goes back to the system but the mapping (and its guard page) stays
+            // (push_cached touches the lowest page again after this, so only that page stays resident)
+            madvise(stack->base, stack->size, MADV_DONTNEED);
+            push_cached(&(bucket->cold), &(bucket->cold_count), stack);
+            cached = 1;
+        }
+    }
+
+    unlock_cache();
+
+    return cached;
+}
+
+void ult_stack_cache_limits(size_t warm_stacks, size_t cold_stacks) {
+    lock_cache();
+    warm_limit = warm_stacks;
+    cold_limit = cold_stacks;
+    unlock_cache();
+}
+
+////////////////////// USER LEVEL THREAD STACK //////////////////////
+
+int ult_stack_map(ult_stack_t* stack, size_t size) {
+    size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+
+    size = (size + page_size - 1) & ~(page_size - 1);
+
+    if (take_cached(stack, size)) {
+        return 0;
+    }
+
+    size_t mapping_size = size + page_size;
+
+    char* mapping = (char*) mmap(NULL, mapping_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (mapping == MAP_FAILED) {
+        return 1;
+    }
+
+    // the stack grows down, the guard goes at the lowest address
+    if (mprotect(mapping, page_size, PROT_NONE) != 0) {
+        int error = errno;
+        munmap(mapping, mapping_size);
+        errno = error;
+        return 1;
+    }
+
+    stack->mapping      = mapping;
+    stack->mapping_size = mapping_size;
+    stack->base         = mapping + page_size;
+    stack->size         = size;
+    stack->valgrind_id  = VALGRIND_STACK_REGISTER(stack->base, stack->base + stack->size);
+
+    return 0;
+}
+
+void ult_stack_use(ult_stack_t* stack, void* buffer, size_t size) {
+    stack->mapping      = NULL;
+    stack->mapping_size = 0;
+    stack->base         = (char*) buffer;
+    stack->size         = size;
+    stack->valgrind_id  = VALGRIND_STACK_REGISTER(stack->base, stack->base + stack->size);
+}
+
+void ult_stack_release(ult_stack_t* stack) {
+    if (stack->mapping != NULL && give_cached(stack)) {
+        // still registered with valgrind, the next thread that takes it uses the same memory
+        stack->mapping = NULL;
+        stack->base    = NULL;
+        stack->size    = 0;
+        return;
+    }
+
+    VALGRIND_STACK_DEREGISTER(stack->valgrind_id);
+
+    if (stack->mapping != NULL) {
+        if (munmap(stack->mapping, stack->mapping_size) != 0) {
+            BAIL("Unmap stack");
+        }
+    }
+
+    stack->mapping = NULL;
+    stack->base    = NULL;
+    stack->size    = 0;
+}
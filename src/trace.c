@@ -0,0 +1,298 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "trace.h"
+#include "ult.h"
+
+#define WAIT_NONE 0
+#define WAIT_READY 1    // in a run queue
+#define WAIT_BLOCKED 2
+
+#define THREADS_PID 1
+#define CARRIERS_PID 2
+
+////////////////////// EVENT TRACE RING //////////////////////
+
+int trace_ring_init(trace_ring_t* ring, size_t events) {
+    size_t size = 1;
+    while (size < events) {
+        size <<= 1;
+    }
+
+    ring->events = (trace_event_t*) malloc(size * sizeof(trace_event_t));
+    if (ring->events == NULL) {
+        return 1;
+    }
+
+    ring->mask = size - 1;
+    ring->head = 0;
+
+    return 0;
+}
+
+void trace_ring_destroy(trace_ring_t* ring) {
+    free(ring->events);
+    ring->events = NULL;
+    ring->mask = 0;
+    ring->head = 0;
+}
+
+////////////////////// CHROME TRACE JSON //////////////////////
+
+// an event of one of the rings, the rings are merged by time
+typedef struct merged_event_t {
+    trace_event_t   event;
+    uint32_t        carrier;
+    uint64_t        sequence;   // the position in its ring, orders the events of a carrier with the same time
+} merged_event_t;
+
+// what a thread was doing at the last event seen for it
+typedef struct thread_state_t {
+    uint8_t     seen;
+    uint8_t     running;
+    uint8_t     exited;
+    uint8_t     waiting;        // WAIT_*
+    uint8_t     block_reason;
+    uint32_t    carrier;
+    uint64_t    run_start;
+    uint64_t    wait_start;
+} thread_state_t;
+
+typedef struct json_writer_t {
+    FILE*           file;
+    uint8_t         first;          // no comma before the first event
+    uint64_t        base_time;      // the first event is at 0
+    double          cycles_per_us;
+} json_writer_t;
+
+static const char* block_reason_names[ULT_BLOCK_REASONS] = { "mutex", "cond", "join", "sleep", "io", "rwlock", "sync", "chan", "park" };
+
+static int compare_merged_events(const void* a, const void* b) {
+    const merged_event_t* first = (const merged_event_t*) a;
+    const merged_event_t* second = (const merged_event_t*) b;
+
+    if (first->event.time != second->event.time) {
+        return first->event.time < second->event.time ? -1 : 1;
+    }
+    if (first->carrier != second->carrier) {
+        return first->carrier < second->carrier ? -1 : 1;
+    }
+    return first->sequence < second->sequence ? -1 : (first->sequence > second->sequence ? 1 : 0);
+}
+
+static double to_us(json_writer_t* writer, uint64_t time) {
+    return time > writer->base_time ? (time - writer->base_time) / writer->cycles_per_us : 0.0;
+}
+
+static void next_event(json_writer_t* writer) {
+    fprintf(writer->file, writer->first ? "\n" : ",\n");
+    writer->first = 0;
+}
+
+static void write_slice(json_writer_t* writer, int pid, uint64_t tid, const char* name, const char* category, uint64_t start, uint64_t end) {
+    next_event(writer);
+    fprintf(writer->file, "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%lu,\"ts\":%.3lf,\"dur\":%.3lf}",
+        name, category, pid, tid, to_us(writer, start), to_us(writer, end) - to_us(writer, start));
+}
+
+static void write_instant(json_writer_t* writer, uint64_t tid, const char* name, uint64_t time, const char* arg_name, uint64_t arg) {
+    next_event(writer);
+    fprintf(writer->file, "{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":%d,\"tid\":%lu,\"ts\":%.3lf,\"args\":{\"%s\":%lu}}",
+        name, THREADS_PID, tid, to_us(writer, time), arg_name, arg);
+}
+
+static void write_name(json_writer_t* writer, const char* kind, int pid, uint64_t tid, const char* prefix, uint64_t id) {
+    next_event(writer);
+    fprintf(writer->file, "{\"name\":\"%s\",\"ph\":\"M\",\"pid\":%d,\"tid\":%lu,\"args\":{\"name\":\"%s%lu\"}}", kind, pid, tid, prefix, id);
+}
+
+// the time a thread spent out of the carrier ends (it runs again or it was woken up)
+static void end_wait(json_writer_t* writer, thread_state_t* state, uint64_t thread, uint64_t time) {
+    if (state->waiting == WAIT_READY) {
+        write_slice(writer, THREADS_PID, thread, "ready", "wait", state->wait_start, time);
+    }
+    else if (state->waiting == WAIT_BLOCKED) {
+        char name[32];
+        snprintf(name, sizeof(name), "blocked: %s", block_reason_names[state->block_reason]);
+        write_slice(writer, THREADS_PID, thread, name, "wait", state->wait_start, time);
+    }
+
+    state->waiting = WAIT_NONE;
+}
+
+static thread_state_t* get_state(thread_state_t** states, size_t* capacity, uint64_t thread) {
+    if (thread >= *capacity) {
+        size_t new_capacity = *capacity > 0 ? *capacity : 64;
+        while (new_capacity <= thread) {
+            new_capacity *= 2;
+        }
+
+        thread_state_t* grown = (thread_state_t*) realloc(*states, new_capacity * sizeof(thread_state_t));
+        if (grown == NULL) {
+            return NULL;
+        }
+        memset(grown + *capacity, 0, (new_capacity - *capacity) * sizeof(thread_state_t));
+
+        *states = grown;
+        *capacity = new_capacity;
+    }
+
+    thread_state_t* state = &((*states)[thread]);
+    state->seen = 1;
+    return state;
+}
+
+static void write_event(json_writer_t* writer, merged_event_t* merged, thread_state_t* state, thread_state_t* object_state) {
+    trace_event_t* event = &(merged->event);
+    char name[32];
+
+    switch (event->type) {
+        case TRACE_RUN:
+            end_wait(writer, state, event->thread, event->time);
+            state->running = 1;
+            state->run_start = event->time;
+            state->carrier = merged->carrier;
+            break;
+
+        case TRACE_STOP:
+            if (state->running) {
+                snprintf(name, sizeof(name), "ult %lu", event->thread);
+                write_slice(writer, THREADS_PID, event->thread, "run", "run", state->run_start, event->time);
+                write_slice(writer, CARRIERS_PID, state->carrier, name, "run", state->run_start, event->time);
+                state->running = 0;
+            }
+
+            if (state->exited) {
+                break;
+            }
+
+            state->wait_start = event->time;
+            if (event->detail == TRACE_STOP_BLOCK && event->object < ULT_BLOCK_REASONS) {
+                state->waiting = WAIT_BLOCKED;
+                state->block_reason = (uint8_t) event->object;
+            }
+            else {
+                // preempted, yielded, or woken up before it got to switch out
+                state->waiting = WAIT_READY;
+            }
+            break;
+
+        case TRACE_WAKE:
+            if (state->waiting == WAIT_BLOCKED) {
+                end_wait(writer, state, event->thread, event->time);
+                state->waiting = WAIT_READY;
+                state->wait_start = event->time;
+            }
+            break;
+
+        case TRACE_CREATE:
+            write_instant(writer, event->thread, "create", event->time, "thread", event->object);
+            if (object_state != NULL) {
+                object_state->waiting = WAIT_READY;
+                object_state->wait_start = event->time;
+            }
+            break;
+
+        case TRACE_EXIT:
+            write_instant(writer, event->thread, "exit", event->time, "thread", event->thread);
+            state->exited = 1;
+            break;
+
+        case TRACE_LOCK:
+            write_instant(writer, event->thread, event->detail ? "lock (waited)" : "lock", event->time, "mutex", event->object);
+            break;
+
+        case TRACE_UNLOCK:
+            write_instant(writer, event->thread, "unlock", event->time, "mutex", event->object);
+            break;
+    }
+}
+
+int trace_write_json(const char* path, trace_ring_t* rings, uint32_t ring_count, double cycles_per_us) {
+    size_t count = 0;
+    for (uint32_t i = 0; i < ring_count; i++) {
+        count += rings[i].head < rings[i].mask + 1 ? rings[i].head : rings[i].mask + 1;
+    }
+
+    merged_event_t* events = (merged_event_t*) malloc((count + 1) * sizeof(merged_event_t));
+    if (events == NULL) {
+        return 1;
+    }
+
+    // only the events that weren't overwritten, oldest first
+    size_t next = 0;
+    for (uint32_t i = 0; i < ring_count; i++) {
+        uint64_t size = rings[i].mask + 1;
+        uint64_t start = rings[i].head > size ? rings[i].head - size : 0;
+
+        for (uint64_t sequence = start; sequence < rings[i].head; sequence++) {
+            events[next].event = rings[i].events[sequence & rings[i].mask];
+            events[next].carrier = i;
+            events[next].sequence = sequence;
+            next += 1;
+        }
+    }
+
+    qsort(events, count, sizeof(merged_event_t), compare_merged_events);
+
+    json_writer_t writer;
+    writer.file = fopen(path, "w");
+    if (writer.file == NULL) {
+        free(events);
+        return 1;
+    }
+    writer.first = 1;
+    writer.base_time = count > 0 ? events[0].event.time : 0;
+    writer.cycles_per_us = cycles_per_us > 0 ? cycles_per_us : 1;
+
+    thread_state_t* states = NULL;
+    size_t capacity = 0;
+
+    fprintf(writer.file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+
+    for (size_t i = 0; i < count; i++) {
+        trace_event_t* event = &(events[i].event);
+
+        if (event->type == TRACE_CREATE && get_state(&states, &capacity, event->object) == NULL) {
+            break; // out of memory, the trace is cut here
+        }
+
+        // looked up after the object, growing the array moves it
+        thread_state_t* state = get_state(&states, &capacity, event->thread);
+        if (state == NULL) {
+            break;
+        }
+
+        thread_state_t* object_state = NULL;
+        if (event->type == TRACE_CREATE) {
+            object_state = &(states[event->object]);
+        }
+
+        write_event(&writer, &events[i], state, object_state);
+    }
+
+    write_name(&writer, "process_name", THREADS_PID, 0, "user level threads", 0);
+    write_name(&writer, "process_name", CARRIERS_PID, 0, "carriers", 0);
+    for (uint64_t thread = 0; thread < capacity; thread++) {
+        if (states[thread].seen) {
+            write_name(&writer, "thread_name", THREADS_PID, thread, "ult ", thread);
+        }
+    }
+    for (uint32_t i = 0; i < ring_count; i++) {
+        write_name(&writer, "thread_name", CARRIERS_PID, i, "carrier ", i);
+    }
+
+    fprintf(writer.file, "\n]}\n");
+
+    int failed = ferror(writer.file);
+    if (fclose(writer.file) != 0) {
+        failed = 1;
+    }
+
+    free(states);
+    free(events);
+
+    return failed ? 1 : 0;
+}
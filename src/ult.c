@@ -1,679 +1,4675 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <signal.h>
 #include <errno.h>
 #include <string.h>
+#include <sched.h>
+#include <pthread.h>
+#include <ucontext.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdatomic.h>
 #include <sys/types.h>
-
-#include <valgrind/valgrind.h>
+#include <sys/syscall.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <dlfcn.h>
+#include <linux/futex.h>
 
 #include "ult.h"
 #include "linked_list.h"
+#include "heap.h"
+#include "uring.h"
+#include "trace.h"
+#include "arena.h"
 
-#define CLOCKID CLOCK_PROCESS_CPUTIME_ID // can use CLOCK_THREAD_CPUTIME_ID, CLOCK_PROCESS_CPUTIME_ID
-#define SLEEP_CLOCK CLOCK_REALTIME
+#define SLEEP_CLOCK CLOCK_MONOTONIC // the wall clock can jump, the futex timeouts of the idle carriers are measured on the monotonic clock too
 #define TIMER_SIG SIGUSR1
 #define DEADLOCK_SIG SIGUSR2
-#define TIMER_INTERVAL_NS 1000000 //ns = 1ms
+#define TIMER_RETRY_NS 100000 // when the timer hits a thread that can't be switched out right now (inside libc), it tries again after this
+#define TIMER_RETRIES 4         // retries per slice, then the thread gets another full slice (or yields at its next call into the library)
+
+#ifndef sigev_notify_thread_id // older glibc headers don't name the field
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+#define RUN_QUEUE_SIZE 256 // must be a power of 2, threads that don't fit go to the shared overflow list
+#define AGING_PICKS 128 // every this many picks a carrier moves the oldest thread of every passed over priority up a level
+#define AGING_SLICES 8 // and every this many time slices, the picks come slowly when the threads run their full slices
+#define FAIR_WAKEUP_CREDIT_NS 3000000 // how far behind the others a woken thread can be, the time it slept doesn't count as time it didn't get
+#define IDLE_STACK_SIZE 0x10000
+#define SPINS_BEFORE_YIELD 64
+#define REACTOR_BATCH 64 // events handled by one epoll_wait
+#define REACTOR_WAKEUP UINT64_MAX // epoll data of the eventfd that interrupts the carrier blocked in epoll_wait
+#define REACTOR_IO (UINT64_MAX - 1) // epoll data of the io engine, readable when there are completed file operations
+#define URING_ENTRIES 256
+#define URING_SUBMIT_BATCH 32 // the prepared operations are submitted when this many are waiting, even if the carrier has other threads to run
+#define IO_HELPER_THREADS 16
+#define CLOCK_CALIBRATION_NS 10000000 // the cycle counter is converted to nanoseconds with the rate measured over at least this long
+#define NOT_BLOCKED ULT_BLOCK_REASONS
+
+// the runnable argument of SCHEDULER, 0 if the current thread blocked
+#define YIELDED 1
+#define PREEMPTED 2
+
+// the state of a rwlock, the readers are counted above the two bits
+#define RWLOCK_WRITER ((uint64_t) 1)
+#define RWLOCK_WAITERS ((uint64_t) 2) // there are threads in the waiting queue, the lock is only taken and released under the scheduler lock while it is set
+#define RWLOCK_READER ((uint64_t) 4)
+#define rwlock_readers(state) ((state) / RWLOCK_READER)
+
+// the state of a semaphore, the value is counted above the waiters bit
+#define SEM_WAITERS ((uint64_t) 1) // there are threads in the waiting queue, the value is only changed under the scheduler lock while it is set
+#define SEM_UNIT ((uint64_t) 2)
+
+// a Chase-Lev style work stealing deque with a fixed size circular buffer
+// only the owner carrier pushes (at the bottom), the owner and the thieves take from the top
+// the owner takes from the top too (instead of popping the bottom) so the threads keep their round robin order
+typedef struct ult_deque_t {
+    _Atomic int64_t     top __attribute__((aligned(64)));
+    _Atomic int64_t     bottom __attribute__((aligned(64)));
+    _Atomic(ult_t*)     slots[RUN_QUEUE_SIZE];
+} ult_deque_t;
+
+// what the lock profiler knows about a mutex or a cond, it is in a list until the mutex / cond is destroyed
+// the stats of a mutex are only changed by its owner (the waiters count under the scheduler lock), the ones of a cond under the scheduler lock
+typedef struct ult_lock_profile_t {
+    uint64_t                    id;
+    uint8_t                     is_cond;
+    ult_lock_stats_t            stats;          // the times in cycles
+    ult_cond_stats_t            cond_stats;
+    uint64_t                    acquired_at;    // when a sampled acquisition took the mutex (cycles), 0 if the current one is not sampled
+    struct ult_lock_profile_t*  prev;
+    struct ult_lock_profile_t*  next;
+} ult_lock_profile_t;
+
+// a kernel thread that runs user level threads
+typedef struct carrier_t {
+    uint32_t            index;
+    pthread_t           pthread;
+    timer_t             timer;          // one shot, only armed while there is something else to run
+    volatile uint8_t    timer_armed;    // cleared by the timer signal
+    uint64_t            switches;       // counts the switches, the timer knows if the current thread got a full slice
+    uint64_t            armed_switches; // the switch count when the timer was armed
+    uint8_t             preempt_retries; // the retries that found the current thread outside of the program's code since it was switched in
+    ult_deque_t         run_queues[ULT_PRIORITY_LEVELS];
+    _Atomic uint32_t    ready_mask;     // bit p is set if run_queues[p] might have threads, only written by the owner (it clears a bit when it finds the queue empty)
+    uint32_t            picks;          // threads taken from the run queues, counts the time for aging
+    uint32_t            slices;         // threads that gave up the carrier while still runnable (preempted or yielding)
+    ult_heap_t          fair_queue;     // the ready threads ordered by vruntime, used instead of the run queues by the fair policy
+    atomic_flag         fair_lock;      // the fair queue is shared with the thieves, they only try to take it
+    uint64_t            min_vruntime;   // the vruntime of the last thread picked from the fair queue, only moves forward
+    uint64_t            charged_at;     // when the scheduler charged the current thread last, the next one starts counting from there
+    uint64_t            run_since;      // when the current thread was switched in, in cycles (for the stats)
+    ult_t*              switched_from;  // the thread that the carrier switched away from, its context is saved only after the switch returns
+    ult_t*              handoff;        // the next thread, when it has to be waited for from the idle context
+    ult_context_t       idle_context;   // the carrier's own stack, the carrier waits here for work when it has nothing to run
+    char*               idle_stack;     // only allocated for the main carrier, the others idle on their pthread stack
+    _Atomic uint32_t    parked;         // futex word, set while the carrier sleeps waiting for work
+} __attribute__((aligned(64))) carrier_t;
 
 static ult_t main_ult;
-
-static ult_linked_list_t running_ult_list, not_finished_ults;
-static volatile uint64_t ult_counter = 0;
-static volatile uint64_t mutex_counter = 0;
-static volatile uint64_t cond_counter = 0;
-static uint32_t deadlock_counter = 0; // this value combined with the explore counter in the ult structure will indicate if a node in the lock graph was already explored in the current stage
-                                      // we don't care about overflows, by this reason this variable could have been byte sized, but for alignment reasons the structure will use a 32bit unsigned
-
-// alarm triggered?
-static volatile uint8_t should_change_thread = 0;
-static volatile uint8_t inside_protected_zone = 0;  // we still need to ignore signals even if we mask them, because masking will keep the signal until it is unmasked, 
-                                                    // but we don't want to execute that signal immediately, because we would still be in the scheduler
-sigset_t mask_sig, no_mask;
-
-// Calling a function that creates a protected zone inside a protected zone will end all the protection zones upon returning (assuming protection zones are NOT reentrant)
-// This means that to ensure the continuity of the protection zone no other function that creates protection zones should be called inside the protection zone
-// Fixing this problem is also tricky. You can:
-//      1. Duplicate the needed code so it doesn't overwrite the protection zone (leads to code duplication, not ideal)
-//      2. Make the protection zones reentrant using a counter (leads to problems when manually calling the SCHEDULER function as it would require all protection zones to be exitted before calling)
+static ult_sched_policy sched_policy = ULT_SCHED_PRIORITY;
+
+static carrier_t* carriers = NULL;
+static uint32_t carrier_count = 0;  // 0 means the number of online CPUs
+static _Atomic uint32_t idle_carriers = 0;
+static _Atomic(carrier_t*) timer_keeper = NULL; // the idle carrier that sleeps until the first sleeping thread has to wake up, the others sleep until they are woken
+
+static __thread carrier_t* this_carrier = NULL;
+static __thread ult_t* current_ult = NULL;
+
+static ult_queue_t not_finished_ults;
+static ult_queue_t overflow_ults[ULT_PRIORITY_LEVELS];
+static _Atomic uint32_t overflow_mask = 0; // bit p is set if overflow_ults[p] is not empty, changed under the overflow lock
+static ult_heap_t sleeping_ults; // ordered by wake time, protected by the timer lock
+static _Atomic uint64_t next_wake_time = UINT64_MAX; // wake time of the first sleeping thread, lets the scheduler skip the lock when nothing expired
+static _Atomic uint64_t ult_counter = 0;
+static _Atomic uint64_t time_slice_ns = ULT_TIME_SLICE_DEFAULT_NS;
+static uint64_t clock_base_cycles = 0;  // the cycle counter and the monotonic clock when the library started
+static uint64_t clock_base_ns = 0;
+static ult_stats_t joined_stats;        // the counters of the joined threads, protected by the scheduler lock
+static _Atomic uint32_t lock_sample_period = 0; // the lock profiler is off while this is 0
+static uint64_t lock_cycles_per_us = 1;         // the hold times are put in the histogram buckets without a division by a double
+static trace_ring_t* trace_rings = NULL;       // one per carrier, allocated by the first ult_trace_start
+static size_t trace_ring_events = 0;
+static volatile uint8_t tracing = 0;            // the events are only recorded while this is set
+static volatile uint8_t deadlock_avoidance = 0; // lock and join refuse the waits that would close a cycle
+static _Atomic uint64_t mutex_counter = 0;
+static _Atomic uint64_t cond_counter = 0;
+static _Atomic uint64_t rwlock_counter = 0;
+static uint32_t deadlock_counter = 0; // the deadlock check that runs now, a thread or cond with the same stage already has a node in the wait-for graph (overflows don't matter)
+
+// protects everything that is shared between carriers: the wait lists of the mutexes and condition variables, joins and the not finished list
+// the run queues are lock free and don't need it
+// it is only taken inside a protected zone, so the owner can't be preempted while holding it
+static atomic_flag scheduler_lock = ATOMIC_FLAG_INIT;
+static atomic_flag overflow_lock = ATOMIC_FLAG_INIT; // a thread can be made ready while the scheduler lock is held, so the overflow list has its own lock
+static atomic_flag timer_lock = ATOMIC_FLAG_INIT;
+static atomic_flag profile_lock = ATOMIC_FLAG_INIT; // protects the list of the lock profiles
+static atomic_flag io_lock = ATOMIC_FLAG_INIT; // protects fd_waiters, it can be taken while holding the timer lock (never the other way around)
+
+static int reactor_fd = -1;                 // epoll instance shared by all the carriers, the fds are armed one shot for a single waiting thread
+static int reactor_wakeup_fd = -1;          // eventfd in the reactor, written to wake the time keeper out of epoll_wait
+static ult_t** fd_waiters = NULL;           // the thread waiting on every fd, indexed by fd
+static size_t fd_waiters_size = 0;
+static _Atomic uint32_t io_waiters = 0;     // threads waiting for an fd, the carriers only poll the reactor if this is not 0
+
+// a file operation of a waiting thread, it lives on the stack of the thread until the operation completes
+typedef struct io_request_t {
+    uint8_t                 opcode;     // IORING_OP_*, the helper threads use the same codes
+    int                     fd;
+    void*                   buf;
+    size_t                  count;
+    off_t                   offset;     // -1 uses (and moves) the file position
+    const char*             path;
+    int                     flags;
+    mode_t                  mode;
+    int64_t                 result;     // what the system call returns, -errno on error
+    ult_t*                  thread;
+    struct io_request_t*    next;       // links the request in the queues of the helper threads
+} io_request_t;
+
+static ult_io_engine io_engine = ULT_IO_URING;
+static _Atomic uint32_t io_inflight = 0;    // file operations handed to the engine and not reaped yet, the carriers only reap if this is not 0
+
+static uring_t ring;                        // shared by all the carriers, the operations are prepared in it and submitted in batches by the scheduler
+static atomic_flag ring_lock = ATOMIC_FLAG_INIT;
+
+static pthread_mutex_t helper_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t helper_cond = PTHREAD_COND_INITIALIZER;
+static io_request_t* helper_first = NULL;   // the requests the helper threads haven't taken yet, protected by the helper lock
+static io_request_t* helper_last = NULL;
+static _Atomic(io_request_t*) helper_done = NULL; // the completed requests, pushed by the helpers and taken all at once by the scheduler
+static int helper_done_fd = -1;             // eventfd in the reactor, written by the helpers after a completion
+
+static volatile sig_atomic_t deadlock_check_requested = 0;
+
+static void run_requested_deadlock_check();
+static int claim_fd_waiter(int fd, ult_t* thread);
+static int reap_io(carrier_t* carrier, uint8_t submit);
+static int has_ready(carrier_t* carrier);
+static void wake_rwlock_waiters(ult_rwlock_t* rwlock);
+static void init_park_table();
+static void expire_park(carrier_t* carrier, ult_t* thread);
+static __attribute__((noinline)) ult_t* get_current();
+void SCHEDULER(ult_t* current, uint8_t runnable);
+
+// A protected zone keeps the timer from switching the current thread out, it costs no system calls
+// Every thread counts how deep it is in protected zones. The timer handler doesn't switch a thread that is inside a zone,
+// it only leaves a note (preempt_pending) and the switch is done when the outermost zone ends.
+// The zones are reentrant, a function that creates a zone can be called from inside another zone.
+// SCHEDULER must be called from the outermost zone, the zone is ended by the thread that is switched in.
+// The state belongs to the thread, not to the carrier, so it stays right if the thread moves to another carrier in the middle of a zone.
+// The idle loop runs without a current thread and it is always protected.
+// A zone only protects the thread from being switched out, the other carriers have to be kept out with the scheduler lock
 
 static void start_protected_zone() {
-    inside_protected_zone = 1;
-    sigprocmask(SIG_BLOCK, &mask_sig, NULL);
+    ult_t* current = get_current();
+
+    if (current != NULL) {
+        // a signal that lands in the middle of the increment is handled completely before it's done, it can't see a half updated value
+        current->preempt_depth += 1;
+        atomic_signal_fence(memory_order_seq_cst);
+    }
 }
 
 static void end_protected_zone() {
-    sigprocmask(SIG_SETMASK, &no_mask, NULL);
-    inside_protected_zone = 0;
+    ult_t* current = get_current();
+
+    if (current == NULL) {
+        return;
+    }
+
+    if (current->preempt_depth == 1) {
+        if (deadlock_check_requested) {
+            run_requested_deadlock_check();
+        }
+
+        if (current->preempt_pending) {
+            // the timer expired inside the zone, do the switch now (SCHEDULER ends the zone)
+            current->preempt_pending = 0;
+            SCHEDULER(current, PREEMPTED);
+            return;
+        }
+    }
+
+    // a timer signal right before this only sets preempt_pending, the thread will yield at the end of its next zone or at the next signal
+    atomic_signal_fence(memory_order_seq_cst);
+    current->preempt_depth -= 1;
 }
 
-// TODO: what happens if a thread finished without releasing resources? 
-//       It would be a deadlock situation, but not ciclycal!
-//       worst part: if the thread is joined it can also be freed
-void find_deadlocks() {
-    start_protected_zone();
+// a user level thread can move to another carrier whenever it is switched out
+// the thread local variables are read through these functions so the compiler can't reuse the address of the previous carrier's variable after a switch
+static __attribute__((noinline)) carrier_t* get_carrier() {
+    return this_carrier;
+}
 
-    deadlock_counter += 1;
+static __attribute__((noinline)) ult_t* get_current() {
+    return current_ult;
+}
 
-    ult_linked_list_t explore_stack, path;
-    init_ult_linked_list(&explore_stack);
-    init_ult_linked_list(&path);
+static __attribute__((noinline)) void set_current(ult_t* thread) {
+    current_ult = thread;
+}
 
-    uint64_t found_deadlocks = 0;
+static inline void cpu_relax(uint32_t* spins) {
+    // on an oversubscribed machine the thread we wait after might not be running at all
+    if (++(*spins) % SPINS_BEFORE_YIELD == 0) {
+        sched_yield();
+    }
+#if defined(__x86_64__)
+    else __builtin_ia32_pause();
+#endif
+}
 
-    ult_node_t* candidate = not_finished_ults.head;
-    while (candidate != NULL) { // start exploring from the current node
-        insert_ult_first(&explore_stack, candidate->ult);
+static inline void spin_lock(atomic_flag* lock) {
+    uint32_t spins = 0;
+    while (atomic_flag_test_and_set_explicit(lock, memory_order_acquire)) {
+        cpu_relax(&spins);
+    }
+}
 
-        while(explore_stack.size > 0) {
-            ult_t* current = explore_stack.head->ult; delete_ult_first(&explore_stack);
+static inline void spin_unlock(atomic_flag* lock) {
+    atomic_flag_clear_explicit(lock, memory_order_release);
+}
 
-            if (current == NULL) {
-                // we explored the current node entirely, now backtrack a level
-                delete_ult_last(&path);
-                continue;
-            }
+static void lock_scheduler() {
+    spin_lock(&scheduler_lock);
+}
 
-            if (current->deadlock_explore_counter == deadlock_counter) {
-                // the node is already explored
-                // look after a cycle in the explored path
-
-                ult_node_t* path_node = path.head;
-                uint8_t deadlock = 0;
-                while (path_node != NULL) {
-                    if (deadlock) {
-                        // we found a deadlock, continue by printing the threads caugth in the deadlock cycle
-                        printf(" -> %lu", path_node->ult->id);
-                    } 
-                    else if (current->id == path_node->ult->id) {
-                        found_deadlocks += 1;
-                        deadlock = 1;
-
-                        if (found_deadlocks == 1) {
-                            printf("\n\n====\n\n");
-                        }
-
-                        printf ("Deadlock %lu:\n %lu", found_deadlocks, current->id);
-                    }
-                    path_node = path_node->next;
-                }
-                if (deadlock) {
-                    printf(" -> %lu \n\n", current->id); fflush(NULL);
-                }
-                continue;
-            }
+static void unlock_scheduler() {
+    spin_unlock(&scheduler_lock);
+}
 
-            // the current thread is not explored
-            current->deadlock_explore_counter = deadlock_counter;
-            
-            insert_ult_last(&path, current);
-            insert_ult_first(&explore_stack, NULL);
+////////////////////// RUN QUEUES //////////////////////
 
-            ult_t* next_candidate = NULL;
+static inline int deque_push(ult_deque_t* deque, ult_t* thread) {
+    int64_t bottom = atomic_load_explicit(&(deque->bottom), memory_order_relaxed);
+    int64_t top = atomic_load_explicit(&(deque->top), memory_order_acquire);
 
-            next_candidate = current->waiting_to_join;
-            if (next_candidate != NULL) {
-                insert_ult_first(&explore_stack, next_candidate);
-            }
+    if (bottom - top >= RUN_QUEUE_SIZE) {
+        return 0; // full
+    }
 
-            if (current->waiting_mutex != NULL) {
-                next_candidate = current->waiting_mutex->owner;
-                insert_ult_first(&explore_stack, next_candidate);
-            }
+    atomic_store_explicit(&(deque->slots[bottom & (RUN_QUEUE_SIZE - 1)]), thread, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&(deque->bottom), bottom + 1, memory_order_relaxed);
 
-            if (current->waiting_cond != NULL) {
-                // the thread is waiting a condition
-                // any thread that is not waiting the same condition is a potential signaler
-                ult_node_t* aux = not_finished_ults.head;
-                while(aux != NULL) {
-                    ult_t* c = aux->ult;
+    return 1;
+}
 
-                    if (c->waiting_cond == NULL || c->waiting_cond->id != current->waiting_cond->id) {
-                        // not waiting the same cond
-                        insert_ult_first(&explore_stack, c);
-                    }
-                    
-                    aux = aux->next;
-                }
+static inline ult_t* deque_take(ult_deque_t* deque) {
+    while (1) {
+        int64_t top = atomic_load_explicit(&(deque->top), memory_order_acquire);
+        atomic_thread_fence(memory_order_seq_cst);
+        int64_t bottom = atomic_load_explicit(&(deque->bottom), memory_order_acquire);
+
+        if (top >= bottom) {
+            return NULL; // empty
+        }
+
+        // the slot can't be reused before top moves past it, because the owner considers the deque full
+        ult_t* thread = atomic_load_explicit(&(deque->slots[top & (RUN_QUEUE_SIZE - 1)]), memory_order_relaxed);
+
+        if (atomic_compare_exchange_strong_explicit(&(deque->top), &top, top + 1, memory_order_seq_cst, memory_order_relaxed)) {
+            return thread;
+        }
+        // lost the race with another carrier, try again
+    }
+}
+
+static inline int64_t deque_size(ult_deque_t* deque) {
+    int64_t bottom = atomic_load_explicit(&(deque->bottom), memory_order_acquire);
+    int64_t top = atomic_load_explicit(&(deque->top), memory_order_acquire);
+    return bottom > top ? bottom - top : 0;
+}
+
+// deadline is an absolute SLEEP_CLOCK time, UINT64_MAX waits forever
+static void futex_wait(_Atomic uint32_t* word, uint32_t value, uint64_t deadline) {
+    if (deadline == UINT64_MAX) {
+        syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+    }
+    else {
+        // FUTEX_WAIT_BITSET takes an absolute CLOCK_MONOTONIC timeout
+        struct timespec timeout = { .tv_sec = deadline / 1000000000, .tv_nsec = deadline % 1000000000 };
+        syscall(SYS_futex, word, FUTEX_WAIT_BITSET_PRIVATE, value, &timeout, NULL, FUTEX_BITSET_MATCH_ANY);
+    }
+}
+
+static void futex_wake(_Atomic uint32_t* word) {
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+// returns 0 if the carrier wasn't parked (or somebody else woke it first)
+static int wake_carrier(carrier_t* carrier) {
+    uint32_t expected = 1;
+
+    if (atomic_compare_exchange_strong(&(carrier->parked), &expected, 0)) {
+        atomic_fetch_sub(&idle_carriers, 1);
+        futex_wake(&(carrier->parked));
+
+        // the time keeper waits in epoll_wait, not on the futex
+        if (atomic_load(&timer_keeper) == carrier) {
+            uint64_t one = 1;
+            if (write(reactor_wakeup_fd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+                BAIL("Wake reactor");
             }
         }
-        candidate = candidate->next;
+
+        return 1;
+    }
+
+    return 0;
+}
+
+static void wake_idle_carrier() {
+    if (atomic_load(&idle_carriers) == 0) {
+        return;
+    }
+
+    for (uint32_t i = 0; i < carrier_count; i++) {
+        if (wake_carrier(&carriers[i])) {
+            return;
+        }
+    }
+}
+
+////////////////////// PREEMPTION TIMER //////////////////////
+
+// every carrier has a one shot timer on the monotonic clock that interrupts only that carrier
+// it is armed when a thread is switched in and there is something else that needs the carrier: another ready thread,
+// a sleeping thread or a thread waiting for io (with the busy carriers the scheduler is the only one that wakes them)
+// a carrier running its only thread gets no signals at all
+// the timer is not armed again on every switch, a thread that was switched in after the timer was armed gets a new slice when it fires
+
+static void set_timer(carrier_t* carrier, uint64_t nsec) {
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its)); // no interval, one shot (zero disarms)
+    its.it_value.tv_sec = nsec / 1000000000;
+    its.it_value.tv_nsec = nsec % 1000000000;
+
+    // the flag is changed first, a signal that comes right after the call must find it set
+    carrier->timer_armed = nsec != 0;
+    carrier->armed_switches = carrier->switches;
+
+    if (timer_settime(carrier->timer, 0, &its, NULL) == -1) {
+        BAIL("Timer Settime");
+    }
+}
+
+// the work a slice should end for, besides the threads in the carrier's own run queues
+// the sleepers and the fds only count while no idle carrier keeps the time, then the scheduler of the busy carriers is the only one that looks at them
+static inline int needs_timer_elsewhere() {
+    if (atomic_load_explicit(&overflow_mask, memory_order_relaxed) != 0) {
+        return 1;
+    }
+
+    if (atomic_load_explicit(&timer_keeper, memory_order_relaxed) != NULL) {
+        return 0;
+    }
+
+    return atomic_load_explicit(&next_wake_time, memory_order_relaxed) != UINT64_MAX
+        || atomic_load_explicit(&io_waiters, memory_order_relaxed) != 0
+        || atomic_load_explicit(&io_inflight, memory_order_relaxed) != 0;
+}
+
+static inline int needs_timer(carrier_t* carrier) {
+    return atomic_load_explicit(&(carrier->ready_mask), memory_order_relaxed) != 0 || needs_timer_elsewhere();
+}
+
+// called on the carrier itself, while it runs a thread
+static inline void arm_timer(carrier_t* carrier) {
+    if (!carrier->timer_armed && needs_timer(carrier)) {
+        set_timer(carrier, atomic_load_explicit(&time_slice_ns, memory_order_relaxed));
+    }
+}
+
+static void disarm_timer(carrier_t* carrier) {
+    if (carrier->timer_armed) {
+        set_timer(carrier, 0);
+    }
+}
+
+static uint64_t get_time_ns() {
+    struct timespec current_time;
+
+    if (clock_gettime(SLEEP_CLOCK, &current_time) == -1) {
+        BAIL("Get Time");
+    }
+
+    return (uint64_t) current_time.tv_sec * 1000000000 + current_time.tv_nsec;
+}
+
+////////////////////// ACCOUNTING //////////////////////
+
+// the stats are counted with the cycle counter of the cpu, reading it costs a few cycles (clock_gettime costs a few dozen nanoseconds)
+// the counter is constant rate on the cpus that matter here, it is converted only when the stats are read
+static inline uint64_t read_cycles() {
+#if defined(__x86_64__)
+    uint32_t low, high;
+    __asm__ volatile ("rdtsc" : "=a" (low), "=d" (high));
+    return ((uint64_t) high << 32) | low;
+#elif defined(__aarch64__)
+    uint64_t cycles;
+    __asm__ volatile ("mrs %0, cntvct_el0" : "=r" (cycles));
+    return cycles;
+#else
+    return get_time_ns();
+#endif
+}
+
+// the rate is measured against the monotonic clock since the library started (the first call might wait for the measurement)
+static double cycles_per_ns() {
+    uint64_t ns = get_time_ns();
+
+    if (ns - clock_base_ns < CLOCK_CALIBRATION_NS) {
+        struct timespec wait = { .tv_sec = 0, .tv_nsec = (long) (CLOCK_CALIBRATION_NS - (ns - clock_base_ns)) };
+        nanosleep(&wait, NULL);
+        ns = get_time_ns();
+    }
+
+    return (double) (read_cycles() - clock_base_cycles) / (double) (ns - clock_base_ns);
+}
+
+static void add_stats(ult_stats_t* total, const ult_stats_t* stats) {
+    total->run_ns += stats->run_ns;
+    total->voluntary_switches += stats->voluntary_switches;
+    total->involuntary_switches += stats->involuntary_switches;
+    total->wakeups += stats->wakeups;
+
+    for (int reason = 0; reason < ULT_BLOCK_REASONS; reason++) {
+        total->blocked_ns[reason] += stats->blocked_ns[reason];
+    }
+}
+
+static void stats_to_ns(ult_stats_t* stats) {
+    double rate = cycles_per_ns();
+
+    stats->run_ns = (uint64_t) (stats->run_ns / rate);
+    for (int reason = 0; reason < ULT_BLOCK_REASONS; reason++) {
+        stats->blocked_ns[reason] = (uint64_t) (stats->blocked_ns[reason] / rate);
+    }
+}
+
+// called by a thread that is about to block, before another carrier can find it in a waiting list and wake it up
+static inline void start_blocking(ult_t* thread, ult_block_reason reason) {
+    thread->block_reason = reason;
+    thread->blocked_at = read_cycles();
+}
+
+// the thread is being made ready on the carrier, the time it was blocked is over
+static inline void end_blocking(carrier_t* carrier, ult_t* thread) {
+    if (thread->block_reason != NOT_BLOCKED) {
+        uint64_t now = read_cycles();
+
+        thread->stats.blocked_ns[thread->block_reason] += now - thread->blocked_at;
+        thread->stats.wakeups += 1;
+
+        if (tracing) {
+            // the idle loop wakes up the sleepers and the io waiters, nobody in particular
+            ult_t* waker = get_current();
+            trace_ring_record(&trace_rings[carrier->index], now, TRACE_WAKE, thread->block_reason, thread->id, waker != NULL ? waker->id : 0);
+        }
+
+        thread->block_reason = NOT_BLOCKED;
     }
+}
 
-    printf("====\nFound %lu deadlocks\n====\n\n", found_deadlocks); fflush(NULL);
+// records an event of the running thread on the ring of its carrier, must be called inside a protected zone (every ring has a single writer)
+static inline void trace_event(uint8_t type, uint8_t detail, uint64_t object) {
+    trace_ring_record(&trace_rings[get_carrier()->index], read_cycles(), type, detail, get_current()->id, object);
+}
 
+// the same from the fast paths that don't enter the runtime
+static void trace_current(uint8_t type, uint8_t detail, uint64_t object) {
+    start_protected_zone();
+    trace_event(type, detail, object);
     end_protected_zone();
 }
 
-static inline void init_ult(ult_t* ult, uint64_t id, voidptr_arg_voidptr_ret_func start_routine, void* arg) {
-    ult->id     = id;
-    ult->status = RUNNING;
-    ult->result = NULL;
+static inline int highest_priority(uint32_t mask) {
+    return 31 - __builtin_clz(mask);
+}
+
+// only the owner of the run queues pushes, the bit is set after the thread is visible in the queue
+static void push_priority(carrier_t* carrier, ult_t* thread, uint32_t priority) {
+    if (deque_push(&(carrier->run_queues[priority]), thread)) {
+        uint32_t mask = atomic_load_explicit(&(carrier->ready_mask), memory_order_relaxed);
+        if (!(mask & (1u << priority))) {
+            atomic_store_explicit(&(carrier->ready_mask), mask | (1u << priority), memory_order_release);
+        }
+        return;
+    }
+
+    spin_lock(&overflow_lock);
+    ult_queue_push_last(&overflow_ults[priority], &(thread->queue_link));
+    atomic_fetch_or(&overflow_mask, 1u << priority);
+    spin_unlock(&overflow_lock);
+}
+
+// only the owner of the fair queue pushes, the thieves only take
+static void push_fair(carrier_t* carrier, ult_t* thread) {
+    spin_lock(&(carrier->fair_lock));
+
+    // a thread that was waiting has a head start of at most FAIR_WAKEUP_CREDIT_NS, it can't take the carrier for as long as it slept
+    uint64_t floor = carrier->min_vruntime > FAIR_WAKEUP_CREDIT_NS ? carrier->min_vruntime - FAIR_WAKEUP_CREDIT_NS : 0;
+    if (thread->vruntime < floor) {
+        thread->vruntime = floor;
+    }
+
+    ult_heap_push(&(carrier->fair_queue), thread);
+    atomic_store_explicit(&(carrier->ready_mask), 1, memory_order_release);
+
+    spin_unlock(&(carrier->fair_lock));
+}
+
+// puts a thread on the run queue of its priority (or in the fair queue), on the carrier executing this code
+static void push_ready(carrier_t* carrier, ult_t* thread) {
+    end_blocking(carrier, thread);
+
+    if (sched_policy == ULT_SCHED_FAIR) {
+        push_fair(carrier, thread);
+    }
+    else {
+        push_priority(carrier, thread, thread->priority);
+    }
+
+    // the running thread is not alone anymore (an idle carrier has no current thread, it is armed when it switches one in)
+    // a preempted or yielding thread pushes itself, the scheduler decides after it picked the next one
+    ult_t* current = get_current();
+    if (current != NULL && current != thread) {
+        arm_timer(carrier);
+    }
+
+    wake_idle_carrier();
+}
+
+// takes the thread that ran the least from the fair queue of a carrier (the own one or a victim's)
+static ult_t* take_fair(carrier_t* carrier, carrier_t* self) {
+    if (carrier == self) {
+        spin_lock(&(carrier->fair_lock));
+    }
+    else if (atomic_flag_test_and_set_explicit(&(carrier->fair_lock), memory_order_acquire)) {
+        return NULL; // busy, try the next victim
+    }
+
+    ult_t* thread = ult_heap_pop(&(carrier->fair_queue));
+
+    if (carrier == self && carrier->fair_queue.size == 0) {
+        // the mask tells the timer if anything else waits for the carrier
+        atomic_store_explicit(&(carrier->ready_mask), 0, memory_order_relaxed);
+    }
+
+    if (thread == NULL) {
+        // nothing to adjust
+    }
+    else if (carrier == self) {
+        if (thread->vruntime > carrier->min_vruntime) {
+            carrier->min_vruntime = thread->vruntime;
+        }
+    }
+    else {
+        // the carriers count vruntime from different points, the thread keeps its distance to the threads around it
+        int64_t distance = (int64_t) (thread->vruntime - carrier->min_vruntime);
+        thread->vruntime = distance < 0 && (uint64_t) -distance > self->min_vruntime ? 0 : self->min_vruntime + distance;
+    }
+
+    spin_unlock(&(carrier->fair_lock));
+
+    return thread;
+}
+
+// adds the time the current thread ran since it was switched in to its vruntime
+static void charge_runtime(carrier_t* carrier, ult_t* current) {
+    uint64_t now = get_time_ns();
+
+    current->vruntime += (now - current->run_start) * ULT_WEIGHT_DEFAULT / current->weight;
+    current->run_start = now; // it might continue running
+    carrier->charged_at = now;
+}
+
+// takes the oldest thread of the highest priority from the run queues of a carrier (the own ones or a victim's)
+// the mask is only a hint for the thieves, a thread pushed right now might be missed (the parking carriers look at the queues themselves)
+static ult_t* take_ready(carrier_t* carrier, carrier_t* self) {
+    if (sched_policy == ULT_SCHED_FAIR) {
+        return take_fair(carrier, self);
+    }
+
+    uint8_t owner = carrier == self;
+    uint32_t mask = atomic_load_explicit(&(carrier->ready_mask), memory_order_acquire);
+
+    while (mask != 0) {
+        int priority = highest_priority(mask);
+
+        ult_t* thread = deque_take(&(carrier->run_queues[priority]));
+
+        if (owner && deque_size(&(carrier->run_queues[priority])) == 0) {
+            // nobody else pushes to this queue, it stays empty until the owner pushes again
+            // (cleared right after the last thread is taken, the timer must not keep ticking for a thread that runs alone)
+            atomic_store_explicit(&(carrier->ready_mask), atomic_load_explicit(&(carrier->ready_mask), memory_order_relaxed) & ~(1u << priority), memory_order_relaxed);
+        }
+
+        if (thread != NULL) {
+            return thread;
+        }
+
+        mask &= ~(1u << priority);
+    }
+
+    return NULL;
+}
+
+static ult_t* take_overflow() {
+    ult_t* thread = NULL;
+
+    spin_lock(&overflow_lock);
+
+    uint32_t mask = atomic_load(&overflow_mask);
+    if (mask != 0) {
+        int priority = highest_priority(mask);
+
+        thread = ult_queue_pop_first(&overflow_ults[priority]);
+        if (overflow_ults[priority].size == 0) {
+            atomic_fetch_and(&overflow_mask, ~(1u << priority));
+        }
+    }
+
+    spin_unlock(&overflow_lock);
+
+    return thread;
+}
+
+// the threads of the lower priorities only run when the higher queues are empty
+// so that a steady stream of higher priority work can't starve them, the oldest thread of every queue under the highest one is moved up a level
+// the boost is lost when the thread runs, it goes back to the queue of its own priority the next time it is ready
+static void age_run_queues(carrier_t* carrier) {
+    uint32_t mask = atomic_load_explicit(&(carrier->ready_mask), memory_order_relaxed);
+
+    if ((mask & (mask - 1)) == 0) {
+        return; // at most one priority is waiting, nobody is passed over
+    }
+
+    // top down, so a thread is moved only one level at a time
+    for (int priority = highest_priority(mask) - 1; priority >= 0; priority--) {
+        if (!(mask & (1u << priority))) {
+            continue;
+        }
+
+        ult_t* thread = deque_take(&(carrier->run_queues[priority]));
+        if (thread != NULL) {
+            push_priority(carrier, thread, priority + 1);
+        }
+    }
+}
+
+// the caller should be inside a protected zone
+static void make_ready(ult_t* thread) {
+    thread->status = RUNNING;
+    push_ready(get_carrier(), thread);
+}
+
+// must be called with the timer lock held
+static void update_next_wake_time() {
+    ult_t* first = ult_heap_top(&sleeping_ults);
+    atomic_store(&next_wake_time, first != NULL ? first->wake_time : UINT64_MAX);
+}
+
+// the idle carrier keeping the time might sleep until a later thread is due, called when a thread became the first one in the timer heap
+static void wake_timer_keeper() {
+    carrier_t* keeper = atomic_load(&timer_keeper);
+    if (keeper != NULL) {
+        wake_carrier(keeper);
+    }
+}
+
+static uint64_t deadline_after(uint64_t sec, uint64_t nsec) {
+    return get_time_ns() + sec * 1000000000 + nsec;
+}
+
+// the thread waits for a mutex, a cond, a rwlock, a join or a park until the deadline too
+// must be called after the thread is in the waiting list, with the lock that owns the list held (the scheduler lock, or the bucket lock of a parked thread)
+// the timer and the thread that ends the wait race for it, whoever takes it out of the timer heap first wakes it up (claim_waiter)
+// returns 1 if the deadline is the earliest one, the caller wakes up the timer keeper after it releases the scheduler lock
+static uint8_t arm_wait_timeout(ult_t* thread, uint64_t deadline) {
+    thread->timed_wait = 1;
+    thread->timed_out = 0;
+    thread->wake_time = deadline;
+
+    spin_lock(&timer_lock);
+    ult_heap_push(&sleeping_ults, thread);
+    uint8_t earliest = ult_heap_top(&sleeping_ults) == thread;
+    update_next_wake_time();
+    spin_unlock(&timer_lock);
+
+    return earliest;
+}
+
+// returns 1 if the caller can wake the waiting thread up, 0 if its timeout already fired (the timer wakes it, it stays in the waiting list until then)
+// must be called with the lock that owns the waiting list of the thread held (the scheduler lock, or the bucket lock of a parked thread)
+static uint8_t claim_waiter(ult_t* thread) {
+    if (!thread->timed_wait) {
+        return 1;
+    }
+
+    spin_lock(&timer_lock);
+
+    uint8_t claimed = thread->heap_index != NOT_IN_HEAP;
+    if (claimed) {
+        ult_heap_remove(&sleeping_ults, thread);
+        update_next_wake_time();
+        thread->timed_wait = 0;
+    }
+
+    spin_unlock(&timer_lock);
+
+    return claimed;
+}
+
+// the timeout of a wait for a mutex, a cond, a rwlock, a join or a park fired, the timer already took the thread out of the heap so nobody else wakes it up
+// called without the timer lock, the waiting lists are changed under the scheduler lock (which is never taken with the timer lock held)
+static void expire_timed_wait(carrier_t* carrier, ult_t* thread) {
+    if (thread->park_address != NULL) {
+        expire_park(carrier, thread); // the park table has its own locks
+        return;
+    }
+
+    lock_scheduler();
+
+    thread->timed_wait = 0;
+
+    if (thread->waiting_mutex != NULL) {
+        ult_mutex_t* mutex = thread->waiting_mutex;
+
+        ult_queue_remove(&(mutex->waiting), &(thread->queue_link));
+        if (mutex->waiting.size == 0) {
+            atomic_fetch_and_explicit(&(mutex->owner), ~MUTEX_WAITERS, memory_order_relaxed);
+        }
+
+        thread->waiting_mutex = NULL;
+        thread->timed_out = 1;
+    }
+    else if (thread->waiting_cond != NULL) {
+        ult_queue_remove(&(thread->waiting_cond->waiting), &(thread->queue_link));
+        thread->waiting_cond = NULL;
+        thread->timed_out = 1;
+    }
+    else if (thread->waiting_rwlock != NULL) {
+        ult_rwlock_t* rwlock = thread->waiting_rwlock;
+
+        ult_queue_remove(&(rwlock->waiting), &(thread->queue_link));
+        if (thread->rwlock_exclusive) {
+            rwlock->waiting_writers -= 1;
+        }
+
+        thread->waiting_rwlock = NULL;
+        thread->timed_out = 1;
+
+        // the readers that waited behind a writer might fit now
+        wake_rwlock_waiters(rwlock);
+    }
+    else if (thread->waiting_to_join != NULL) {
+        thread->waiting_to_join->joined_by = NULL; // it can be joined again
+        thread->waiting_to_join = NULL;
+        thread->timed_out = 1;
+    }
+    // otherwise the joined thread finished while the timer claimed the joining one, the join succeeds
+
+    thread->status = RUNNING;
+    push_ready(carrier, thread);
+
+    unlock_scheduler();
+}
+
+// moves the sleeping threads whose time has come to the run queue of the carrier
+// when nothing expired this costs a clock read, no matter how many threads are sleeping
+static void wake_sleepers(carrier_t* carrier) {
+    if (atomic_load(&next_wake_time) == UINT64_MAX) {
+        return; // nobody is sleeping
+    }
+
+    uint64_t now = get_time_ns();
+
+    if (now < atomic_load(&next_wake_time)) {
+        return;
+    }
+
+    spin_lock(&timer_lock);
+
+    ult_t* thread = ult_heap_top(&sleeping_ults);
+    while (thread != NULL && thread->wake_time <= now) {
+        ult_heap_pop(&sleeping_ults);
+
+        if (thread->timed_wait) {
+            update_next_wake_time();
+            spin_unlock(&timer_lock);
+
+            expire_timed_wait(carrier, thread);
+
+            spin_lock(&timer_lock);
+        }
+        // a thread waiting for an fd is woken by whoever takes it out of fd_waiters first, the timer or the reactor
+        else if (thread->waiting_fd < 0 || claim_fd_waiter(thread->waiting_fd, thread)) {
+            // the thread should wake up
+            thread->status = RUNNING;
+            push_ready(carrier, thread);
+        }
+
+        thread = ult_heap_top(&sleeping_ults);
+    }
+
+    update_next_wake_time();
+
+    spin_unlock(&timer_lock);
+}
+
+////////////////////// REACTOR //////////////////////
+
+// returns 1 if the thread was still waiting for the fd, the caller is the one that has to wake it up
+static int claim_fd_waiter(int fd, ult_t* thread) {
+    int claimed = 0;
+
+    spin_lock(&io_lock);
+
+    if ((size_t) fd < fd_waiters_size && fd_waiters[fd] == thread) {
+        fd_waiters[fd] = NULL;
+        atomic_fetch_sub(&io_waiters, 1);
+        claimed = 1;
+    }
+
+    spin_unlock(&io_lock);
+
+    return claimed;
+}
+
+// must be called with the io lock held
+static int reserve_fd_waiter(int fd) {
+    if ((size_t) fd < fd_waiters_size) {
+        return 0;
+    }
+
+    size_t new_size = fd_waiters_size == 0 ? 64 : fd_waiters_size * 2;
+    while (new_size <= (size_t) fd) {
+        new_size *= 2;
+    }
+
+    ult_t** new_waiters = (ult_t**) realloc(fd_waiters, new_size * sizeof(ult_t*));
+    if (new_waiters == NULL) {
+        return 1;
+    }
+
+    memset(new_waiters + fd_waiters_size, 0, (new_size - fd_waiters_size) * sizeof(ult_t*));
+    fd_waiters = new_waiters;
+    fd_waiters_size = new_size;
+
+    return 0;
+}
+
+// the caller is inside a protected zone
+static void remove_from_timer(ult_t* thread) {
+    spin_lock(&timer_lock);
+
+    if (thread->heap_index != NOT_IN_HEAP) {
+        ult_heap_remove(&sleeping_ults, thread);
+        update_next_wake_time();
+    }
+
+    spin_unlock(&timer_lock);
+}
+
+// waits for fd events until the deadline (0 doesn't wait, UINT64_MAX waits forever) and moves the woken threads to the run queue of the carrier
+// returns the number of threads woken up
+static int poll_reactor(carrier_t* carrier, uint64_t deadline) {
+    struct epoll_event events[REACTOR_BATCH];
+    int count;
+    int woken = 0;
+
+    if (deadline == 0 || deadline == UINT64_MAX) {
+        count = epoll_wait(reactor_fd, events, REACTOR_BATCH, deadline == 0 ? 0 : -1);
+    }
+    else {
+        uint64_t now = get_time_ns();
+        uint64_t wait = deadline > now ? deadline - now : 0;
+        struct timespec timeout = { .tv_sec = wait / 1000000000, .tv_nsec = wait % 1000000000 };
+
+        count = epoll_pwait2(reactor_fd, events, REACTOR_BATCH, &timeout, NULL);
+        if (count == -1 && errno == ENOSYS) {
+            // older kernels only have millisecond timeouts, round up so the sleepers are not woken early
+            count = epoll_wait(reactor_fd, events, REACTOR_BATCH, (int) ((wait + 999999) / 1000000));
+        }
+    }
+
+    if (count == -1) {
+        if (errno == EINTR) {
+            return 0;
+        }
+        BAIL("Poll reactor");
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (events[i].data.u64 == REACTOR_WAKEUP) {
+            uint64_t value;
+            if (read(reactor_wakeup_fd, &value, sizeof(value)) == -1 && errno != EAGAIN) {
+                BAIL("Drain reactor wakeup");
+            }
+            continue;
+        }
+
+        if (events[i].data.u64 == REACTOR_IO) {
+            woken += reap_io(carrier, 1);
+            continue;
+        }
+
+        int fd = (int) events[i].data.u64;
+
+        spin_lock(&io_lock);
+        ult_t* thread = (size_t) fd < fd_waiters_size ? fd_waiters[fd] : NULL;
+        if (thread != NULL) {
+            fd_waiters[fd] = NULL;
+            atomic_fetch_sub(&io_waiters, 1);
+        }
+        spin_unlock(&io_lock);
+
+        if (thread == NULL) {
+            continue; // the wait timed out before the event was handled
+        }
+
+        thread->io_revents = events[i].events;
+        remove_from_timer(thread);
+
+        thread->status = RUNNING;
+        push_ready(carrier, thread);
+        woken += 1;
+    }
+
+    return woken;
+}
+
+static void init_reactor() {
+    reactor_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (reactor_fd == -1) {
+        BAIL("Create reactor");
+    }
+
+    reactor_wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (reactor_wakeup_fd == -1) {
+        BAIL("Create reactor wakeup");
+    }
+
+    struct epoll_event event = { .events = EPOLLIN, .data.u64 = REACTOR_WAKEUP };
+    if (epoll_ctl(reactor_fd, EPOLL_CTL_ADD, reactor_wakeup_fd, &event) == -1) {
+        BAIL("Add reactor wakeup");
+    }
+}
+
+////////////////////// IO ENGINE //////////////////////
+
+// a thread that starts a file operation waits (not in the reactor, the files are always "ready") until the engine completes it
+// with io_uring the operations are only prepared in the submission queue, the scheduler submits them with one system call per batch:
+// when the carrier runs out of threads to run, when URING_SUBMIT_BATCH are waiting or when a thread is preempted
+// the completions are read from the shared memory of the ring every time a carrier looks for work
+// without io_uring the operations are done by helper kernel threads with the blocking system calls
+
+// moves the threads of the completed requests to the run queue of the carrier, returns how many there were
+// the request is on the stack of its thread, it can't be touched after the thread is ready
+static int wake_requests(carrier_t* carrier, io_request_t* request) {
+    int woken = 0;
+
+    while (request != NULL) {
+        io_request_t* next = request->next;
+        ult_t* thread = request->thread;
+
+        atomic_fetch_sub(&io_inflight, 1);
+        thread->status = RUNNING;
+        push_ready(carrier, thread);
+
+        request = next;
+        woken += 1;
+    }
+
+    return woken;
+}
+
+// must be called with the ring lock held, the completed requests are added to done
+static io_request_t* reap_ring_locked(io_request_t* done) {
+    struct io_uring_cqe* cqe;
+
+    while ((cqe = uring_peek_cqe(&ring)) != NULL) {
+        io_request_t* request = (io_request_t*) (uintptr_t) cqe->user_data;
+        request->result = cqe->res;
+        request->next = done;
+        done = request;
+
+        uring_cqe_seen(&ring);
+    }
+
+    return done;
+}
+
+// must be called with the ring lock held
+static void submit_ring_locked() {
+    if (uring_submit(&ring) == -1 && errno != EAGAIN && errno != EBUSY) {
+        // EAGAIN and EBUSY only mean the kernel is short on resources or completions, the entries stay in the queue for the next try
+        BAIL("Submit io_uring");
+    }
+}
+
+// submits the prepared operations (if submit is set, or if the carrier has nothing else to do or a batch is full) and wakes the threads whose operations completed
+// the caller should be inside a protected zone
+static int reap_io(carrier_t* carrier, uint8_t submit) {
+    if (atomic_load(&io_inflight) == 0) {
+        return 0;
+    }
+
+    io_request_t* done = NULL;
+
+    if (io_engine == ULT_IO_URING) {
+        // another carrier is already at it, the completions will be handled there
+        if (atomic_flag_test_and_set_explicit(&ring_lock, memory_order_acquire)) {
+            return 0;
+        }
+
+        uint32_t pending = uring_pending(&ring);
+        if (pending > 0 && (submit || pending >= URING_SUBMIT_BATCH || atomic_load(&(carrier->ready_mask)) == 0)) {
+            submit_ring_locked();
+        }
+
+        // the operations on cached data are often completed inside the submit
+        done = reap_ring_locked(done);
+
+        spin_unlock(&ring_lock);
+    }
+    else if (atomic_load_explicit(&helper_done, memory_order_relaxed) != NULL) {
+        done = atomic_exchange_explicit(&helper_done, NULL, memory_order_acquire);
+    }
+
+    return wake_requests(carrier, done);
+}
+
+static int64_t run_request(io_request_t* request) {
+    ssize_t result = 0;
+
+    switch (request->opcode) {
+        case IORING_OP_READ:
+            result = request->offset == -1 ? read(request->fd, request->buf, request->count) : pread(request->fd, request->buf, request->count, request->offset);
+            break;
+
+        case IORING_OP_WRITE:
+            result = request->offset == -1 ? write(request->fd, request->buf, request->count) : pwrite(request->fd, request->buf, request->count, request->offset);
+            break;
+
+        case IORING_OP_FSYNC:
+            result = fsync(request->fd);
+            break;
+
+        case IORING_OP_OPENAT:
+            result = openat(request->fd, request->path, request->flags, request->mode);
+            break;
+
+        default:
+            errno = EINVAL;
+            result = -1;
+    }
+
+    return result == -1 ? -errno : (int64_t) result;
+}
+
+static void* io_helper_main(void* arg) {
+    (void) arg;
+
+    // the helpers never run user level threads, the signals of the library are for the carriers
+    sigset_t all;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, NULL);
+
+    while (1) {
+        pthread_mutex_lock(&helper_lock);
+
+        while (helper_first == NULL) {
+            pthread_cond_wait(&helper_cond, &helper_lock);
+        }
+
+        io_request_t* request = helper_first;
+        helper_first = request->next;
+        if (helper_first == NULL) {
+            helper_last = NULL;
+        }
+
+        pthread_mutex_unlock(&helper_lock);
+
+        request->result = run_request(request);
+
+        io_request_t* first = atomic_load_explicit(&helper_done, memory_order_relaxed);
+        do {
+            request->next = first;
+        } while (!atomic_compare_exchange_weak_explicit(&helper_done, &first, request, memory_order_release, memory_order_relaxed));
+
+        // the running carriers see the request the next time they look for work, an idle time keeper is woken through the reactor
+        uint64_t one = 1;
+        if (write(helper_done_fd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+            BAIL("Signal io completion");
+        }
+    }
+
+    return NULL;
+}
+
+// the caller is inside a protected zone
+static void start_request(io_request_t* request) {
+    if (io_engine == ULT_IO_URING) {
+        io_request_t* done = NULL;
+        struct io_uring_sqe* sqe;
+
+        spin_lock(&ring_lock);
+
+        // the submission queue is full, make room
+        while ((sqe = uring_get_sqe(&ring)) == NULL) {
+            submit_ring_locked();
+            done = reap_ring_locked(done);
+        }
+
+        sqe->opcode = request->opcode;
+        sqe->fd = request->fd;
+        sqe->user_data = (uint64_t) (uintptr_t) request;
+
+        switch (request->opcode) {
+            case IORING_OP_READ:
+            case IORING_OP_WRITE:
+                sqe->addr = (uint64_t) (uintptr_t) request->buf;
+                sqe->len = request->count > UINT32_MAX ? UINT32_MAX : (uint32_t) request->count; // a short read or write, like the system calls are allowed to do
+                sqe->off = (uint64_t) request->offset;
+                break;
+
+            case IORING_OP_OPENAT:
+                sqe->addr = (uint64_t) (uintptr_t) request->path;
+                sqe->len = request->mode;
+                sqe->open_flags = (uint32_t) request->flags;
+                break;
+        }
+
+        spin_unlock(&ring_lock);
+
+        wake_requests(get_carrier(), done);
+    }
+    else {
+        pthread_mutex_lock(&helper_lock);
+
+        request->next = NULL;
+        if (helper_last != NULL) {
+            helper_last->next = request;
+        }
+        else {
+            helper_first = request;
+        }
+        helper_last = request;
+
+        pthread_cond_signal(&helper_cond);
+        pthread_mutex_unlock(&helper_lock);
+    }
+}
+
+static void init_io_engine() {
+    if (io_engine == ULT_IO_URING) {
+        if (uring_init(&ring, URING_ENTRIES) == 0) {
+            // the ring fd is readable while there are completions, the idle time keeper waits for them in the reactor
+            struct epoll_event event = { .events = EPOLLIN, .data.u64 = REACTOR_IO };
+            if (epoll_ctl(reactor_fd, EPOLL_CTL_ADD, ring.fd, &event) == -1) {
+                BAIL("Add io_uring to the reactor");
+            }
+            return;
+        }
+
+        // ENOSYS on old kernels, EPERM when it is disabled (io_uring_disabled, seccomp filters of containers)
+        io_engine = ULT_IO_THREAD;
+    }
+
+    helper_done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (helper_done_fd == -1) {
+        BAIL("Create io completion eventfd");
+    }
+
+    struct epoll_event event = { .events = EPOLLIN, .data.u64 = REACTOR_IO };
+    if (epoll_ctl(reactor_fd, EPOLL_CTL_ADD, helper_done_fd, &event) == -1) {
+        BAIL("Add io completion eventfd to the reactor");
+    }
+
+    for (int i = 0; i < IO_HELPER_THREADS; i++) {
+        pthread_t helper;
+
+        if (pthread_create(&helper, NULL, io_helper_main, NULL) != 0) {
+            BAIL("Create io helper");
+        }
+        pthread_detach(helper);
+    }
+}
+
+static ult_t* find_ready(carrier_t* carrier) {
+    ult_t* thread;
+
+    wake_sleepers(carrier);
+    reap_io(carrier, 0);
+
+    if (++(carrier->picks) % AGING_PICKS == 0 || carrier->slices >= AGING_SLICES) {
+        carrier->slices = 0;
+        age_run_queues(carrier);
+    }
+
+    // the threads that didn't fit in a run queue, if they are more important than the local ones
+    uint32_t overflow = atomic_load(&overflow_mask);
+    uint32_t local = atomic_load(&(carrier->ready_mask));
+    if (overflow != 0 && (local == 0 || highest_priority(overflow) > highest_priority(local))) {
+        thread = take_overflow();
+        if (thread != NULL) {
+            return thread;
+        }
+    }
+
+    // the local run queues
+    thread = take_ready(carrier, carrier);
+    if (thread != NULL) {
+        return thread;
+    }
+
+    if (atomic_load(&overflow_mask) != 0) {
+        thread = take_overflow();
+        if (thread != NULL) {
+            return thread;
+        }
+    }
+
+    // the threads whose fds are ready
+    if (atomic_load(&io_waiters) > 0 && poll_reactor(carrier, 0) > 0) {
+        thread = take_ready(carrier, carrier);
+        if (thread != NULL) {
+            return thread;
+        }
+    }
+
+    // steal from the other carriers, starting with the next one so that not everybody robs the same victim
+    for (uint32_t i = 1; i < carrier_count; i++) {
+        carrier_t* victim = &carriers[(carrier->index + i) % carrier_count];
+
+        thread = take_ready(victim, carrier);
+        if (thread != NULL) {
+            return thread;
+        }
+    }
+
+    return NULL;
+}
+
+////////////////////// SWITCHING //////////////////////
+
+// must be called right after every switch, on the side that was switched to
+// the previous thread can be resumed (by any carrier) only after its context is completely saved
+static void finish_switch() {
+    carrier_t* carrier = get_carrier();
+
+    if (carrier->switched_from != NULL) {
+        atomic_store_explicit(&(carrier->switched_from->on_carrier), 0, memory_order_release);
+        carrier->switched_from = NULL;
+    }
+}
+
+static void switch_to(carrier_t* carrier, ult_t* from, ult_context_t* from_context, ult_t* next) {
+    // the carrier that ran the next thread last might still be saving its context
+    uint32_t spins = 0;
+    while (atomic_load_explicit(&(next->on_carrier), memory_order_acquire)) {
+        cpu_relax(&spins);
+    }
+
+    atomic_store_explicit(&(next->on_carrier), 1, memory_order_relaxed);
+    carrier->switched_from = from;
+    set_current(next);
+
+    carrier->switches += 1;
+    arm_timer(carrier);
+
+    if (sched_policy == ULT_SCHED_FAIR) {
+        // a switch from a thread comes from the scheduler, which just read the clock
+        next->run_start = from != NULL ? carrier->charged_at : get_time_ns();
+    }
+
+    if (from == NULL) {
+        carrier->run_since = read_cycles(); // the time in the idle loop is nobody's
+    }
+
+    if (tracing) {
+        trace_ring_record(&trace_rings[carrier->index], carrier->run_since, TRACE_RUN, 0, next->id, 0);
+    }
+
+    ult_context_switch(from_context, &(next->context));
+
+    // this might be a different carrier than the one that started the switch
+    finish_switch();
+}
+
+// the wait-for graph of the deadlock check, the nodes are the threads first, then a node for every waited cond and two chains of nodes that connect the conds to their signalers
+// a thread waits for at most one node: the owner of its mutex, the thread it joins or its cond
+// the waiters of a cond can be woken by any thread that doesn't wait for the same cond, instead of an edge to each of those threads the cond has an edge to the
+// prefix chain node before its group and one to the suffix chain node after it (the chain nodes have edges to the members of their group and to the next chain node)
+// so the graph stays linear in the number of threads however many conds are waited
+// every waited rwlock has a node last, with an edge to each thread holding it (the writer or the tracked readers), the waiters only move when all of them do
+typedef struct wait_graph_t {
+    uint32_t        thread_count;
+    uint32_t        cond_count;
+    uint32_t        rwlock_count;
+    uint32_t        rwlock_first;   // the node of the first rwlock
+    uint32_t        node_count;
+    ult_t**         threads;        // by node
+    ult_cond_t**    conds;          // by group, group 0 are the threads that don't wait for a cond
+    ult_rwlock_t**  rwlocks;        // by group, from 1
+    uint32_t*       held;           // the rwlock group of the read lock slots of every thread (0 if not waited), read once so the edges agree with the counts
+    uint32_t*       writers;        // the writer node of every rwlock group (NO_NODE if there is none), then the next free edge of the rwlock
+    uint32_t*       edge_start;     // the edges of node v are edges[edge_start[v]] up to edges[edge_start[v + 1]]
+    uint32_t*       edges;
+    uint8_t*        flags;          // NODE_*
+} wait_graph_t;
+
+#define NO_NODE UINT32_MAX
+
+#define NODE_LIVE       1   // a thread that runs, is ready or will be woken by the timer or the reactor
+#define NODE_ON_STACK   2
+#define NODE_PROGRESS   4   // a live thread can be reached from the node, the threads behind it will move eventually
+#define NODE_ALL        8   // a rwlock, it progresses only if all its edges lead to progress
+
+#define cond_node(graph, group) ((graph)->thread_count + (group) - 1)
+#define prefix_node(graph, group) ((graph)->thread_count + (graph)->cond_count + (group))
+#define suffix_node(graph, group) ((graph)->thread_count + 2 * (graph)->cond_count + 1 + (group))
+#define rwlock_node(graph, group) ((graph)->rwlock_first + (group) - 1)
+
+static arena_t deadlock_arena; // reused by every check, it is mapped again only when the graph gets bigger
+
+// the node the thread waits for, NO_NODE if it doesn't wait for another thread (live is set if it can run)
+static uint32_t wait_target(wait_graph_t* graph, ult_t* thread, uint8_t* live) {
+    *live = 0;
+
+    if (thread->timed_wait) {
+        // the timer will end the wait
+        *live = 1;
+        return NO_NODE;
+    }
+
+    if (thread->waiting_rwlock != NULL) {
+        return rwlock_node(graph, thread->waiting_rwlock->deadlock_group);
+    }
+
+    if (thread->waiting_mutex != NULL) {
+        ult_t* owner = mutex_owner(thread->waiting_mutex);
+        // an owner that already finished will never release the mutex, the thread is stuck without a cycle
+        return owner != NULL && owner->deadlock_stage == deadlock_counter ? owner->deadlock_node : NO_NODE;
+    }
+
+    if (thread->waiting_to_join != NULL && thread->waiting_to_join->deadlock_stage == deadlock_counter) {
+        return thread->waiting_to_join->deadlock_node;
+    }
+
+    if (thread->waiting_cond != NULL) {
+        return cond_node(graph, thread->waiting_cond->deadlock_group);
+    }
+
+    // running, ready, sleeping, waiting for an fd, or parked (anybody can unpark it, the park table isn't looked at)
+    *live = 1;
+    return NO_NODE;
+}
+
+// members are the nodes of a strongly connected component that can't reach a live thread
+static void print_deadlock(wait_graph_t* graph, uint64_t number, uint32_t* members, uint32_t member_count, uint32_t root) {
+    if (number == 1) {
+        printf("\n\n====\n\n");
+    }
+
+    uint8_t has_conds = 0, has_rwlocks = 0;
+    for (uint32_t i = 0; i < member_count; i++) {
+        if (members[i] >= graph->rwlock_first) {
+            has_rwlocks = 1;
+        }
+        else if (members[i] >= graph->thread_count) {
+            has_conds = 1;
+        }
+    }
+
+    if (!has_conds && !has_rwlocks) {
+        // every thread has a single edge, the component is a simple cycle
+        printf("Deadlock %lu:\n %lu", number, graph->threads[root]->id);
+        for (uint32_t node = graph->edges[graph->edge_start[root]]; node != root; node = graph->edges[graph->edge_start[node]]) {
+            printf(" -> %lu", graph->threads[node]->id);
+        }
+        printf(" -> %lu \n\n", graph->threads[root]->id);
+        return;
+    }
+
+    printf("Deadlock %lu (every thread that could signal the conds or release the rwlocks waits too):\n threads:", number);
+    for (uint32_t i = 0; i < member_count; i++) {
+        if (members[i] < graph->thread_count) {
+            printf(" %lu", graph->threads[members[i]]->id);
+        }
+    }
+
+    if (has_conds) {
+        printf("\n conds:");
+        for (uint32_t i = 0; i < member_count; i++) {
+            if (members[i] >= cond_node(graph, 1) && members[i] < prefix_node(graph, 0)) {
+                printf(" %lu", graph->conds[members[i] - graph->thread_count + 1]->id);
+            }
+        }
+    }
+
+    if (has_rwlocks) {
+        printf("\n rwlocks:");
+        for (uint32_t i = 0; i < member_count; i++) {
+            if (members[i] >= graph->rwlock_first) {
+                printf(" %lu", graph->rwlocks[members[i] - graph->rwlock_first + 1]->id);
+            }
+        }
+    }
+    printf("\n\n");
+}
+
+// the arrays of the graph and of the search, all from the arena, returns 1 if the memory couldn't be mapped
+// the node and edge counts are upper bounds (every thread might wait for a different cond or rwlock, and hold a rwlock for each tracked read lock and a written one)
+static int alloc_wait_graph(wait_graph_t* graph, uint32_t thread_count, uint32_t** search) {
+    size_t max_nodes = 5 * (size_t) thread_count + 2;
+    size_t max_edges = (8 + ULT_TRACKED_READ_LOCKS) * (size_t) thread_count + 2;
+
+    size_t size = arena_rounded(thread_count * sizeof(ult_t*))
+                + arena_rounded((thread_count + 1) * sizeof(ult_cond_t*))
+                + arena_rounded((thread_count + 1) * sizeof(ult_rwlock_t*))
+                + arena_rounded(ULT_TRACKED_READ_LOCKS * (size_t) thread_count * sizeof(uint32_t))
+                + arena_rounded((thread_count + 1) * sizeof(uint32_t))
+                + arena_rounded((max_nodes + 1) * sizeof(uint32_t))
+                + arena_rounded(max_edges * sizeof(uint32_t))
+                + arena_rounded(max_nodes * sizeof(uint8_t))
+                + 5 * arena_rounded(max_nodes * sizeof(uint32_t));
+
+    if (arena_reset(&deadlock_arena, size) != 0) {
+        return 1;
+    }
+
+    graph->threads = (ult_t**) arena_alloc(&deadlock_arena, thread_count * sizeof(ult_t*));
+    graph->conds = (ult_cond_t**) arena_alloc(&deadlock_arena, (thread_count + 1) * sizeof(ult_cond_t*));
+    graph->rwlocks = (ult_rwlock_t**) arena_alloc(&deadlock_arena, (thread_count + 1) * sizeof(ult_rwlock_t*));
+    graph->held = (uint32_t*) arena_alloc(&deadlock_arena, ULT_TRACKED_READ_LOCKS * (size_t) thread_count * sizeof(uint32_t));
+    graph->writers = (uint32_t*) arena_alloc(&deadlock_arena, (thread_count + 1) * sizeof(uint32_t));
+    graph->edge_start = (uint32_t*) arena_alloc(&deadlock_arena, (max_nodes + 1) * sizeof(uint32_t));
+    graph->edges = (uint32_t*) arena_alloc(&deadlock_arena, max_edges * sizeof(uint32_t));
+    graph->flags = (uint8_t*) arena_alloc(&deadlock_arena, max_nodes * sizeof(uint8_t));
+
+    // index, low link, component stack, call stack nodes, call stack edge positions
+    for (int i = 0; i < 5; i++) {
+        search[i] = (uint32_t*) arena_alloc(&deadlock_arena, max_nodes * sizeof(uint32_t));
+    }
+
+    return 0;
+}
+
+// builds the edges, the threads and the conds are already numbered, group_size counts the threads in every group
+// the members of each group are kept in the component stack while the edges are built (it is free until the search starts)
+static void build_wait_graph(wait_graph_t* graph, uint32_t* group_size, uint32_t* members) {
+    uint32_t* edge_start = graph->edge_start;
+    uint32_t n = graph->thread_count;
+    uint32_t k = graph->cond_count;
+    uint32_t r = graph->rwlock_count;
+
+    // the out degrees first, the edges of every node are stored together
+    for (uint32_t node = 0; node < n; node++) {
+        uint8_t live;
+        edge_start[node] = wait_target(graph, graph->threads[node], &live) != NO_NODE ? 1 : 0;
+        graph->flags[node] = live ? NODE_LIVE : 0;
+    }
+
+    if (k > 0) {
+        for (uint32_t group = 1; group <= k; group++) {
+            edge_start[cond_node(graph, group)] = group < k ? 2 : 1;
+        }
+        for (uint32_t group = 0; group <= k; group++) {
+            edge_start[prefix_node(graph, group)] = group_size[group] + (group > 0 ? 1 : 0);
+            edge_start[suffix_node(graph, group)] = group_size[group] + (group < k ? 1 : 0);
+        }
+    }
+
+    for (uint32_t node = n; node < graph->rwlock_first; node++) {
+        graph->flags[node] = 0;
+    }
+
+    for (uint32_t group = 1; group <= r; group++) {
+        edge_start[rwlock_node(graph, group)] = 0;
+    }
+
+    // the readers holding the waited rwlocks, a running thread might take or release one meanwhile so its slots are read only here
+    for (uint32_t node = 0; node < n; node++) {
+        for (uint32_t i = 0; i < ULT_TRACKED_READ_LOCKS; i++) {
+            ult_rwlock_t* rwlock = graph->threads[node]->read_locks[i];
+            uint32_t group = rwlock != NULL && rwlock->deadlock_stage == deadlock_counter ? rwlock->deadlock_group : 0;
+
+            graph->held[node * ULT_TRACKED_READ_LOCKS + i] = group;
+            if (group != 0) {
+                edge_start[rwlock_node(graph, group)] += 1;
+            }
+        }
+    }
+
+    // a rwlock whose holders aren't all known (more readers than the tracked ones, or caught between two holders) is taken as live
+    for (uint32_t group = 1; group <= r; group++) {
+        ult_rwlock_t* rwlock = graph->rwlocks[group];
+        uint32_t node = rwlock_node(graph, group);
+        uint64_t state = atomic_load_explicit(&(rwlock->state), memory_order_relaxed);
+        ult_t* writer = rwlock->writer;
+        uint8_t live;
+
+        graph->writers[group] = NO_NODE;
+        if (state & RWLOCK_WRITER) {
+            // the writer is set right after the lock is taken and cleared right before it is released
+            // a writer that already finished will never release it, the waiters are stuck without a cycle
+            live = writer == NULL;
+            if (writer != NULL && writer->deadlock_stage == deadlock_counter) {
+                graph->writers[group] = writer->deadlock_node;
+                edge_start[node] += 1;
+            }
+        }
+        else {
+            live = rwlock_readers(state) == 0 || rwlock_readers(state) > edge_start[node];
+        }
+
+        graph->flags[node] = NODE_ALL | (live ? NODE_LIVE : 0);
+    }
+
+    uint32_t total = 0;
+    for (uint32_t node = 0; node < graph->node_count; node++) {
+        uint32_t degree = edge_start[node];
+        edge_start[node] = total;
+        total += degree;
+    }
+    edge_start[graph->node_count] = total;
+
+    uint32_t* edges = graph->edges;
+    for (uint32_t node = 0; node < n; node++) {
+        uint8_t live;
+        uint32_t target = wait_target(graph, graph->threads[node], &live);
+        if (target != NO_NODE) {
+            edges[edge_start[node]] = target;
+        }
+    }
+
+    // the writer first, then the readers
+    for (uint32_t group = 1; group <= r; group++) {
+        uint32_t edge = edge_start[rwlock_node(graph, group)];
+        if (graph->writers[group] != NO_NODE) {
+            edges[edge++] = graph->writers[group];
+        }
+        graph->writers[group] = edge;
+    }
+    for (uint32_t node = 0; node < n; node++) {
+        for (uint32_t i = 0; i < ULT_TRACKED_READ_LOCKS; i++) {
+            uint32_t group = graph->held[node * ULT_TRACKED_READ_LOCKS + i];
+            if (group != 0) {
+                edges[graph->writers[group]++] = node;
+            }
+        }
+    }
+
+    if (k == 0) {
+        return;
+    }
+
+    // the threads sorted by group (counting sort), group_size becomes the start of every group
+    uint32_t start = 0;
+    for (uint32_t group = 0; group <= k; group++) {
+        uint32_t size = group_size[group];
+        group_size[group] = start;
+        start += size;
+    }
+    for (uint32_t node = 0; node < n; node++) {
+        ult_cond_t* cond = graph->threads[node]->waiting_cond;
+        uint32_t group = graph->threads[node]->waiting_mutex == NULL && cond != NULL ? cond->deadlock_group : 0;
+        members[group_size[group]++] = node;
+    }
+    // group_size[group] is the end of the group now, the start is the end of the one before
+
+    for (uint32_t group = 1; group <= k; group++) {
+        uint32_t edge = edge_start[cond_node(graph, group)];
+        edges[edge] = prefix_node(graph, group - 1);
+        if (group < k) {
+            edges[edge + 1] = suffix_node(graph, group + 1);
+        }
+    }
+
+    for (uint32_t group = 0; group <= k; group++) {
+        uint32_t first = group > 0 ? group_size[group - 1] : 0;
+        uint32_t prefix_edge = edge_start[prefix_node(graph, group)];
+        uint32_t suffix_edge = edge_start[suffix_node(graph, group)];
+
+        if (group > 0) {
+            edges[prefix_edge++] = prefix_node(graph, group - 1);
+        }
+        if (group < k) {
+            edges[suffix_edge++] = suffix_node(graph, group + 1);
+        }
+
+        for (uint32_t i = first; i < group_size[group]; i++) {
+            edges[prefix_edge++] = members[i];
+            edges[suffix_edge++] = members[i];
+        }
+    }
+}
+
+// must be called inside a protected zone, without holding the scheduler lock
+// the strongly connected components of the wait-for graph are found with Tarjan's algorithm (without recursion, it might run on a small thread stack)
+// a component with a cycle that can't reach a live thread is a deadlock, the whole check is linear in the number of threads
+static void detect_deadlocks() {
+    lock_scheduler();
+
+    deadlock_counter += 1;
+
+    wait_graph_t graph;
+    uint32_t* search[5];
+    uint32_t n = (uint32_t) not_finished_ults.size + 1; // main is not in the list
+
+    if (alloc_wait_graph(&graph, n, search) != 0) {
+        unlock_scheduler();
+        printf("Not enough memory to look for deadlocks\n"); fflush(NULL);
+        return;
+    }
+
+    uint32_t* index = search[0];
+    uint32_t* low = search[1];
+    uint32_t* stack = search[2];
+    uint32_t* call_node = search[3];
+    uint32_t* call_edge = search[4];
+    uint32_t* group_size = low; // free until the search starts
+
+    // number the threads and the waited conds (the cond of a thread that is taking its mutex back doesn't count)
+    uint32_t node = 0;
+    for (ult_link_t* link = not_finished_ults.head; link != NULL; link = link->next) {
+        graph.threads[node++] = link->ult;
+    }
+    graph.threads[node++] = &main_ult;
+
+    graph.thread_count = n;
+    graph.cond_count = 0;
+    graph.rwlock_count = 0;
+    group_size[0] = 0;
+
+    for (node = 0; node < n; node++) {
+        ult_t* thread = graph.threads[node];
+        thread->deadlock_stage = deadlock_counter;
+        thread->deadlock_node = node;
+
+        ult_rwlock_t* rwlock = thread->waiting_rwlock;
+        if (rwlock != NULL && rwlock->deadlock_stage != deadlock_counter) {
+            rwlock->deadlock_stage = deadlock_counter;
+            graph.rwlock_count += 1;
+            rwlock->deadlock_group = graph.rwlock_count;
+            graph.rwlocks[graph.rwlock_count] = rwlock;
+        }
+
+        ult_cond_t* cond = thread->waiting_mutex == NULL ? thread->waiting_cond : NULL;
+        if (cond == NULL) {
+            group_size[0] += 1;
+            continue;
+        }
+
+        if (cond->deadlock_stage != deadlock_counter) {
+            cond->deadlock_stage = deadlock_counter;
+            graph.cond_count += 1;
+            cond->deadlock_group = graph.cond_count;
+            graph.conds[graph.cond_count] = cond;
+            group_size[graph.cond_count] = 0;
+        }
+        group_size[cond->deadlock_group] += 1;
+    }
+
+    graph.rwlock_first = graph.cond_count > 0 ? n + 3 * graph.cond_count + 2 : n;
+    graph.node_count = graph.rwlock_first + graph.rwlock_count;
+    build_wait_graph(&graph, group_size, stack);
+
+    for (node = 0; node < graph.node_count; node++) {
+        index[node] = NO_NODE;
+    }
+
+    uint64_t found_deadlocks = 0;
+    uint32_t next_index = 0, stack_top = 0, call_top = 0;
+
+    for (uint32_t root = 0; root < n; root++) {
+        if (index[root] != NO_NODE) {
+            continue;
+        }
+
+        index[root] = low[root] = next_index++;
+        stack[stack_top++] = root;
+        graph.flags[root] |= NODE_ON_STACK;
+        call_node[call_top] = root;
+        call_edge[call_top++] = graph.edge_start[root];
+
+        while (call_top > 0) {
+            uint32_t v = call_node[call_top - 1];
+
+            if (call_edge[call_top - 1] < graph.edge_start[v + 1]) {
+                uint32_t w = graph.edges[call_edge[call_top - 1]++];
+
+                if (index[w] == NO_NODE) {
+                    index[w] = low[w] = next_index++;
+                    stack[stack_top++] = w;
+                    graph.flags[w] |= NODE_ON_STACK;
+                    call_node[call_top] = w;
+                    call_edge[call_top++] = graph.edge_start[w];
+                }
+                else if ((graph.flags[w] & NODE_ON_STACK) && index[w] < low[v]) {
+                    low[v] = index[w];
+                }
+                continue;
+            }
+
+            // all the edges of v are explored
+            call_top -= 1;
+            if (call_top > 0 && low[v] < low[call_node[call_top - 1]]) {
+                low[call_node[call_top - 1]] = low[v];
+            }
+
+            if (low[v] != index[v]) {
+                continue;
+            }
+
+            // v is the first node of a component, the component is the stack above it
+            // the edges that leave the component go to components that are already done (those still on the stack are in this one)
+            uint32_t first = stack_top - 1;
+            while (stack[first] != v) {
+                first -= 1;
+            }
+
+            // a rwlock only counts if all its holders progress outside the component, otherwise one of them might be stuck in it
+            // so a component mixing rwlocks with other waits can be taken as progressing while part of it is stuck, a deadlock is never reported wrongly
+            uint8_t progress = 0;
+            uint8_t cycle = stack_top - first > 1;
+            for (uint32_t i = first; i < stack_top; i++) {
+                uint32_t member = stack[i];
+                uint8_t needs_all = graph.flags[member] & NODE_ALL;
+                uint8_t all_progress = 1;
+                progress |= graph.flags[member] & NODE_LIVE;
+
+                for (uint32_t edge = graph.edge_start[member]; edge < graph.edge_start[member + 1]; edge++) {
+                    uint32_t w = graph.edges[edge];
+                    if (w == member) {
+                        cycle = 1; // a thread joining itself
+                    }
+                    else if (!(graph.flags[w] & NODE_ON_STACK) && (graph.flags[w] & NODE_PROGRESS)) {
+                        progress |= !needs_all;
+                    }
+                    else {
+                        all_progress = 0;
+                    }
+                }
+
+                if (needs_all && all_progress && graph.edge_start[member] < graph.edge_start[member + 1]) {
+                    progress = 1;
+                }
+            }
+
+            for (uint32_t i = first; i < stack_top; i++) {
+                graph.flags[stack[i]] &= ~NODE_ON_STACK;
+                if (progress) {
+                    graph.flags[stack[i]] |= NODE_PROGRESS;
+                }
+            }
+
+            if (!progress && cycle) {
+                found_deadlocks += 1;
+                print_deadlock(&graph, found_deadlocks, stack + first, stack_top - first, v);
+            }
+
+            stack_top = first;
+        }
+    }
+
+    uint32_t stuck = 0;
+    for (node = 0; node < n; node++) {
+        if (!(graph.flags[node] & NODE_PROGRESS)) {
+            stuck += 1;
+        }
+    }
+
+    unlock_scheduler();
+
+    printf("====\nFound %lu deadlocks, %u threads can't make progress\n====\n\n", found_deadlocks, stuck); fflush(NULL);
+}
+
+// follows the chain of threads that waits start at the thread the current thread is about to wait for, must be called with the scheduler lock held
+// a thread waiting for a mutex waits for its owner (the waited mutexes can't change owner without the scheduler lock), a joining thread waits for the joined one
+// and a thread waiting for a written rwlock waits for the writer (the same holds for the waited rwlocks)
+// a thread that sleeps or waits for a cond, an fd or the readers of a rwlock ends the chain, nobody knows who will wake it up
+// returns 1 if the chain leads back to the current thread
+static uint8_t would_deadlock(ult_t* current, ult_t* waited) {
+    // a chain longer than the number of threads is stuck in a cycle without the current thread, waiting on it doesn't make a new one
+    size_t steps = not_finished_ults.size + 1;
+
+    while (waited != NULL && steps > 0) {
+        if (waited == current) {
+            return 1;
+        }
+
+        if (waited->waiting_mutex != NULL) {
+            waited = mutex_owner(waited->waiting_mutex);
+        }
+        else if (waited->waiting_rwlock != NULL) {
+            waited = waited->waiting_rwlock->writer;
+        }
+        else {
+            waited = waited->waiting_to_join;
+        }
+        steps -= 1;
+    }
+
+    return 0;
+}
+
+void find_deadlocks() {
+    start_protected_zone();
+    detect_deadlocks();
+    end_protected_zone();
+}
+
+// DEADLOCK_SIG can arrive while the carrier holds the scheduler lock, in that case the check is done at the end of the protected zone
+static void run_requested_deadlock_check() {
+    deadlock_check_requested = 0;
+    detect_deadlocks();
+}
+
+static inline void init_ult(ult_t* ult, uint64_t id, voidptr_arg_voidptr_ret_func start_routine, void* arg) {
+    ult->id     = id;
+    ult->status = RUNNING;
+    ult->result = NULL;
+
+    ult->joined_by                = NULL;
+    ult->waiting_to_join          = NULL;
+    ult->waiting_mutex            = NULL;
+    ult->waiting_cond             = NULL;
+    ult->waiting_rwlock           = NULL;
+    ult->rwlock_exclusive         = 0;
+    memset(ult->read_locks, 0, sizeof(ult->read_locks));
+    ult->untracked_read_locks     = 0;
+    ult->chan_transfer            = NULL;
+    ult->park_address             = NULL;
+    ult->timed_wait               = 0;
+    ult->timed_out                = 0;
+    ult->deadlock_stage           = 0;
+    ult->deadlock_node            = 0;
+    atomic_init(&(ult->on_carrier), 0);
+    ult->heap_index               = NOT_IN_HEAP;
+    ult->waiting_fd               = -1;
+    ult->preempt_depth            = 1; // a new thread starts in the middle of a switch, the wrapper ends the zone
+    ult->preempt_pending          = 0;
+    ult->priority                 = ULT_PRIORITY_DEFAULT;
+    ult->weight                   = ULT_WEIGHT_DEFAULT;
+    ult->vruntime                 = 0;
+    ult->run_start                = 0;
+    ult->run_index                = NOT_IN_HEAP;
+    ult->block_reason             = NOT_BLOCKED;
+    ult->lock_samples             = 0;
+    memset(&(ult->stats), 0, sizeof(ult_stats_t));
+    init_ult_link(&(ult->all_link), ult);
+    init_ult_link(&(ult->queue_link), ult);
+
+    ult->arg           = arg;
+    ult->start_routine = start_routine;
+    ult->joined_by     = NULL;
+}
+
+void wrapper();
+
+static inline void init_ult_context(ult_t* ult) {
+    ult_context_make(&(ult->context), ult->stack.base, ult->stack.size, wrapper);
+}
+
+// must be called inside a protected zone, it returns outside of it (possibly on another carrier)
+// a thread that is still runnable (PREEMPTED or YIELDED) goes to the back of the run queue, otherwise (0) it must already be in a waiting list (or sleeping)
+// the status can't tell the two cases apart, a waiting thread might already be woken up by another carrier
+void SCHEDULER(ult_t* current, uint8_t runnable) {
+    carrier_t* carrier = get_carrier();
+    current->preempt_pending = 0; // switching anyway
+    carrier->preempt_retries = 0;
+
+    // the next thread starts counting from here
+    uint64_t now = read_cycles();
+    current->stats.run_ns += now - carrier->run_since;
+    carrier->run_since = now;
+
+    if (tracing) {
+        // a blocked thread that was already woken up by another carrier is not blocked anymore
+        trace_ring_record(&trace_rings[carrier->index], now, TRACE_STOP, runnable, current->id, current->block_reason);
+    }
+
+    if (runnable == PREEMPTED) {
+        current->stats.involuntary_switches += 1;
+    }
+    else {
+        current->stats.voluntary_switches += 1;
+    }
+
+    if (sched_policy == ULT_SCHED_FAIR) {
+        charge_runtime(carrier, current); // before it goes back to the fair queue, ordered by the new value
+    }
+
+    if (runnable) {
+        // a preempted or yielding thread gives the threads waiting for fds a chance too
+        if (atomic_load(&io_waiters) > 0) {
+            poll_reactor(carrier, 0);
+        }
+
+        // and the file operations prepared since the last submit don't wait for the carrier to run out of threads
+        reap_io(carrier, 1);
+
+        carrier->slices += 1;
+        push_ready(carrier, current);
+    }
+
+    ult_t* thread = find_ready(carrier);
+
+    // no need to swap if the current thread is the next scheduled for execution
+    // the switch is done inside the protected zone, a signal received between leaving the zone and switching would
+    // run the scheduler again on a thread that is already in a run queue
+    if (thread == NULL) {
+        // nothing to run right now, wait for work on the carrier's own stack
+        // (waiting on the current stack would be a problem if another carrier resumes the current thread)
+        carrier->switched_from = current;
+        set_current(NULL);
+        ult_context_switch(&(current->context), &(carrier->idle_context));
+        finish_switch();
+    }
+    else if (thread != current && atomic_load_explicit(&(thread->on_carrier), memory_order_acquire)) {
+        // the next thread was made ready before its carrier got to save it, and that carrier might be waiting for the current thread the same way
+        // the current thread is saved first (by switching to the idle context), the wait for the next one is done from there
+        carrier->handoff = thread;
+        carrier->switched_from = current;
+        set_current(NULL);
+        ult_context_switch(&(current->context), &(carrier->idle_context));
+        finish_switch();
+    }
+    else if (thread != current) {
+        switch_to(carrier, current, &(current->context), thread);
+    }
+    else {
+        // the thread continues, a new slice if somebody else is waiting now, no signals while it runs alone
+        // the queues are looked at themselves, the bit of the queue the thread was just taken from might still be set
+        carrier->switches += 1;
+        if (has_ready(carrier) || needs_timer_elsewhere()) {
+            arm_timer(carrier);
+        }
+        else {
+            disarm_timer(carrier);
+        }
+
+        if (tracing) {
+            trace_ring_record(&trace_rings[carrier->index], carrier->run_since, TRACE_RUN, 0, current->id, 0);
+        }
+    }
+
+    end_protected_zone(); // ends the zone of the thread that was switched in (which is the current thread again)
+}
+
+// looks at the queues themselves, not at the ready mask
+static int has_ready(carrier_t* carrier) {
+    if (sched_policy == ULT_SCHED_FAIR) {
+        spin_lock(&(carrier->fair_lock));
+        size_t size = carrier->fair_queue.size;
+        spin_unlock(&(carrier->fair_lock));
+
+        return size > 0;
+    }
+
+    for (int priority = 0; priority < ULT_PRIORITY_LEVELS; priority++) {
+        if (deque_size(&(carrier->run_queues[priority])) > 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// puts the carrier to sleep until another carrier has work for it
+// one of the idle carriers also keeps the time for the sleeping threads and watches the fds, it wakes up by itself when the first one is due
+static void park_carrier(carrier_t* carrier) {
+    spin_lock(&overflow_lock);
+
+    if (atomic_load(&overflow_mask) != 0) {
+        spin_unlock(&overflow_lock);
+        return;
+    }
+
+    // the threads only get in a run queue from a running carrier, the timers or the reactor
+    // if all the carriers are out of work and nobody sleeps or waits for an fd or a file operation nothing will ever wake up
+    if (atomic_fetch_add(&idle_carriers, 1) + 1 == carrier_count && atomic_load(&next_wake_time) == UINT64_MAX && atomic_load(&io_waiters) == 0 && atomic_load(&io_inflight) == 0) {
+        spin_unlock(&overflow_lock);
+        detect_deadlocks();
+        BAIL("There are no running threads! This might indicate that a deadlock that involves all existing threads occured!");
+    }
+
+    atomic_store(&(carrier->parked), 1);
+
+    spin_unlock(&overflow_lock);
+
+    // nothing to preempt while parked
+    disarm_timer(carrier);
+
+    uint8_t keeps_time = 0;
+    if (atomic_load(&next_wake_time) != UINT64_MAX || atomic_load(&io_waiters) > 0 || atomic_load(&io_inflight) > 0) {
+        carrier_t* expected = NULL;
+        keeps_time = atomic_compare_exchange_strong(&timer_keeper, &expected, carrier);
+    }
+
+    // a thread might have been pushed before the carrier became visible as idle
+    for (uint32_t i = 0; i < carrier_count; i++) {
+        if (has_ready(&carriers[i])) {
+            wake_carrier(carrier);
+            break;
+        }
+    }
+
+    while (atomic_load(&(carrier->parked))) {
+        uint64_t deadline = UINT64_MAX;
+
+        if (keeps_time) {
+            // read after parked was set, ult_sleep wakes the keeper if it adds an earlier thread after this
+            deadline = atomic_load(&next_wake_time);
+
+            if (deadline != UINT64_MAX && deadline <= get_time_ns()) {
+                wake_carrier(carrier); // time to wake some threads
+                break;
+            }
+        }
+
+        if (keeps_time) {
+            // the keeper also watches the fds and the io engine, it is woken through the reactor's eventfd
+            if (poll_reactor(carrier, deadline) > 0) {
+                wake_carrier(carrier);
+            }
+        }
+        else {
+            futex_wait(&(carrier->parked), 1, deadline);
+        }
+
+        if (deadlock_check_requested) {
+            run_requested_deadlock_check();
+        }
+    }
+
+    if (keeps_time) {
+        atomic_store(&timer_keeper, NULL);
+    }
+}
+
+// the carrier runs this loop (inside a protected zone) whenever it has nothing to execute
+static void idle_loop() {
+    carrier_t* carrier = get_carrier();
+
+    while (1) {
+        finish_switch();
+
+        if (deadlock_check_requested) {
+            run_requested_deadlock_check();
+        }
+
+        ult_t* thread = carrier->handoff;
+        carrier->handoff = NULL;
+
+        if (thread == NULL) {
+            thread = find_ready(carrier);
+        }
+
+        if (thread == NULL) {
+            park_carrier(carrier);
+            continue;
+        }
+
+        switch_to(carrier, NULL, &(carrier->idle_context), thread);
+    }
+}
+
+static inline void wrapper_exit(ult_t* current, void* result) {
+    start_protected_zone();
+
+    if (tracing) {
+        trace_event(TRACE_EXIT, 0, 0);
+    }
+
+    lock_scheduler();
+
+    current->result = result;
+    current->status = FINISHED;
+    // the memory is freed after join
+
+    ult_t* joined_by = current->joined_by;
+    if (joined_by != NULL) {
+        joined_by->waiting_to_join = NULL;
+        if (claim_waiter(joined_by)) {
+            make_ready(joined_by); // wake the thread waiting to join the current thread
+        }
+    }
+
+    unlock_scheduler();
+
+    SCHEDULER(current, 0);
+}
+
+void wrapper() {
+    // a new thread starts from the middle of a switch
+    finish_switch();
+
+    ult_t* current = get_current();
+    void* result;
+
+    end_protected_zone();
+
+    result = current->start_routine(current->arg);
+
+    wrapper_exit(current, result);
+}
+
+// start and end of the program's own code, provided by the linker
+extern char __executable_start[], etext[];
+
+// the libc functions are not written to be left in the middle and reentered by another thread of the same carrier
+// (a thread stopped between the two halves of unlocking a stdio lock leaves the lock taken forever for everybody on its kernel thread)
+// so the threads are switched only while they execute the program's own code, otherwise the thread is switched at its next call into the library
+// (the end of its next protected zone) or when a retry of the timer finds it in the program's code
+static int interrupted_in_program(void* uc) {
+    ucontext_t* context = (ucontext_t*) uc;
+    uintptr_t pc;
+
+#if defined(__x86_64__)
+    pc = (uintptr_t) context->uc_mcontext.gregs[REG_RIP];
+#elif defined(__aarch64__)
+    pc = (uintptr_t) context->uc_mcontext.pc;
+#else
+    (void) context;
+    return 1;
+#endif
+
+    return pc >= (uintptr_t) __executable_start && pc < (uintptr_t) etext;
+}
+
+// the handler runs with SA_NODEFER, a thread switched out from inside the handler must not leave the signal blocked on the carrier
+// (a second signal that arrives before the handler enters the zone switches the thread out first, the first one continues after the thread is back)
+void sig_handler(int signum, siginfo_t *si, void *uc) {
+    ult_t* current = get_current();
+
+    if (signum == TIMER_SIG) {
+        carrier_t* carrier = get_carrier();
+        carrier->timer_armed = 0; // one shot
+
+        if (current == NULL) {
+            return; // went idle before it expired
+        }
+
+        if (carrier->switches != carrier->armed_switches) {
+            // the thread was switched in after the timer was armed, it gets its full slice from now on
+            arm_timer(carrier);
+            return;
+        }
+
+        if (current->preempt_depth == 0 && !interrupted_in_program(uc)) {
+            // not a good moment, the end of the next protected zone does the switch, the timer tries again soon in case that takes long
+            // a thread that stays in libc (a long computation in libm) would be hit every retry, after a few it gets a full slice before the next ones
+            current->preempt_pending = 1;
+            if (carrier->preempt_retries < TIMER_RETRIES) {
+                carrier->preempt_retries += 1;
+                set_timer(carrier, TIMER_RETRY_NS);
+            }
+            else {
+                carrier->preempt_retries = 0;
+                set_timer(carrier, atomic_load_explicit(&time_slice_ns, memory_order_relaxed));
+            }
+            return;
+        }
+    }
+
+    if (current == NULL || current->preempt_depth != 0 || !interrupted_in_program(uc)) {
+        // the carrier is idle or the thread can't be switched out right now
+        // the work is done at the end of the outermost protected zone (or when the carrier goes idle)
+        if (signum == DEADLOCK_SIG) {
+            deadlock_check_requested = 1;
+        }
+        else if (current != NULL) {
+            current->preempt_pending = 1;
+        }
+        return;
+    }
+
+    start_protected_zone();
+
+    switch (signum) {
+        case TIMER_SIG:
+            SCHEDULER(current, PREEMPTED);
+            break;
+
+        case DEADLOCK_SIG:
+            detect_deadlocks();
+            end_protected_zone();
+            break;
+    }
+}
+
+static void init_main() {
+    uint64_t id = 1;
+    ult_counter = 1;
+
+    init_ult(&main_ult, id, NULL, NULL);
+    // main already runs on the process stack, its context is saved by the first switch away from it
+    // when main is done the entire program is done, no cleanup will be done after
+
+    main_ult.preempt_depth = 0;
+    main_ult.run_start = get_time_ns(); // main is already running
+    atomic_store(&(main_ult.on_carrier), 1);
+    set_current(&main_ult);
+}
+
+// every carrier has its own timer that interrupts only that carrier, it is armed when the carrier runs a thread
+static void init_timer(carrier_t* carrier) {
+    struct sigevent     sev;
+
+    memset(&sev, 0, sizeof(sev));
+    sev.sigev_notify = SIGEV_THREAD_ID;
+    sev.sigev_signo = TIMER_SIG;
+    sev.sigev_notify_thread_id = gettid();
+    if (timer_create(CLOCK_MONOTONIC, &sev, &(carrier->timer)) == -1) {
+        BAIL("Timer Create");
+    }
+
+    carrier->timer_armed = 0;
+}
+
+static void* carrier_main(void* arg) {
+    carrier_t* carrier = (carrier_t*) arg;
+
+    this_carrier = carrier;
+
+    init_timer(carrier); // the idle loop has no current thread, the timer never switches it out
+
+    idle_loop();
+
+    return NULL;
+}
+
+static void init_carriers() {
+    if (carrier_count == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        carrier_count = cpus > 0 ? (uint32_t) cpus : 1;
+    }
+
+    if (posix_memalign((void**) &carriers, 64, carrier_count * sizeof(carrier_t)) != 0) {
+        BAIL("Allocate carriers");
+    }
+    memset(carriers, 0, carrier_count * sizeof(carrier_t));
+
+    for (uint32_t i = 0; i < carrier_count; i++) {
+        carriers[i].index = i;
+        init_ult_heap_keyed(&(carriers[i].fair_queue), offsetof(ult_t, vruntime), offsetof(ult_t, run_index));
+        atomic_flag_clear(&(carriers[i].fair_lock));
+    }
+
+    // the thread that called main becomes the first carrier, it needs a separate stack to wait for work
+    carrier_t* main_carrier = &carriers[0];
+    this_carrier = main_carrier;
+    main_carrier->pthread = pthread_self();
+    main_carrier->idle_stack = (char*) malloc(IDLE_STACK_SIZE);
+    if (main_carrier->idle_stack == NULL) {
+        BAIL("Allocate idle stack");
+    }
+    ult_context_make(&(main_carrier->idle_context), main_carrier->idle_stack, IDLE_STACK_SIZE, idle_loop);
+    init_timer(main_carrier);
+    main_carrier->run_since = read_cycles(); // main is already running
+
+    for (uint32_t i = 1; i < carrier_count; i++) {
+        if (pthread_create(&(carriers[i].pthread), NULL, carrier_main, &carriers[i]) != 0) {
+            BAIL("Create carrier");
+        }
+    }
+}
+
+static void init_signals() {
+    // setup signal handlers
+    struct sigaction sa;
+
+    sa.sa_sigaction = sig_handler;
+    sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+    sigemptyset(&sa.sa_mask);
+    sigaction(TIMER_SIG, &sa, NULL);
+    sigaction(DEADLOCK_SIG, &sa, NULL);
+}
+
+static inline void init_lib() {
+    if (ult_counter == 0) {
+        init_ult_queue(&not_finished_ults);
+        for (int i = 0; i < ULT_PRIORITY_LEVELS; i++) {
+            init_ult_queue(&overflow_ults[i]);
+        }
+        init_ult_heap(&sleeping_ults);
+        clock_base_ns = get_time_ns();
+        clock_base_cycles = read_cycles();
+        init_reactor();
+        init_io_engine();
+        init_park_table();
+
+        // this is the first call to the library
+        init_signals();
+        init_main();
+        init_carriers(); // the other carriers are started last, when everything they could touch is initialized
+    }
+}
+
+// 'public' members
+
+int ult_set_concurrency(uint32_t carriers_num) {
+    if (ult_counter != 0) {
+        // the carriers are already running
+        return 1;
+    }
+
+    carrier_count = carriers_num;
+    return 0;
+}
+
+uint32_t ult_get_concurrency() {
+    init_lib();
+    return carrier_count;
+}
+
+int ult_set_time_slice(uint64_t nsec) {
+    if (nsec < ULT_TIME_SLICE_MIN_NS || nsec > ULT_TIME_SLICE_MAX_NS) {
+        return 1;
+    }
+
+    atomic_store(&time_slice_ns, nsec);
+    return 0;
+}
+
+uint64_t ult_get_time_slice() {
+    return atomic_load(&time_slice_ns);
+}
+
+int ult_set_deadlock_avoidance(uint8_t enabled) {
+    deadlock_avoidance = enabled ? 1 : 0;
+    return 0;
+}
+
+uint8_t ult_get_deadlock_avoidance() {
+    return deadlock_avoidance;
+}
+
+int ult_set_sched_policy(ult_sched_policy policy) {
+    if (ult_counter != 0) {
+        // the threads are already in the queues of the current policy
+        return 1;
+    }
+
+    sched_policy = policy;
+    return 0;
+}
+
+ult_sched_policy ult_get_sched_policy() {
+    return sched_policy;
+}
+
+int ult_set_io_engine(ult_io_engine engine) {
+    if (ult_counter != 0) {
+        // the engine is already started
+        return 1;
+    }
+
+    io_engine = engine;
+    return 0;
+}
+
+ult_io_engine ult_get_io_engine() {
+    init_lib();
+    return io_engine;
+}
+
+int ult_set_stack_cache(size_t warm_stacks, size_t cold_stacks) {
+    // it doesn't start the library, so it can be called before ult_set_concurrency
+    start_protected_zone();
+    ult_stack_cache_limits(warm_stacks, cold_stacks);
+    end_protected_zone();
+
+    return 0;
+}
+
+int ult_attr_init(ult_attr_t* attr) {
+    attr->stack_size = DEFAULT_ULT_STACK_SIZE;
+    attr->stack = NULL;
+    attr->priority = ULT_PRIORITY_DEFAULT;
+    attr->weight = ULT_WEIGHT_DEFAULT;
+
+    return 0;
+}
+
+int ult_attr_setstacksize(ult_attr_t* attr, size_t stack_size) {
+    if (stack_size < MIN_ULT_STACK_SIZE) {
+        return 1;
+    }
+
+    attr->stack_size = stack_size;
+    attr->stack = NULL;
+
+    return 0;
+}
+
+int ult_attr_setstack(ult_attr_t* attr, void* stack, size_t stack_size) {
+    if (stack == NULL || stack_size < MIN_ULT_STACK_SIZE) {
+        return 1;
+    }
+
+    attr->stack_size = stack_size;
+    attr->stack = stack;
+
+    return 0;
+}
+
+int ult_attr_setpriority(ult_attr_t* attr, int priority) {
+    if (priority < ULT_PRIORITY_MIN || priority > ULT_PRIORITY_MAX) {
+        return 1;
+    }
+
+    attr->priority = priority;
+
+    return 0;
+}
+
+int ult_attr_setweight(ult_attr_t* attr, uint32_t weight) {
+    if (weight < ULT_WEIGHT_MIN || weight > ULT_WEIGHT_MAX) {
+        return 1;
+    }
+
+    attr->weight = weight;
+
+    return 0;
+}
+
+int ult_create(ult_t* thread, voidptr_arg_voidptr_ret_func start_routine, void* arg) {
+    return ult_create_with_attr(thread, NULL, start_routine, arg);
+}
+
+int ult_create_with_attr(ult_t* thread, const ult_attr_t* attr, voidptr_arg_voidptr_ret_func start_routine, void* arg) {
+    init_lib();
+
+    if (attr != NULL && attr->stack != NULL) {
+        ult_stack_use(&(thread->stack), attr->stack, attr->stack_size);
+    }
+    else {
+        start_protected_zone();
+        int err = ult_stack_map(&(thread->stack), attr != NULL ? attr->stack_size : DEFAULT_ULT_STACK_SIZE);
+        end_protected_zone();
+
+        if (err != 0) {
+            return 1;
+        }
+    }
+
+    uint64_t id = atomic_fetch_add(&ult_counter, 1) + 1;
+
+    init_ult(thread, id, start_routine, arg);
+    if (attr != NULL) {
+        thread->priority = (uint8_t) attr->priority;
+        thread->weight = attr->weight;
+    }
+    init_ult_context(thread);    // the thread starts in wrapper, which reads the parameters from the ult structure
+
+    start_protected_zone(); // protect this area from being interrupted
+        lock_scheduler();
+        ult_queue_push_last(&not_finished_ults, &(thread->all_link));
+        unlock_scheduler();
+
+        if (tracing) {
+            trace_event(TRACE_CREATE, 0, id);
+        }
+
+        make_ready(thread);
+    end_protected_zone(); // end of protected zone
+
+    // TODO: maybe it would be more 'fair' to call swap
+    return 0;
+}
+
+// deadline is UINT64_MAX if the join doesn't time out
+static int join_thread(ult_t* thread, void** retval, uint64_t deadline) {
+    init_lib();
+
+    start_protected_zone();
+    lock_scheduler();
+
+    ult_t* current_waiting_join = get_current();
+
+    if (deadlock_avoidance && thread->status != FINISHED && would_deadlock(current_waiting_join, thread)) {
+        // the thread stays joinable
+        unlock_scheduler();
+        end_protected_zone();
+        return EDEADLK;
+    }
+
+    if (thread->joined_by != NULL) {
+        // the thread is already being waited by some other thread
+        unlock_scheduler();
+        end_protected_zone();
+        return EINVAL;
+    }
+
+    // also marks a finished thread as joined, a second join must not unlink it again
+    thread->joined_by = current_waiting_join;
+
+    if (thread->status != FINISHED) {
+        start_blocking(current_waiting_join, ULT_BLOCK_JOIN);
+        current_waiting_join->status = WAITING;
+        current_waiting_join->waiting_to_join = thread;
+
+        uint8_t earliest = deadline != UINT64_MAX ? arm_wait_timeout(current_waiting_join, deadline) : 0;
+
+        unlock_scheduler();
+
+        if (earliest) {
+            wake_timer_keeper();
+        }
+
+        SCHEDULER(current_waiting_join, 0); // the scheduler would set the signals back
+
+        if (current_waiting_join->timed_out) {
+            // the thread is not joined, it can be joined again
+            current_waiting_join->timed_out = 0;
+            return ETIMEDOUT;
+        }
+
+        start_protected_zone();
+        lock_scheduler();
+    }
+
+    // current thread is now running after the finish of the to-be-joined thread (or the thread was already in the finished state)
+    if (retval != NULL) {
+        *retval = thread->result;
+    }
+
+    unlock_scheduler();
+
+    // the finished thread might still be switching away on its carrier, its stack can be freed only after the switch is done
+    uint32_t spins = 0;
+    while (atomic_load_explicit(&(thread->on_carrier), memory_order_acquire)) {
+        cpu_relax(&spins);
+    }
+
+    // remove the thread from the not finished list, its counters are final now (the switch away counted its last run)
+    lock_scheduler();
+    ult_queue_remove(&not_finished_ults, &(thread->all_link));
+    add_stats(&joined_stats, &(thread->stats));
+    unlock_scheduler();
+
+    ult_stack_release(&(thread->stack));
+
+    end_protected_zone();
+
+    return 0;
+}
+
+int ult_join(ult_t* thread, void** retval) {
+    return join_thread(thread, retval, UINT64_MAX);
+}
+
+int ult_join_timeout(ult_t* thread, void** retval, uint64_t sec, uint64_t nsec) {
+    return join_thread(thread, retval, deadline_after(sec, nsec));
+}
+
+int ult_set_priority(ult_t* thread, int priority) {
+    init_lib();
+
+    if (priority < ULT_PRIORITY_MIN || priority > ULT_PRIORITY_MAX) {
+        return 1;
+    }
+
+    if (thread == NULL) {
+        thread = get_current();
+    }
+
+    // read by push_ready, a thread that is in a run queue stays where it is
+    thread->priority = (uint8_t) priority;
+
+    return 0;
+}
+
+int ult_get_priority(ult_t* thread) {
+    init_lib();
+
+    return thread != NULL ? thread->priority : get_current()->priority;
+}
+
+int ult_set_weight(ult_t* thread, uint32_t weight) {
+    init_lib();
+
+    if (weight < ULT_WEIGHT_MIN || weight > ULT_WEIGHT_MAX) {
+        return 1;
+    }
+
+    if (thread == NULL) {
+        thread = get_current();
+    }
+
+    // the time until the next switch is charged with the new weight
+    thread->weight = weight;
+
+    return 0;
+}
+
+uint32_t ult_get_weight(ult_t* thread) {
+    init_lib();
+
+    return thread != NULL ? thread->weight : get_current()->weight;
+}
+
+int ult_get_stats(ult_t* thread, ult_stats_t* stats) {
+    init_lib();
+
+    start_protected_zone();
+
+    ult_t* current = get_current();
+    if (thread == NULL) {
+        thread = current;
+    }
+
+    *stats = thread->stats;
+    if (thread == current) {
+        stats->run_ns += read_cycles() - get_carrier()->run_since; // the time since it was switched in is not counted yet
+    }
+
+    end_protected_zone();
+
+    stats_to_ns(stats);
+    return 0;
+}
+
+int ult_get_runtime_stats(ult_stats_t* stats) {
+    init_lib();
+
+    start_protected_zone();
+    lock_scheduler();
+
+    *stats = joined_stats;
+    add_stats(stats, &(main_ult.stats));
+
+    for (ult_link_t* link = not_finished_ults.head; link != NULL; link = link->next) {
+        add_stats(stats, &(link->ult->stats));
+    }
+
+    unlock_scheduler();
+    end_protected_zone();
+
+    stats_to_ns(stats);
+    return 0;
+}
+
+void ult_sleep(uint64_t sec, uint64_t nsec) {
+    init_lib();
+
+    start_protected_zone();
+
+    ult_t* current = get_current();
+
+    // the sleeping thread leaves the run queue, the scheduler only looks at the first thread in the timer heap
+    current->wake_time = deadline_after(sec, nsec);
+    current->status = SLEEPING;
+    start_blocking(current, ULT_BLOCK_SLEEP);
+
+    spin_lock(&timer_lock);
+    ult_heap_push(&sleeping_ults, current);
+    uint8_t earliest = ult_heap_top(&sleeping_ults) == current;
+    update_next_wake_time();
+    spin_unlock(&timer_lock);
+
+    if (earliest) {
+        wake_timer_keeper();
+    }
+
+    SCHEDULER(current, 0);
+}
+
+void ult_yield() {
+    init_lib();
+
+    start_protected_zone();
+    SCHEDULER(get_current(), YIELDED);
+}
+
+int ult_wait_fd(int fd, short events, int timeout_ms) {
+    init_lib();
+
+    if (fd < 0) {
+        errno = EBADF;
+        return -1;
+    }
+
+    start_protected_zone();
+
+    ult_t* current = get_current();
+
+    spin_lock(&io_lock);
+
+    if (reserve_fd_waiter(fd) != 0 || fd_waiters[fd] != NULL) {
+        int error = (size_t) fd < fd_waiters_size ? EBUSY : ENOMEM;
+        spin_unlock(&io_lock);
+        end_protected_zone();
+
+        errno = error;
+        return -1;
+    }
+
+    start_blocking(current, ULT_BLOCK_IO);
+    fd_waiters[fd] = current;
+    atomic_fetch_add(&io_waiters, 1);
+
+    spin_unlock(&io_lock);
+
+    current->waiting_fd = fd;
+    current->io_revents = 0;
+    current->status = WAITING;
+
+    uint8_t earliest = 0;
+    if (timeout_ms >= 0) {
+        current->wake_time = get_time_ns() + (uint64_t) timeout_ms * 1000000;
+
+        spin_lock(&timer_lock);
+        ult_heap_push(&sleeping_ults, current);
+        earliest = ult_heap_top(&sleeping_ults) == current;
+        update_next_wake_time();
+        spin_unlock(&timer_lock);
+    }
+
+    // armed after the thread is registered, the event can come right away
+    struct epoll_event event = { .events = (uint32_t) events | EPOLLONESHOT, .data.u64 = (uint64_t) fd };
+    int err = epoll_ctl(reactor_fd, EPOLL_CTL_MOD, fd, &event);
+    if (err == -1 && errno == ENOENT) {
+        err = epoll_ctl(reactor_fd, EPOLL_CTL_ADD, fd, &event);
+    }
+
+    if (err == -1) {
+        int error = errno;
+
+        if (claim_fd_waiter(fd, current)) {
+            remove_from_timer(current);
+            current->status = RUNNING;
+            current->waiting_fd = -1;
+            current->block_reason = NOT_BLOCKED; // never blocked
+            end_protected_zone();
+        }
+        else {
+            // the timeout already expired and the thread was made ready, it has to go through the scheduler to consume that
+            SCHEDULER(current, 0);
+            current->waiting_fd = -1;
+        }
+
+        errno = error;
+        return -1;
+    }
+
+    // the new fd is watched right away
+    if (earliest) {
+        wake_timer_keeper();
+    }
+
+    SCHEDULER(current, 0);
+
+    current->waiting_fd = -1;
+    return (int) current->io_revents;
+}
+
+// the fds might be shared with code that doesn't know about the library, the flag is checked every time
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+
+    if (flags == -1) {
+        return -1;
+    }
+
+    if (!(flags & O_NONBLOCK) && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        return -1;
+    }
+
+    return 0;
+}
+
+// EAGAIN means the operation would block, wait until the fd is ready and try again
+// the fds that can't be watched by epoll (regular files) never return EAGAIN
+static inline int retry_after_wait(int fd, short events) {
+    if (errno == EINTR) {
+        return 1;
+    }
+
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        return 0;
+    }
+
+    return ult_wait_fd(fd, events, -1) >= 0;
+}
+
+// the result of a file operation, like the system call would return it
+static inline int64_t request_result(int64_t result) {
+    if (result < 0) {
+        errno = (int) -result;
+        return -1;
+    }
+
+    return result;
+}
+
+// the type of the fd is checked every time too, the number can be reused for another kind of file
+static int is_file(int fd) {
+    struct stat info;
+    return fstat(fd, &info) == 0 && (S_ISREG(info.st_mode) || S_ISBLK(info.st_mode));
+}
+
+// blocks the current thread until the request is completed, returns the result of the system call (-errno on error)
+static int64_t wait_request(io_request_t* request) {
+    init_lib();
+
+    start_protected_zone();
+
+    ult_t* current = get_current();
+
+    request->thread = current;
+    current->status = WAITING;
+    start_blocking(current, ULT_BLOCK_IO);
+    atomic_fetch_add(&io_inflight, 1);
+
+    start_request(request);
+
+    // the operation is submitted by the scheduler (the thread might be made ready before it switches out, that is fine)
+    SCHEDULER(current, 0);
+
+    return request->result;
+}
+
+ssize_t ult_read(int fd, void* buf, size_t count) {
+    if (is_file(fd)) {
+        io_request_t request = { .opcode = IORING_OP_READ, .fd = fd, .buf = buf, .count = count, .offset = -1 };
+        return (ssize_t) request_result(wait_request(&request));
+    }
+
+    if (set_nonblocking(fd) == -1) {
+        return -1;
+    }
+
+    while (1) {
+        ssize_t result = read(fd, buf, count);
+
+        if (result >= 0 || !retry_after_wait(fd, POLLIN)) {
+            return result;
+        }
+    }
+}
+
+ssize_t ult_write(int fd, const void* buf, size_t count) {
+    if (is_file(fd)) {
+        io_request_t request = { .opcode = IORING_OP_WRITE, .fd = fd, .buf = (void*) buf, .count = count, .offset = -1 };
+        return (ssize_t) request_result(wait_request(&request));
+    }
+
+    if (set_nonblocking(fd) == -1) {
+        return -1;
+    }
+
+    while (1) {
+        ssize_t result = write(fd, buf, count);
+
+        if (result >= 0 || !retry_after_wait(fd, POLLOUT)) {
+            return result;
+        }
+    }
+}
+
+int ult_accept(int fd, struct sockaddr* addr, socklen_t* addrlen) {
+    if (set_nonblocking(fd) == -1) {
+        return -1;
+    }
+
+    while (1) {
+        int result = accept(fd, addr, addrlen);
+
+        if (result >= 0 || !retry_after_wait(fd, POLLIN)) {
+            return result;
+        }
+    }
+}
+
+int ult_connect(int fd, const struct sockaddr* addr, socklen_t addrlen) {
+    if (set_nonblocking(fd) == -1) {
+        return -1;
+    }
+
+    if (connect(fd, addr, addrlen) == 0) {
+        return 0;
+    }
+
+    if (errno != EINPROGRESS && errno != EINTR) {
+        return -1;
+    }
+
+    // the connection is established (or failed) when the socket becomes writable
+    if (ult_wait_fd(fd, POLLOUT, -1) == -1) {
+        return -1;
+    }
+
+    int error = 0;
+    socklen_t length = sizeof(error);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) == -1) {
+        return -1;
+    }
+
+    if (error != 0) {
+        errno = error;
+        return -1;
+    }
+
+    return 0;
+}
+
+ssize_t ult_pread(int fd, void* buf, size_t count, off_t offset) {
+    if (offset < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    io_request_t request = { .opcode = IORING_OP_READ, .fd = fd, .buf = buf, .count = count, .offset = offset };
+    return (ssize_t) request_result(wait_request(&request));
+}
+
+ssize_t ult_pwrite(int fd, const void* buf, size_t count, off_t offset) {
+    if (offset < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    io_request_t request = { .opcode = IORING_OP_WRITE, .fd = fd, .buf = (void*) buf, .count = count, .offset = offset };
+    return (ssize_t) request_result(wait_request(&request));
+}
+
+int ult_fsync(int fd) {
+    io_request_t request = { .opcode = IORING_OP_FSYNC, .fd = fd };
+    return (int) request_result(wait_request(&request));
+}
+
+int ult_openat(int dirfd, const char* path, int flags, mode_t mode) {
+    io_request_t request = { .opcode = IORING_OP_OPENAT, .fd = dirfd, .path = path, .flags = flags, .mode = mode };
+    return (int) request_result(wait_request(&request));
+}
+
+uint64_t ult_get_id() {
+    init_lib();
+    return get_current()->id;
+}
+
+void ult_exit(void* retval) {
+    init_lib();
+
+    ult_t* current = get_current();
+
+    wrapper_exit(current, retval);
+}
+
+////////////////////// TRACING //////////////////////
+
+int ult_trace_start(size_t events_per_carrier) {
+    init_lib();
+
+    if (tracing || events_per_carrier == 0) {
+        return 1;
+    }
+
+    if (trace_rings == NULL) {
+        trace_rings = (trace_ring_t*) calloc(carrier_count, sizeof(trace_ring_t));
+        if (trace_rings == NULL) {
+            return 1;
+        }
+    }
+
+    for (uint32_t i = 0; i < carrier_count; i++) {
+        if (events_per_carrier != trace_ring_events) {
+            trace_ring_destroy(&trace_rings[i]);
+            if (trace_ring_init(&trace_rings[i], events_per_carrier) != 0) {
+                trace_ring_events = 0; // the rest are reallocated by the next call
+                return 1;
+            }
+        }
+        else {
+            trace_rings[i].head = 0;
+        }
+    }
+    trace_ring_events = events_per_carrier;
+
+    tracing = 1;
+    return 0;
+}
+
+void ult_trace_stop() {
+    tracing = 0;
+}
+
+int ult_trace_dump(const char* path) {
+    init_lib();
+    tracing = 0;
+
+    if (trace_rings == NULL || trace_ring_events == 0) {
+        return 1;
+    }
+
+    return trace_write_json(path, trace_rings, carrier_count, cycles_per_ns() * 1000);
+}
+
+////////////////////// LOCK PROFILER //////////////////////
+
+// one in lock_sample_period lock calls of every thread is sampled: the time it waits and the time it holds the mutex are measured
+// the waits on the queues (and everything about the conds) are counted every time, they are in the runtime anyway
+// nothing is allocated for a mutex that is never sampled or waited on, when the profiler is off the cost is a load and a branch per call
+
+static ult_lock_profile_t* lock_profiles = NULL;
+
+// the record is created by whoever needs it first, the others use that one (must be called outside protected zones, it allocates)
+static ult_lock_profile_t* get_profile(_Atomic(ult_lock_profile_t*)* slot, uint64_t id, uint8_t is_cond) {
+    ult_lock_profile_t* profile = atomic_load_explicit(slot, memory_order_acquire);
+    if (profile != NULL) {
+        return profile;
+    }
+
+    ult_lock_profile_t* created = (ult_lock_profile_t*) calloc(1, sizeof(ult_lock_profile_t));
+    if (created == NULL) {
+        return NULL; // not profiled
+    }
+    created->id = id;
+    created->is_cond = is_cond;
+
+    start_protected_zone();
+    spin_lock(&profile_lock);
+
+    profile = atomic_load_explicit(slot, memory_order_relaxed);
+    if (profile == NULL) {
+        created->next = lock_profiles;
+        if (lock_profiles != NULL) {
+            lock_profiles->prev = created;
+        }
+        lock_profiles = created;
+
+        profile = created;
+        atomic_store_explicit(slot, profile, memory_order_release);
+    }
+
+    spin_unlock(&profile_lock);
+    end_protected_zone();
+
+    if (profile != created) {
+        free(created);
+    }
+
+    return profile;
+}
+
+static void drop_profile(_Atomic(ult_lock_profile_t*)* slot) {
+    ult_lock_profile_t* profile = atomic_exchange(slot, NULL);
+    if (profile == NULL) {
+        return;
+    }
+
+    start_protected_zone();
+    spin_lock(&profile_lock);
+
+    if (profile->prev != NULL) {
+        profile->prev->next = profile->next;
+    }
+    else {
+        lock_profiles = profile->next;
+    }
+    if (profile->next != NULL) {
+        profile->next->prev = profile->prev;
+    }
+
+    spin_unlock(&profile_lock);
+    end_protected_zone();
+
+    free(profile);
+}
+
+static inline uint8_t lock_sampled(ult_t* current) {
+    uint32_t period = atomic_load_explicit(&lock_sample_period, memory_order_relaxed);
+
+    if (period == 0 || ++(current->lock_samples) < period) {
+        return 0;
+    }
+
+    current->lock_samples = 0;
+    return 1;
+}
+
+// called by the new owner of the mutex, wait is 0 if it didn't have to wait
+static void profile_acquired(ult_mutex_t* mutex, uint64_t wait, void* site) {
+    ult_lock_profile_t* profile = get_profile(&(mutex->profile), mutex->id, 0);
+    if (profile == NULL) {
+        return;
+    }
+
+    uint64_t now = read_cycles();
+
+    profile->stats.acquisitions += 1;
+    if (wait != 0) {
+        profile->stats.contended += 1;
+        profile->stats.wait_ns += wait;
+
+        if (wait > profile->stats.max_wait_ns) {
+            profile->stats.max_wait_ns = wait;
+            profile->stats.max_wait_site = site;
+        }
+    }
+
+    profile->acquired_at = now;
+}
+
+// called by the owner right before it releases the mutex
+static inline void profile_released(ult_mutex_t* mutex) {
+    ult_lock_profile_t* profile = atomic_load_explicit(&(mutex->profile), memory_order_relaxed);
+
+    if (profile == NULL || profile->acquired_at == 0) {
+        return; // the acquisition was not sampled
+    }
+
+    uint64_t held_us = (read_cycles() - profile->acquired_at) / lock_cycles_per_us;
+    int bucket = held_us == 0 ? 0 : 64 - __builtin_clzll(held_us);
+
+    profile->stats.hold_histogram[bucket < ULT_LOCK_HOLD_BUCKETS ? bucket : ULT_LOCK_HOLD_BUCKETS - 1] += 1;
+    profile->acquired_at = 0;
+}
+
+static void lock_stats_to_ns(ult_lock_stats_t* stats) {
+    double rate = cycles_per_ns();
+
+    stats->wait_ns = (uint64_t) (stats->wait_ns / rate);
+    stats->max_wait_ns = (uint64_t) (stats->max_wait_ns / rate);
+}
+
+int ult_set_lock_profiling(uint32_t sample_period) {
+    init_lib();
+
+    if (sample_period != 0) {
+        uint64_t cycles_per_us = (uint64_t) (cycles_per_ns() * 1000);
+        lock_cycles_per_us = cycles_per_us > 0 ? cycles_per_us : 1;
+    }
+
+    atomic_store(&lock_sample_period, sample_period);
+    return 0;
+}
+
+int ult_mutex_get_stats(ult_mutex_t* mutex, ult_lock_stats_t* stats) {
+    ult_lock_profile_t* profile = atomic_load(&(mutex->profile));
+
+    if (profile == NULL) {
+        memset(stats, 0, sizeof(ult_lock_stats_t));
+        return 0;
+    }
+
+    *stats = profile->stats;
+    lock_stats_to_ns(stats);
+    return 0;
+}
+
+int ult_cond_get_stats(ult_cond_t* cond, ult_cond_stats_t* stats) {
+    ult_lock_profile_t* profile = atomic_load(&(cond->profile));
+
+    if (profile == NULL) {
+        memset(stats, 0, sizeof(ult_cond_stats_t));
+        return 0;
+    }
+
+    *stats = profile->cond_stats;
+    return 0;
+}
+
+static int compare_mutex_profiles(const void* a, const void* b) {
+    const ult_lock_profile_t* first = (const ult_lock_profile_t*) a;
+    const ult_lock_profile_t* second = (const ult_lock_profile_t*) b;
+
+    return first->stats.wait_ns < second->stats.wait_ns ? 1 : (first->stats.wait_ns > second->stats.wait_ns ? -1 : 0);
+}
+
+static int compare_cond_profiles(const void* a, const void* b) {
+    const ult_lock_profile_t* first = (const ult_lock_profile_t*) a;
+    const ult_lock_profile_t* second = (const ult_lock_profile_t*) b;
+
+    return first->cond_stats.waits < second->cond_stats.waits ? 1 : (first->cond_stats.waits > second->cond_stats.waits ? -1 : 0);
+}
+
+// the object file and the offset in it can be given to addr2line, the symbol is only there for exported functions
+// the site is a return address, the offset points one byte back, inside the call instruction (the next line can belong to inlined code)
+static void print_site(void* site) {
+    Dl_info info;
+
+    if (site == NULL) {
+        printf("-");
+    }
+    else if (dladdr(site, &info) != 0 && info.dli_fname != NULL) {
+        printf("%s+0x%lx", info.dli_fname, (unsigned long) ((char*) site - 1 - (char*) info.dli_fbase));
+        if (info.dli_sname != NULL) {
+            printf(" (%s+0x%lx)", info.dli_sname, (unsigned long) ((char*) site - (char*) info.dli_saddr));
+        }
+    }
+    else {
+        printf("%p", site);
+    }
+}
+
+void ult_print_lock_report(uint32_t top) {
+    init_lib();
+
+    // a copy of the records, the report is printed without holding the lock
+    start_protected_zone();
+    spin_lock(&profile_lock);
+
+    size_t count = 0;
+    for (ult_lock_profile_t* profile = lock_profiles; profile != NULL; profile = profile->next) {
+        count += 1;
+    }
+
+    ult_lock_profile_t* copies = (ult_lock_profile_t*) malloc((count + 1) * sizeof(ult_lock_profile_t));
+    size_t mutexes = 0, conds = count;
+    if (copies != NULL) {
+        // the mutexes from the start, the conds from the end
+        for (ult_lock_profile_t* profile = lock_profiles; profile != NULL; profile = profile->next) {
+            copies[profile->is_cond ? --conds : mutexes++] = *profile;
+        }
+    }
+
+    spin_unlock(&profile_lock);
+    end_protected_zone();
+
+    if (copies == NULL) {
+        return;
+    }
+
+    qsort(copies, mutexes, sizeof(ult_lock_profile_t), compare_mutex_profiles);
+    qsort(copies + conds, count - conds, sizeof(ult_lock_profile_t), compare_cond_profiles);
+
+    printf("\n====\nLock report (1 in %u acquisitions sampled)\n", atomic_load(&lock_sample_period));
+
+    for (size_t i = 0; i < mutexes && i < top; i++) {
+        ult_lock_stats_t* stats = &(copies[i].stats);
+        lock_stats_to_ns(stats);
+
+        printf("mutex %lu: %lu acquisitions, %lu contended (%.1lf%%), wait %.3lf ms (max %.3lf ms at ",
+            copies[i].id, stats->acquisitions, stats->contended, stats->acquisitions > 0 ? 100.0 * stats->contended / stats->acquisitions : 0.0,
+            stats->wait_ns / 1e6, stats->max_wait_ns / 1e6);
+        print_site(stats->max_wait_site);
+        printf("), up to %u waiters\n    held (us):", stats->max_waiters);
+
+        for (int bucket = 0; bucket < ULT_LOCK_HOLD_BUCKETS; bucket++) {
+            if (stats->hold_histogram[bucket] != 0) {
+                printf(" %s%lu: %lu", bucket == ULT_LOCK_HOLD_BUCKETS - 1 ? ">=" : "<", 1ul << (bucket == ULT_LOCK_HOLD_BUCKETS - 1 ? bucket - 1 : bucket), stats->hold_histogram[bucket]);
+            }
+        }
+        printf("\n");
+    }
+
+    for (size_t i = conds; i < count && i - conds < top; i++) {
+        ult_cond_stats_t* stats = &(copies[i].cond_stats);
+        printf("cond %lu: %lu waits, %lu wakes, up to %u waiters\n", copies[i].id, stats->waits, stats->wakes, stats->max_waiters);
+    }
+
+    printf("====\n\n"); fflush(NULL);
+
+    free(copies);
+}
+
+////////////////////// MUTEX //////////////////////
+
+int ult_mutex_init(ult_mutex_t* mutex) {
+    init_lib();
+
+    mutex->id = atomic_fetch_add(&mutex_counter, 1) + 1;
+    atomic_init(&(mutex->owner), 0);
+    init_ult_queue(&(mutex->waiting));
+    atomic_init(&(mutex->profile), NULL);
+
+    return 0;
+}
+
+int ult_mutex_destroy(ult_mutex_t* mutex) {
+    init_lib();
+
+    if (atomic_load(&(mutex->owner)) != 0) {
+        return 1;
+    }
+
+    init_ult_queue(&(mutex->waiting));
+    drop_profile(&(mutex->profile));
+
+    return 0;
+}
+
+// takes the first thread of a waiting list that can be woken up, the ones whose timeout already fired stay in the list until the timer removes them
+// must be called with the scheduler lock held
+static ult_t* pop_waiter(ult_queue_t* waiting) {
+    for (ult_link_t* link = waiting->head; link != NULL; link = link->next) {
+        if (claim_waiter(link->ult)) {
+            ult_queue_remove(waiting, link);
+            return link->ult;
+        }
+    }
+
+    return NULL;
+}
+
+// hands the mutex to the first waiting thread, must be called with the scheduler lock held by the owner of the mutex
+// the waiters bit is only set under the scheduler lock, so it can't change while this runs
+static void release_mutex_locked(ult_mutex_t* mutex) {
+    profile_released(mutex);
+
+    if (tracing) {
+        trace_event(TRACE_UNLOCK, 0, mutex->id);
+    }
+
+    // if there are threads waiting for this mutex pass the ownership to the next thread in the waiting list
+    ult_t* next_owner = pop_waiter(&(mutex->waiting));
+
+    if (next_owner == NULL) {
+        // current thread frees the mutex
+        atomic_store_explicit(&(mutex->owner), 0, memory_order_release);
+        return;
+    }
+
+    uintptr_t waiters = mutex->waiting.size > 0 ? MUTEX_WAITERS : 0;
+    atomic_store_explicit(&(mutex->owner), (uintptr_t) next_owner | waiters, memory_order_release);
+
+    // if there is a thread waiting, WAKE IT UP!
+    next_owner->waiting_mutex = NULL;
+    make_ready(next_owner);
+}
+
+int ult_mutex_trylock(ult_mutex_t* mutex) {
+    init_lib(); // the fast path needs the current thread too, a mutex can be the first thing a program touches
+
+    ult_t* current = get_current();
+    uintptr_t expected = 0;
+
+    if (atomic_compare_exchange_strong_explicit(&(mutex->owner), &expected, (uintptr_t) current, memory_order_acquire, memory_order_relaxed)) {
+        if (lock_sampled(current)) {
+            profile_acquired(mutex, 0, __builtin_return_address(0));
+        }
+        if (tracing) {
+            trace_current(TRACE_LOCK, 0, mutex->id);
+        }
+        return 0;
+    }
+
+    // the mutex is held by the running thread
+    return mutex_owner(mutex) == current ? 0 : 1;
+}
+
+// site is the code that called lock, for the lock profiler
+// a wait that would deadlock returns EDEADLK if may_refuse is set and the avoidance is on (cond wait has to take the mutex back anyway)
+// the wait ends with ETIMEDOUT at the deadline, UINT64_MAX waits as long as it takes
+static int lock_mutex(ult_mutex_t* mutex, void* site, uint8_t may_refuse, uint64_t deadline) {
+    init_lib();
+
+    ult_t* current = get_current();
+    uintptr_t expected = 0;
+    uint8_t sampled = lock_sampled(current);
+
+    // the mutex is free, take it without entering the runtime
+    if (atomic_compare_exchange_strong_explicit(&(mutex->owner), &expected, (uintptr_t) current, memory_order_acquire, memory_order_relaxed)) {
+        if (sampled) {
+            profile_acquired(mutex, 0, site);
+        }
+        if (tracing) {
+            trace_current(TRACE_LOCK, 0, mutex->id);
+        }
+        return 0;
+    }
+
+    if (mutex_owner(mutex) == current) {
+        // the mutex is held by the running thread
+        return 0;
+    }
+
+    uint64_t wait_start = sampled ? read_cycles() : 0;
+    ult_lock_profile_t* profile = NULL;
+    if (atomic_load_explicit(&lock_sample_period, memory_order_relaxed) != 0) {
+        profile = get_profile(&(mutex->profile), mutex->id, 0); // the waiters are counted under the scheduler lock, nothing can be allocated there
+    }
+
+    start_protected_zone();
+    lock_scheduler();
+
+    // mark the mutex as waited, the owner can't release it without the scheduler lock after that
+    uintptr_t owner = atomic_load_explicit(&(mutex->owner), memory_order_relaxed);
+    while (1) {
+        if (owner == 0) {
+            // released in the meantime
+            if (atomic_compare_exchange_weak_explicit(&(mutex->owner), &owner, (uintptr_t) current, memory_order_acquire, memory_order_relaxed)) {
+                unlock_scheduler();
+
+                if (tracing) {
+                    trace_event(TRACE_LOCK, 1, mutex->id);
+                }
+
+                end_protected_zone();
+
+                if (sampled) {
+                    profile_acquired(mutex, read_cycles() - wait_start, site);
+                }
+                return 0;
+            }
+        }
+        else if ((owner & MUTEX_WAITERS) || atomic_compare_exchange_weak_explicit(&(mutex->owner), &owner, owner | MUTEX_WAITERS, memory_order_relaxed, memory_order_relaxed)) {
+            break;
+        }
+    }
+
+    if (may_refuse && deadlock_avoidance && would_deadlock(current, (ult_t*) (owner & ~MUTEX_WAITERS))) {
+        // the waiters bit might stay set without waiters, the next unlock just takes the slow path
+        unlock_scheduler();
+        end_protected_zone();
+        return EDEADLK;
+    }
+
+    // the current thread should wait
+    start_blocking(current, ULT_BLOCK_MUTEX);
+    ult_queue_push_last(&(mutex->waiting), &(current->queue_link));
+    current->status = WAITING;
+    current->waiting_mutex = mutex;
+
+    if (profile != NULL && mutex->waiting.size > profile->stats.max_waiters) {
+        profile->stats.max_waiters = (uint32_t) mutex->waiting.size;
+    }
+
+    uint8_t earliest = deadline != UINT64_MAX ? arm_wait_timeout(current, deadline) : 0;
+
+    unlock_scheduler();
+
+    if (earliest) {
+        wake_timer_keeper();
+    }
+
+    SCHEDULER(current, 0); // the scheduler will reset the signals, when it returns the mutex was handed to the current thread (or the timeout fired)
+
+    if (current->timed_out) {
+        current->timed_out = 0;
+        return ETIMEDOUT;
+    }
+
+    if (tracing) {
+        trace_current(TRACE_LOCK, 1, mutex->id);
+    }
+
+    if (sampled) {
+        profile_acquired(mutex, read_cycles() - wait_start, site);
+    }
+
+    return 0;
+}
+
+int ult_mutex_lock(ult_mutex_t* mutex) {
+    return lock_mutex(mutex, __builtin_return_address(0), 1, UINT64_MAX);
+}
+
+int ult_mutex_timedlock(ult_mutex_t* mutex, uint64_t sec, uint64_t nsec) {
+    return lock_mutex(mutex, __builtin_return_address(0), 1, deadline_after(sec, nsec));
+}
+
+int ult_mutex_unlock(ult_mutex_t* mutex) {
+    if (mutex == NULL) {
+        return 1;
+    }
+
+    init_lib(); // without a current thread the unlock of a free mutex would look like the owner's
+
+    ult_t* current = get_current();
+    uintptr_t expected = (uintptr_t) current;
+
+    if (atomic_load_explicit(&(mutex->profile), memory_order_relaxed) != NULL && mutex_owner(mutex) == current) {
+        profile_released(mutex);
+    }
+
+    // nobody waits, release it without entering the runtime
+    if (atomic_compare_exchange_strong_explicit(&(mutex->owner), &expected, 0, memory_order_release, memory_order_relaxed)) {
+        if (tracing) {
+            trace_current(TRACE_UNLOCK, 0, mutex->id);
+        }
+        return 0;
+    }
+
+    if ((ult_t*) (expected & ~MUTEX_WAITERS) != current) {
+        // exit with error if the mutex has no owner or the current thread is not the owner
+        return 1;
+    }
+
+    start_protected_zone();
+    lock_scheduler();
+
+    release_mutex_locked(mutex);
+
+    unlock_scheduler();
+    end_protected_zone();
+
+    return 0;
+}
+
+int ult_cond_init(ult_cond_t* cond) {
+    init_lib();
+
+    cond->id = atomic_fetch_add(&cond_counter, 1) + 1;
+    cond->deadlock_stage = 0;
+    cond->deadlock_group = 0;
+    init_ult_queue(&(cond->waiting));
+    atomic_init(&(cond->profile), NULL);
+
+    return 0;
+}
+
+int ult_cond_destroy(ult_cond_t* cond) {
+    init_lib();
+
+    start_protected_zone();
+    lock_scheduler();
+
+    if (cond->waiting.size != 0) {
+        unlock_scheduler();
+        end_protected_zone();
+        return 1;
+    }
+
+    init_ult_queue(&(cond->waiting));
+
+    unlock_scheduler();
+    end_protected_zone();
+
+    drop_profile(&(cond->profile));
+
+    return 0;
+}
+
+// the profile of the cond, created outside the protected zone (NULL if the profiler is off)
+static inline ult_lock_profile_t* cond_profile(ult_cond_t* cond) {
+    if (atomic_load_explicit(&lock_sample_period, memory_order_relaxed) == 0) {
+        return NULL;
+    }
+
+    return get_profile(&(cond->profile), cond->id, 1);
+}
+
+// deadline is UINT64_MAX if the wait doesn't time out, the mutex is taken back either way
+static int wait_cond(ult_cond_t* cond, ult_mutex_t* mutex, uint64_t deadline) {
+    init_lib();
+
+    ult_lock_profile_t* profile = cond_profile(cond);
+
+    start_protected_zone();
+    lock_scheduler();
+
+    // we cannot use ult_mutex_unlock as it would break the protection zone,
+    // and it is needed that the mutex unocking and waiting to be done atomically
+    // ult_mutex_unlock(mutex);
+
+    ult_t* current = get_current();
+
+    // unlock the mutex atomically with waiting to make sure that no signals are missed
+    if (mutex != NULL && mutex_owner(mutex) == current) {
+        release_mutex_locked(mutex);
+    }
+
+    start_blocking(current, ULT_BLOCK_COND);
+    ult_queue_push_last(&(cond->waiting), &(current->queue_link));
+    current->status = WAITING;
+    current->waiting_cond = cond;
+
+    if (profile != NULL) {
+        profile->cond_stats.waits += 1;
+        if (cond->waiting.size > profile->cond_stats.max_waiters) {
+            profile->cond_stats.max_waiters = (uint32_t) cond->waiting.size;
+        }
+    }
+
+    uint8_t earliest = deadline != UINT64_MAX ? arm_wait_timeout(current, deadline) : 0;
+
+    unlock_scheduler();
+
+    if (earliest) {
+        wake_timer_keeper();
+    }
+
+    SCHEDULER(current, 0);
+
+    uint8_t timed_out = current->timed_out;
+    current->timed_out = 0;
+
+    lock_mutex(mutex, __builtin_return_address(0), 0, UINT64_MAX);
+
+    return timed_out ? ETIMEDOUT : 0;
+}
+
+int ult_cond_wait(ult_cond_t* cond, ult_mutex_t* mutex) {
+    return wait_cond(cond, mutex, UINT64_MAX);
+}
+
+int ult_cond_timedwait(ult_cond_t* cond, ult_mutex_t* mutex, uint64_t sec, uint64_t nsec) {
+    return wait_cond(cond, mutex, deadline_after(sec, nsec));
+}
+
+int ult_cond_signal(ult_cond_t* cond) {
+    init_lib();
+
+    ult_lock_profile_t* profile = cond_profile(cond);
+
+    start_protected_zone();
+    lock_scheduler();
+
+    ult_t* ult_to_start = pop_waiter(&(cond->waiting));
+    if (ult_to_start == NULL) {
+        unlock_scheduler();
+        end_protected_zone();
+        return 1;
+    }
+
+    ult_to_start->waiting_cond = NULL;
+    make_ready(ult_to_start);
+
+    if (profile != NULL) {
+        profile->cond_stats.wakes += 1;
+    }
+
+    unlock_scheduler();
+    end_protected_zone();
+
+    return 0;
+}
+
+int ult_cond_broadcast(ult_cond_t* cond) {
+    init_lib();
+
+    ult_lock_profile_t* profile = cond_profile(cond);
+
+    start_protected_zone();
+    lock_scheduler();
+
+    ult_link_t* link = cond->waiting.head;
+    while (link != NULL) {
+        ult_link_t* next = link->next;
+        ult_t* ult_to_start = link->ult;
+
+        // the waiters whose timeout fired are left for the timer
+        if (claim_waiter(ult_to_start)) {
+            ult_queue_remove(&(cond->waiting), link);
+            ult_to_start->waiting_cond = NULL;
+            make_ready(ult_to_start);
+
+            if (profile != NULL) {
+                profile->cond_stats.wakes += 1;
+            }
+        }
+
+        link = next;
+    }
+
+    unlock_scheduler();
+    end_protected_zone();
+
+    return 0;
+}
+
+////////////////////// RWLOCK //////////////////////
+
+int ult_rwlock_init(ult_rwlock_t* rwlock, ult_rwlock_preference preference) {
+    init_lib();
+
+    if (preference != ULT_RWLOCK_PREFER_READERS && preference != ULT_RWLOCK_PREFER_WRITERS) {
+        return 1;
+    }
+
+    rwlock->id = atomic_fetch_add(&rwlock_counter, 1) + 1;
+    atomic_init(&(rwlock->state), 0);
+    rwlock->writer = NULL;
+    init_ult_queue(&(rwlock->waiting));
+    rwlock->waiting_writers = 0;
+    rwlock->prefer_writers = preference == ULT_RWLOCK_PREFER_WRITERS;
+    rwlock->deadlock_stage = 0;
+    rwlock->deadlock_group = 0;
+
+    return 0;
+}
+
+int ult_rwlock_destroy(ult_rwlock_t* rwlock) {
+    init_lib();
+
+    // the waiters bit is set while there are threads waiting
+    if (atomic_load(&(rwlock->state)) != 0) {
+        return 1;
+    }
+
+    init_ult_queue(&(rwlock->waiting));
+
+    return 0;
+}
+
+// the read lock slots of a thread are only changed by the thread, the deadlock check reads them under the scheduler lock
+// a slot is filled after the lock is taken and emptied before it is released, so the check never counts a reader that doesn't hold the lock
+static inline void track_read_lock(ult_t* current, ult_rwlock_t* rwlock) {
+    for (int i = 0; i < ULT_TRACKED_READ_LOCKS; i++) {
+        if (current->read_locks[i] == NULL) {
+            current->read_locks[i] = rwlock;
+            return;
+        }
+    }
+    // all the slots are taken, the deadlock check takes the waits on this rwlock as live
+    current->untracked_read_locks += 1;
+}
+
+// returns 0 if the thread doesn't read the rwlock, as far as it can tell (a lock beyond the slots can't be told apart from the others)
+static inline uint8_t untrack_read_lock(ult_t* current, ult_rwlock_t* rwlock) {
+    for (int i = 0; i < ULT_TRACKED_READ_LOCKS; i++) {
+        if (current->read_locks[i] == rwlock) {
+            current->read_locks[i] = NULL;
+            return 1;
+        }
+    }
+
+    if (current->untracked_read_locks > 0) {
+        current->untracked_read_locks -= 1;
+        return 1;
+    }
+
+    return 0;
+}
+
+static inline uint8_t holds_read_lock(ult_t* current, ult_rwlock_t* rwlock) {
+    for (int i = 0; i < ULT_TRACKED_READ_LOCKS; i++) {
+        if (current->read_locks[i] == rwlock) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// a reader can join the ones holding the rwlock if it isn't written, and if the writers are preferred nobody waits to write it
+// must be called with the scheduler lock held (waiting_writers)
+static inline uint8_t can_read(ult_rwlock_t* rwlock, uint64_t state) {
+    return !(state & RWLOCK_WRITER) && !(rwlock->prefer_writers && rwlock->waiting_writers > 0);
+}
+
+// hands the rwlock to the waiting threads that fit, in the order they came, must be called with the scheduler lock held after the rwlock was released or a waiter left
+// a writer that doesn't fit stops the readers behind it if the writers are preferred, otherwise they go past it
+// the waiters whose timeout already fired are left for the timer
+static void wake_rwlock_waiters(ult_rwlock_t* rwlock) {
+    ult_link_t* link = rwlock->waiting.head;
+
+    while (link != NULL) {
+        ult_link_t* next = link->next;
+        ult_t* thread = link->ult;
+        uint64_t state = atomic_load_explicit(&(rwlock->state), memory_order_relaxed);
+
+        if (state & RWLOCK_WRITER) {
+            break; // nothing else fits
+        }
+
+        if (thread->rwlock_exclusive && rwlock_readers(state) > 0) {
+            if (rwlock->prefer_writers) {
+                break;
+            }
+            link = next;
+            continue;
+        }
+
+        if (!claim_waiter(thread)) {
+            link = next;
+            continue;
+        }
+
+        // the waiters bit stays set, the thread doesn't touch the state when it wakes up
+        if (thread->rwlock_exclusive) {
+            rwlock->waiting_writers -= 1;
+            rwlock->writer = thread;
+            atomic_fetch_or_explicit(&(rwlock->state), RWLOCK_WRITER, memory_order_relaxed);
+        }
+        else {
+            atomic_fetch_add_explicit(&(rwlock->state), RWLOCK_READER, memory_order_relaxed);
+        }
+
+        ult_queue_remove(&(rwlock->waiting), link);
+        thread->waiting_rwlock = NULL;
+        make_ready(thread);
+
+        link = next;
+    }
+
+    if (rwlock->waiting.size == 0) {
+        // the fast paths work again
+        atomic_fetch_and_explicit(&(rwlock->state), ~RWLOCK_WAITERS, memory_order_release);
+    }
+}
+
+// exclusive takes the rwlock for writing, otherwise for reading
+// a wait that would deadlock returns EDEADLK if the avoidance is on, the wait ends with ETIMEDOUT at the deadline (UINT64_MAX waits as long as it takes)
+static int lock_rwlock(ult_rwlock_t* rwlock, uint8_t exclusive, uint64_t deadline) {
+    ult_t* current = get_current();
+    uint64_t state = atomic_load_explicit(&(rwlock->state), memory_order_relaxed);
+
+    // nobody waits and the rwlock fits, take it without entering the runtime
+    if (exclusive) {
+        state = 0;
+        if (atomic_compare_exchange_strong_explicit(&(rwlock->state), &state, RWLOCK_WRITER, memory_order_acquire, memory_order_relaxed)) {
+            rwlock->writer = current;
+            return 0;
+        }
+    }
+    else {
+        while (!(state & (RWLOCK_WRITER | RWLOCK_WAITERS))) {
+            if (atomic_compare_exchange_weak_explicit(&(rwlock->state), &state, state + RWLOCK_READER, memory_order_acquire, memory_order_relaxed)) {
+                track_read_lock(current, rwlock);
+                return 0;
+            }
+        }
+    }
+
+    start_protected_zone();
+    lock_scheduler();
+
+    // mark the rwlock as waited, after that it is only taken and released under the scheduler lock (except by the readers that leave before the last one)
+    state = atomic_load_explicit(&(rwlock->state), memory_order_relaxed);
+    while (1) {
+        uint8_t fits = exclusive ? (state & ~RWLOCK_WAITERS) == 0 : can_read(rwlock, state);
+
+        if (fits) {
+            uint64_t taken = exclusive ? state | RWLOCK_WRITER : state + RWLOCK_READER;
+            if (atomic_compare_exchange_weak_explicit(&(rwlock->state), &state, taken, memory_order_acquire, memory_order_relaxed)) {
+                if (exclusive) {
+                    rwlock->writer = current;
+                }
+                else {
+                    track_read_lock(current, rwlock);
+                }
+
+                unlock_scheduler();
+                end_protected_zone();
+                return 0;
+            }
+        }
+        else if ((state & RWLOCK_WAITERS) || atomic_compare_exchange_weak_explicit(&(rwlock->state), &state, state | RWLOCK_WAITERS, memory_order_relaxed, memory_order_relaxed)) {
+            break;
+        }
+    }
+
+    if (deadlock_avoidance && (would_deadlock(current, rwlock->writer) || (exclusive && holds_read_lock(current, rwlock)))) {
+        // the waiters bit might stay set without waiters, the rwlock is held and its last holder takes the slow path and clears it
+        unlock_scheduler();
+        end_protected_zone();
+        return EDEADLK;
+    }
+
+    // the current thread should wait
+    start_blocking(current, ULT_BLOCK_RWLOCK);
+    ult_queue_push_last(&(rwlock->waiting), &(current->queue_link));
+    current->status = WAITING;
+    current->waiting_rwlock = rwlock;
+    current->rwlock_exclusive = exclusive;
+    if (exclusive) {
+        rwlock->waiting_writers += 1;
+    }
+
+    uint8_t earliest = deadline != UINT64_MAX ? arm_wait_timeout(current, deadline) : 0;
+
+    unlock_scheduler();
+
+    if (earliest) {
+        wake_timer_keeper();
+    }
+
+    SCHEDULER(current, 0); // when it returns the rwlock was handed to the current thread (or the timeout fired)
+
+    if (current->timed_out) {
+        current->timed_out = 0;
+        return ETIMEDOUT;
+    }
+
+    if (!exclusive) {
+        track_read_lock(current, rwlock);
+    }
+
+    return 0;
+}
+
+int ult_rwlock_rdlock(ult_rwlock_t* rwlock) {
+    return lock_rwlock(rwlock, 0, UINT64_MAX);
+}
+
+int ult_rwlock_wrlock(ult_rwlock_t* rwlock) {
+    return lock_rwlock(rwlock, 1, UINT64_MAX);
+}
+
+int ult_rwlock_timedrdlock(ult_rwlock_t* rwlock, uint64_t sec, uint64_t nsec) {
+    return lock_rwlock(rwlock, 0, deadline_after(sec, nsec));
+}
+
+int ult_rwlock_timedwrlock(ult_rwlock_t* rwlock, uint64_t sec, uint64_t nsec) {
+    return lock_rwlock(rwlock, 1, deadline_after(sec, nsec));
+}
+
+int ult_rwlock_tryrdlock(ult_rwlock_t* rwlock) {
+    uint64_t state = atomic_load_explicit(&(rwlock->state), memory_order_relaxed);
+
+    while (!(state & (RWLOCK_WRITER | RWLOCK_WAITERS))) {
+        if (atomic_compare_exchange_weak_explicit(&(rwlock->state), &state, state + RWLOCK_READER, memory_order_acquire, memory_order_relaxed)) {
+            track_read_lock(get_current(), rwlock);
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+int ult_rwlock_trywrlock(ult_rwlock_t* rwlock) {
+    uint64_t expected = 0;
+
+    if (atomic_compare_exchange_strong_explicit(&(rwlock->state), &expected, RWLOCK_WRITER, memory_order_acquire, memory_order_relaxed)) {
+        rwlock->writer = get_current();
+        return 0;
+    }
+
+    return 1;
+}
+
+int ult_rwlock_unlock(ult_rwlock_t* rwlock) {
+    if (rwlock == NULL) {
+        return 1;
+    }
+
+    ult_t* current = get_current();
+    uint64_t state = atomic_load_explicit(&(rwlock->state), memory_order_relaxed);
+
+    if (state & RWLOCK_WRITER) {
+        if (rwlock->writer != current) {
+            return 1;
+        }
+
+        rwlock->writer = NULL;
+
+        // nobody waits, release it without entering the runtime
+        uint64_t expected = RWLOCK_WRITER;
+        if (atomic_compare_exchange_strong_explicit(&(rwlock->state), &expected, 0, memory_order_release, memory_order_relaxed)) {
+            return 0;
+        }
+
+        start_protected_zone();
+        lock_scheduler();
+
+        atomic_fetch_and_explicit(&(rwlock->state), ~RWLOCK_WRITER, memory_order_release);
+        wake_rwlock_waiters(rwlock);
+
+        unlock_scheduler();
+        end_protected_zone();
+
+        return 0;
+    }
+
+    if (rwlock_readers(state) == 0) {
+        // the rwlock is free
+        return 1;
+    }
+
+    if (!untrack_read_lock(current, rwlock)) {
+        return 1; // read by others
+    }
+
+    // the last reader wakes the waiters up, they can only be writers or readers behind a writer
+    uint64_t previous = atomic_fetch_sub_explicit(&(rwlock->state), RWLOCK_READER, memory_order_release);
+    if ((previous & RWLOCK_WAITERS) && rwlock_readers(previous) == 1) {
+        start_protected_zone();
+        lock_scheduler();
+
+        wake_rwlock_waiters(rwlock);
+
+        unlock_scheduler();
+        end_protected_zone();
+    }
+
+    return 0;
+}
+
+////////////////////// SEMAPHORE, BARRIER, WAIT GROUP //////////////////////
+
+// puts the current thread in the waiting queue of a semaphore, a barrier or a wait group, must be called inside a protected zone with the scheduler lock held
+// returns outside of the zone when the thread was woken up, or with ETIMEDOUT at the deadline (UINT64_MAX waits as long as it takes)
+static int wait_in_queue(ult_cond_t* waiters, uint64_t deadline) {
+    ult_t* current = get_current();
+
+    start_blocking(current, ULT_BLOCK_SYNC);
+    ult_queue_push_last(&(waiters->waiting), &(current->queue_link));
+    current->status = WAITING;
+    current->waiting_cond = waiters;
+
+    uint8_t earliest = deadline != UINT64_MAX ? arm_wait_timeout(current, deadline) : 0;
+
+    unlock_scheduler();
+
+    if (earliest) {
+        wake_timer_keeper();
+    }
+
+    SCHEDULER(current, 0);
+
+    if (current->timed_out) {
+        current->timed_out = 0;
+        return ETIMEDOUT;
+    }
+
+    return 0;
+}
+
+// wakes up the first n threads of the waiting queue, must be called with the scheduler lock held, returns how many there were
+static uint32_t wake_from_queue(ult_cond_t* waiters, uint32_t n) {
+    uint32_t woken = 0;
+
+    while (woken < n) {
+        ult_t* thread = pop_waiter(&(waiters->waiting));
+        if (thread == NULL) {
+            break;
+        }
 
-    ult->joined_by                = NULL;
-    ult->waiting_to_join          = NULL;
-    ult->waiting_mutex            = NULL;
-    ult->deadlock_explore_counter = 0;
+        thread->waiting_cond = NULL;
+        make_ready(thread);
+        woken += 1;
+    }
 
-    ult->arg           = arg;
-    ult->start_routine = start_routine;
-    ult->joined_by     = NULL;
+    return woken;
 }
 
-static inline void init_ult_context(ult_t* ult, ucontext_t* link) {
-    if (getcontext(&(ult->context)) != 0)
-        BAIL("Get Context");
+int ult_sem_init(ult_sem_t* sem, uint32_t value) {
+    init_lib();
 
-    VALGRIND_STACK_REGISTER(ult->stack, ult->stack + DEFAULT_ULT_STACK_SIZE);
+    atomic_init(&(sem->state), value * SEM_UNIT);
+    ult_cond_init(&(sem->waiters));
 
-    ult->context.uc_stack.ss_sp = ult->stack;
-    ult->context.uc_stack.ss_size = sizeof(ult->stack);
-    ult->context.uc_link = link;
+    return 0;
 }
 
-void SCHEDULER(ult_t* current) {
-    // printf("[scheduler / %ld] scheduler started\n", current->id); fflush(NULL);
+int ult_sem_destroy(ult_sem_t* sem) {
+    return ult_cond_destroy(&(sem->waiters));
+}
 
-    start_protected_zone(); // unset signals after switch to avoid scheduler being interrupted
+static int wait_sem(ult_sem_t* sem, uint64_t deadline) {
+    uint64_t state = atomic_load_explicit(&(sem->state), memory_order_relaxed);
 
-    // check if we should change the execution to another thread
-    if (should_change_thread) {
-        rotate_ult_front_to_back(&running_ult_list);
-        should_change_thread = 0;
-        // printf("[scheduler] rotate from %lu to %lu\n", running_ult_list.tail->ult->id, running_ult_list.head->ult->id); fflush(NULL);
+    // the value is not 0 and nobody waits, take one without entering the runtime
+    while (state >= SEM_UNIT && !(state & SEM_WAITERS)) {
+        if (atomic_compare_exchange_weak_explicit(&(sem->state), &state, state - SEM_UNIT, memory_order_acquire, memory_order_relaxed)) {
+            return 0;
+        }
     }
 
-    if (running_ult_list.size == 0) {
-        find_deadlocks();
-        BAIL("There are no running threads! This might indicate that a deadlock that involves all existing threads occured!");
+    start_protected_zone();
+    lock_scheduler();
+
+    // mark the semaphore as waited, after that the posts take the scheduler lock
+    state = atomic_load_explicit(&(sem->state), memory_order_relaxed);
+    while (1) {
+        if (state >= SEM_UNIT) {
+            // posted in the meantime
+            if (atomic_compare_exchange_weak_explicit(&(sem->state), &state, state - SEM_UNIT, memory_order_acquire, memory_order_relaxed)) {
+                unlock_scheduler();
+                end_protected_zone();
+                return 0;
+            }
+        }
+        else if ((state & SEM_WAITERS) || atomic_compare_exchange_weak_explicit(&(sem->state), &state, state | SEM_WAITERS, memory_order_relaxed, memory_order_relaxed)) {
+            break;
+        }
     }
 
-    ult_t* thread = running_ult_list.head->ult;
-    while (/*thread != NULL &&*/ thread->status != RUNNING) { // if all threads are sleeping this loop will repeat until one wakes up
-        if (thread->status == SLEEPING) {
-            // printf("[scheduler] %lu is sleeping\n", thread->id); fflush(NULL);
-            struct timespec current_time;
+    // a post hands its unit to the thread directly, the value stays 0
+    return wait_in_queue(&(sem->waiters), deadline);
+}
 
-            if (clock_gettime(SLEEP_CLOCK, &current_time) == -1) {
-                BAIL("Get Time");
-            }
+int ult_sem_wait(ult_sem_t* sem) {
+    return wait_sem(sem, UINT64_MAX);
+}
 
-            const uint64_t ns_in_sec = 1000000000;
-            uint64_t elapsed = (current_time.tv_sec - thread->sleep_time.tv_sec) * ns_in_sec + (current_time.tv_nsec - thread->sleep_time.tv_nsec);
-            
-            if (elapsed > thread->sleep_amount_nsec) {
-                // the thread should wake up
-                thread->status = RUNNING;
-                // printf("[scheduler] waking up %lu\n", thread->id); fflush(NULL);
-            }
-            else {
-                // the thread should remain sleeping
-                // printf("[scheduler] %lu reamains sleeping\n", thread->id); fflush(NULL);
-                rotate_ult_front_to_back(&running_ult_list);
-                thread = running_ult_list.head->ult;
-                // printf("[scheduler] rotate from %lu to %lu\n", running_ult_list.tail->ult->id, running_ult_list.head->ult->id); fflush(NULL);
-            }
+int ult_sem_timedwait(ult_sem_t* sem, uint64_t sec, uint64_t nsec) {
+    return wait_sem(sem, deadline_after(sec, nsec));
+}
+
+int ult_sem_trywait(ult_sem_t* sem) {
+    uint64_t state = atomic_load_explicit(&(sem->state), memory_order_relaxed);
+
+    while (state >= SEM_UNIT) {
+        if (atomic_compare_exchange_weak_explicit(&(sem->state), &state, state - SEM_UNIT, memory_order_acquire, memory_order_relaxed)) {
+            return 0;
         }
     }
 
-    end_protected_zone(); // set signal handlers before switch
+    return 1;
+}
 
-    // printf("[scheduler] switch to %lu\n", running_ult_list.head->ult->id); fflush(NULL);
-    // no need to swap if the current thread is the next scheduled for execution
-    if (current->id != thread->id) {
-        if (swapcontext(&(current->context), &(thread->context)) != 0) 
-            BAIL("Swapcontext scheduler");
+int ult_sem_post_n(ult_sem_t* sem, uint32_t n) {
+    if (n == 0) {
+        return 0;
     }
-}
 
-static inline void wrapper_exit(ult_t* current, void* result) {
-    start_protected_zone();
+    uint64_t state = atomic_load_explicit(&(sem->state), memory_order_relaxed);
 
-    current->result = result;
-    current->status = FINISHED;
+    // nobody waits, add to the value without entering the runtime
+    while (!(state & SEM_WAITERS)) {
+        if (atomic_compare_exchange_weak_explicit(&(sem->state), &state, state + n * SEM_UNIT, memory_order_release, memory_order_relaxed)) {
+            return 0;
+        }
+    }
 
-    // remove the current thread from the running list
-    delete_ult_first(&running_ult_list);    // in theory the current thread is the first
-    // the memory is freed after join
+    start_protected_zone();
+    lock_scheduler();
 
-    if (current->joined_by != NULL) {
-        printf("[%lu] wrapper, change status of (%lu) to RUNNING\n", current->id, current->joined_by->id); fflush(NULL);
-        current->joined_by->status = RUNNING; // wake the thread waiting to join the current thread, without changing the run order
-        current->joined_by->waiting_to_join = NULL;
-        insert_ult_last(&running_ult_list, current->joined_by);
+    uint32_t woken = wake_from_queue(&(sem->waiters), n);
+    if (woken < n) {
+        atomic_fetch_add_explicit(&(sem->state), (n - woken) * SEM_UNIT, memory_order_release);
     }
 
-    printf("[%lu] wrapper exit\n", current->id); fflush(NULL);
+    // the waiters whose timeout fired keep the bit set until the timer removes them, the posts take the slow path meanwhile
+    if (sem->waiters.waiting.size == 0) {
+        atomic_fetch_and_explicit(&(sem->state), ~SEM_WAITERS, memory_order_release);
+    }
 
-    SCHEDULER(current);
+    unlock_scheduler();
     end_protected_zone();
-}
 
-void wrapper() {
-    ult_t* current = running_ult_list.head->ult;
-    void* result;
+    return 0;
+}
 
-    printf("[%lu] wrapper enter\n", current->id); fflush(NULL);
-    result = current->start_routine(current->arg);
-    printf("[%lu] routine finished\n", current->id); fflush(NULL);
+int ult_sem_post(ult_sem_t* sem) {
+    return ult_sem_post_n(sem, 1);
+}
 
-    wrapper_exit(current, result);
+uint32_t ult_sem_getvalue(ult_sem_t* sem) {
+    return (uint32_t) (atomic_load_explicit(&(sem->state), memory_order_relaxed) / SEM_UNIT);
 }
 
-void sig_handler(int signum, siginfo_t *si, void *uc) {
-    // printf("[handler %lu] received %d, protect: %s\n", running_ult_list.head->ult->id, signum, inside_protected_zone? "true": "false"); fflush(NULL);
+int ult_barrier_init(ult_barrier_t* barrier, uint32_t count) {
+    init_lib();
 
-    if (inside_protected_zone && signum != DEADLOCK_SIG) {
-        // printf("[handler] IGNORE %d\n", signum); fflush(NULL);
-        return;
+    if (count == 0) {
+        return 1;
     }
 
-    switch (signum) {
-        case TIMER_SIG:
-            should_change_thread = 1;
-            SCHEDULER(running_ult_list.head->ult);
-            break;
+    barrier->count = count;
+    barrier->arrived = 0;
+    ult_cond_init(&(barrier->waiters));
 
-        case DEADLOCK_SIG:
-            find_deadlocks();
-            break;
-    }
+    return 0;
 }
 
-static void init_main() {
-    uint64_t id = 1;
-    ult_counter = 1;
-
-    init_ult(&main_ult, id, NULL, NULL);
-    init_ult_context(&main_ult, NULL); // when main is done the entire program is done, no cleanup will be done after
-
-    insert_ult_last(&running_ult_list, &main_ult);
+int ult_barrier_destroy(ult_barrier_t* barrier) {
+    return ult_cond_destroy(&(barrier->waiters));
 }
 
-static void init_timer() {
-    timer_t             timerid;
-    struct sigevent     sev;
-    struct itimerspec   its;
+int ult_barrier_wait(ult_barrier_t* barrier) {
+    start_protected_zone();
+    lock_scheduler();
 
-    // Set up the timer
-    sev.sigev_notify = SIGEV_SIGNAL;
-    sev.sigev_signo = TIMER_SIG;
-    sev.sigev_value.sival_ptr = &timerid;
-    if (timer_create(CLOCKID, &sev, &timerid) == -1) {
-        BAIL("Timer Create");
+    barrier->arrived += 1;
+
+    if (barrier->arrived < barrier->count) {
+        return wait_in_queue(&(barrier->waiters), UINT64_MAX);
     }
 
-    its.it_value.tv_sec = 0;
-    its.it_value.tv_nsec = TIMER_INTERVAL_NS;
-    its.it_interval.tv_sec = 0;
-    its.it_interval.tv_nsec = TIMER_INTERVAL_NS;
+    // the last one releases exactly the threads of this round, the ones that arrive next wait for the next round
+    barrier->arrived = 0;
+    wake_from_queue(&(barrier->waiters), barrier->count - 1);
 
-    // Start the timer
-    if (timer_settime(timerid, 0, &its, NULL) == -1) {
-        BAIL("Timer Settime");
-    }
+    unlock_scheduler();
+    end_protected_zone();
+
+    return ULT_BARRIER_SERIAL_THREAD;
 }
 
-static void init_signals() {
-    // prepare signal masks
-    sigemptyset(&mask_sig);
-    sigaddset(&mask_sig, TIMER_SIG);
-    // sigaddset(&mask_sig, DEADLOCK_SIG);
-    sigemptyset(&no_mask);
+int ult_waitgroup_init(ult_waitgroup_t* group) {
+    init_lib();
 
-    // setup signal handlers
-    struct sigaction sa;
+    atomic_init(&(group->counter), 0);
+    ult_cond_init(&(group->waiters));
 
-    sa.sa_sigaction = sig_handler;
-    sa.sa_flags = SA_SIGINFO;
-    sigemptyset(&sa.sa_mask);
-    sigaction(TIMER_SIG, &sa, NULL);
-    sigaction(DEADLOCK_SIG, &sa, NULL);
+    return 0;
 }
 
-static inline void init_lib() {
-    if (ult_counter == 0) {
-        printf("Initializing library\n");
-        init_ult_linked_list(&running_ult_list);
-        init_ult_linked_list(&not_finished_ults);
-
-        // this is the first call to the library
-        init_signals();
-        init_timer();
-        init_main(); // we initialize main after initializing all other lib parts to make sure that we don't execute the code twice
-    }
+int ult_waitgroup_destroy(ult_waitgroup_t* group) {
+    return ult_cond_destroy(&(group->waiters));
 }
 
-// 'public' members
+int ult_waitgroup_add(ult_waitgroup_t* group, int64_t delta) {
+    int64_t counter = atomic_load_explicit(&(group->counter), memory_order_relaxed);
 
-int ult_create(ult_t* thread, voidptr_arg_voidptr_ret_func start_routine, void* arg) {
-    init_lib();
+    do {
+        if (counter + delta < 0) {
+            return 1;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(&(group->counter), &counter, counter + delta, memory_order_acq_rel, memory_order_relaxed));
 
-    ult_t* running = running_ult_list.head->ult;
-    printf("[%lu] create: %lu\n", running->id, ult_counter + 1); fflush(NULL);
+    if (delta == 0 || counter + delta != 0) {
+        return 0;
+    }
 
-    start_protected_zone(); // protect this area from being interrupted
-        ult_counter += 1;
-        uint64_t id = ult_counter;
-    end_protected_zone(); // end of protected zone
+    // the waiters check the counter under the scheduler lock, so the ones that saw it above 0 are already in the queue
+    // if it went up again in the meantime they wait for the next time it gets to 0
+    start_protected_zone();
+    lock_scheduler();
 
-    init_ult(thread, id, start_routine, arg);
-    init_ult_context(thread, NULL);    // when done return to the scheduler
+    if (atomic_load(&(group->counter)) == 0) {
+        wake_from_queue(&(group->waiters), UINT32_MAX);
+    }
 
-    // cast wraper to a function without parameters that returns void (void (*)(void)) to avoid compiler warning if wrapper has parameters
-    makecontext(&(thread->context), wrapper, 0);  // passing pointers as parameters to makecontext might not be portable, so we save the parameters in ult_data
-        
-    start_protected_zone();
-        insert_ult_last(&running_ult_list, thread);
-        insert_ult_last(&not_finished_ults, thread);
+    unlock_scheduler();
     end_protected_zone();
 
-    // TODO: maybe it would be more 'fair' to call swap
     return 0;
 }
 
-int ult_join(ult_t* thread, void** retval) {
-    init_lib();
-
-    start_protected_zone();
-
-    ult_t* current_waiting_join = running_ult_list.head->ult;
+int ult_waitgroup_done(ult_waitgroup_t* group) {
+    return ult_waitgroup_add(group, -1);
+}
 
-    printf("[%lu] waiting to join: %lu\n", current_waiting_join->id, thread->id); fflush(NULL);
+int ult_waitgroup_wait(ult_waitgroup_t* group) {
+    if (atomic_load(&(group->counter)) == 0) {
+        return 0;
+    }
 
-    if (thread->joined_by != NULL) {
-        // the thread is already being waited by some other thread
-        printf("[%lu] %lu was already waited by %lu\n", current_waiting_join->id, thread->id, thread->joined_by->id); fflush(NULL);
+    start_protected_zone();
+    lock_scheduler();
 
+    if (atomic_load(&(group->counter)) == 0) {
+        unlock_scheduler();
         end_protected_zone();
-        return 2;
+        return 0;
     }
 
-    if (thread->status != FINISHED) {
-        printf("[%lu] %lu did not finish yet\n", current_waiting_join->id, thread->id); fflush(NULL);
-
-        if (thread->joined_by != NULL) {
-            // the thread is already being waited by some other thread
-            printf("[%lu] %lu is being waited by %lu\n", current_waiting_join->id, thread->id, thread->joined_by->id); fflush(NULL);
-
-            end_protected_zone();
-            return 2;
-        }
+    return wait_in_queue(&(group->waiters), UINT64_MAX);
+}
 
-        thread->joined_by = current_waiting_join;
-        current_waiting_join->status = WAITING;
-        current_waiting_join->waiting_to_join = thread;
-        delete_ult_first(&running_ult_list); // remove the current thread from the running list
+////////////////////// CHANNEL //////////////////////
 
-        SCHEDULER(current_waiting_join); // the scheduler would set the signals back
-        start_protected_zone();
-    }
+// what a thread blocked in a channel sends or wants, on its stack while it waits
+typedef struct chan_transfer_t {
+    void**  items;
+    size_t  count;  // the items to send, or the most the receiver takes
+    size_t  done;   // moved by the other side so far
+} chan_transfer_t;
 
-    // current thread is now running after the finish of the to-be-joined thread (or the thread was already in the finished state)
-    if (retval != NULL) {
-        *retval = thread->result;
-    }
+int ult_chan_init(ult_chan_t* chan, size_t capacity) {
+    init_lib();
 
-    // remove the thread from the not finished list
-    ult_node_t* current = not_finished_ults.head;
-    while (current != NULL) {
-        if (current->ult->id == thread->id) {
-            // there won't be duplicate ids, we can exit immediately after deleting this node so there is no need to save the next node pointer
-            delete_ult_node(&not_finished_ults, current);
-            break;
+    chan->buffer = NULL;
+    if (capacity > 0) {
+        chan->buffer = (void**) malloc(capacity * sizeof(void*));
+        if (chan->buffer == NULL) {
+            return 1;
         }
-
-        current = current->next;
     }
-    VALGRIND_STACK_DEREGISTER(thread->stack);
 
-    end_protected_zone();
+    chan->capacity = capacity;
+    chan->head = 0;
+    chan->count = 0;
+    chan->closed = 0;
+    atomic_flag_clear(&(chan->lock));
+    ult_cond_init(&(chan->senders));
+    ult_cond_init(&(chan->receivers));
 
     return 0;
 }
 
-void ult_sleep(uint64_t sec, uint64_t nsec) {
-    ult_t* current = running_ult_list.head->ult;
+int ult_chan_destroy(ult_chan_t* chan) {
+    start_protected_zone();
+    spin_lock(&(chan->lock));
 
-    printf("[%lu] sleep\n", current->id); fflush(NULL);
+    uint8_t waited = chan->senders.waiting.size > 0 || chan->receivers.waiting.size > 0;
 
-    if (clock_gettime(SLEEP_CLOCK, &(current->sleep_time)) == -1) {
-        BAIL("Get Time");
+    spin_unlock(&(chan->lock));
+    end_protected_zone();
+
+    if (waited) {
+        return 1;
     }
 
-    current->sleep_amount_nsec = sec * 1000000000 + nsec;
-    current->status = SLEEPING;
+    free(chan->buffer);
+    chan->buffer = NULL;
+    chan->capacity = 0;
+    chan->count = 0;
 
-    should_change_thread = 1;
-    SCHEDULER(current);
+    return 0;
 }
 
-uint64_t ult_get_id() {
-    init_lib();
-    return running_ult_list.head->ult->id;
+// the thread was taken out of the waiting queue of the channel, must be called with the channel lock held
+// its transfer is on its stack, it can't be touched after this
+static inline void wake_chan_waiter(ult_t* thread) {
+    // the deadlock check reads waiting_cond under the scheduler lock, the channel lock alone doesn't keep it still
+    lock_scheduler();
+    thread->waiting_cond = NULL;
+    unlock_scheduler();
+
+    make_ready(thread);
 }
 
-void ult_exit(void* retval) {
-    init_lib();
+// the first waiting senders move their items into the free room of the buffer, the ones that are done are woken up
+// must be called with the channel lock held
+static void refill_from_senders(ult_chan_t* chan) {
+    while (chan->count < chan->capacity && chan->senders.waiting.size > 0) {
+        ult_t* sender = chan->senders.waiting.head->ult;
+        chan_transfer_t* transfer = (chan_transfer_t*) sender->chan_transfer;
 
-    ult_t* current = running_ult_list.head->ult;
+        chan->buffer[(chan->head + chan->count) % chan->capacity] = transfer->items[transfer->done++];
+        chan->count += 1;
 
-    wrapper_exit(current, retval);
+        if (transfer->done == transfer->count) {
+            ult_queue_pop_first(&(chan->senders.waiting));
+            wake_chan_waiter(sender);
+        }
+    }
 }
 
-int ult_mutex_init(ult_mutex_t* mutex) {
-    init_lib();
+// moves up to n items to the receiver oldest first, from the buffer (which the waiting senders fill back up) or straight from the senders of a rendezvous channel
+// must be called with the channel lock held, returns how many
+static size_t take_items(ult_chan_t* chan, void** items, size_t n) {
+    size_t taken = 0;
+
+    while (taken < n) {
+        if (chan->count > 0) {
+            items[taken++] = chan->buffer[chan->head];
+            chan->head = (chan->head + 1) % chan->capacity;
+            chan->count -= 1;
+            refill_from_senders(chan);
+        }
+        else if (chan->senders.waiting.size > 0) {
+            // senders only wait with an empty buffer if there is no buffer
+            ult_t* sender = chan->senders.waiting.head->ult;
+            chan_transfer_t* transfer = (chan_transfer_t*) sender->chan_transfer;
 
-    start_protected_zone();
-        mutex_counter += 1;
-        uint64_t id = mutex_counter;
-    end_protected_zone();
+            items[taken++] = transfer->items[transfer->done++];
 
-    mutex->id = id;
-    mutex->owner = NULL;
-    init_ult_linked_list(&(mutex->waiting));
+            if (transfer->done == transfer->count) {
+                ult_queue_pop_first(&(chan->senders.waiting));
+                wake_chan_waiter(sender);
+            }
+        }
+        else {
+            break;
+        }
+    }
 
-    return 0;
+    return taken;
 }
 
-int ult_mutex_destroy(ult_mutex_t* mutex) {
-    init_lib();
+// hands the items to the waiting receivers first (each one takes as many as it asked for), then puts them in the buffer
+// must be called with the channel lock held, returns how many
+static size_t put_items(ult_chan_t* chan, void** items, size_t n) {
+    size_t put = 0;
 
-    start_protected_zone();
+    // receivers only wait while the buffer is empty, the items go around it
+    while (put < n && chan->receivers.waiting.size > 0) {
+        ult_t* receiver = ult_queue_pop_first(&(chan->receivers.waiting));
+        chan_transfer_t* transfer = (chan_transfer_t*) receiver->chan_transfer;
 
-    if (mutex->owner != NULL) {
-        end_protected_zone();
-        return 1;
-    }
+        while (put < n && transfer->done < transfer->count) {
+            transfer->items[transfer->done++] = items[put++];
+        }
 
-    destroy_ult_list(&(mutex->waiting));
+        wake_chan_waiter(receiver);
+    }
 
-    end_protected_zone();
+    while (put < n && chan->count < chan->capacity) {
+        chan->buffer[(chan->head + chan->count) % chan->capacity] = items[put++];
+        chan->count += 1;
+    }
 
-    return 0;
+    return put;
 }
 
-int ult_mutex_lock(ult_mutex_t* mutex) {
-    init_lib();
+// the current thread waits in one of the queues of the channel until the other side moved its items or the channel was closed
+// must be called inside a protected zone with the channel lock held, returns outside of the zone
+static void wait_in_chan(ult_chan_t* chan, ult_cond_t* queue, chan_transfer_t* transfer) {
+    ult_t* current = get_current();
 
-    start_protected_zone();
+    start_blocking(current, ULT_BLOCK_CHAN);
+    ult_queue_push_last(&(queue->waiting), &(current->queue_link));
+    current->status = WAITING;
+    current->chan_transfer = transfer;
+
+    // published for the deadlock check, the queue itself is only touched under the channel lock
+    lock_scheduler();
+    current->waiting_cond = queue;
+    unlock_scheduler();
 
-    ult_t* current = running_ult_list.head->ult;
+    spin_unlock(&(chan->lock));
 
-    if (mutex->owner == NULL) {
-        // the mutex is free
-        printf("[%lu] mutex %lu is free\n", current->id, mutex->id); fflush(NULL);
-        mutex->owner = current;
+    SCHEDULER(current, 0);
+}
+
+size_t ult_chan_send_n(ult_chan_t* chan, void** items, size_t n) {
+    start_protected_zone();
+    spin_lock(&(chan->lock));
+
+    if (chan->closed) {
+        spin_unlock(&(chan->lock));
         end_protected_zone();
         return 0;
     }
 
-    if (mutex->owner->id == current->id) { // comapring the pointers should also work, but for corectness comapre ids
-        // the mutex is held by the running thread
-        printf("[%lu] mutex %lu is already held by me\n", current->id, mutex->id); fflush(NULL);
+    size_t sent = put_items(chan, items, n);
+    if (sent == n) {
+        spin_unlock(&(chan->lock));
         end_protected_zone();
-        return 0;
+        return n;
     }
 
-    printf("[%lu] mutex %lu is held by %lu\n", current->id, mutex->id, mutex->owner->id); fflush(NULL);
-
-    // the current thread should wait
-    insert_ult_last(&(mutex->waiting), current);
-    current->status = WAITING;
-    current->waiting_mutex = mutex;
-    delete_ult_first(&running_ult_list);
-
-    printf("[%lu] switched to WAITING at mutex %lu\n", current->id, mutex->id); fflush(NULL);
-
-    SCHEDULER(current); // the scheduler will reset the signals
+    // the receivers take the rest as the room frees up
+    chan_transfer_t transfer = { items + sent, n - sent, 0 };
+    wait_in_chan(chan, &(chan->senders), &transfer);
 
-    end_protected_zone();
-    
-    return 0;
+    return sent + transfer.done;
 }
 
-int ult_mutex_unlock(ult_mutex_t* mutex) {
-    init_lib();
+size_t ult_chan_recv_n(ult_chan_t* chan, void** items, size_t n) {
+    if (n == 0) {
+        return 0;
+    }
 
     start_protected_zone();
+    spin_lock(&(chan->lock));
 
-    ult_t* current = running_ult_list.head->ult;
-
-    if (mutex == NULL || mutex->owner == NULL || mutex->owner->id != current->id) {
-        // exit with error if the mutex doesn't exist, has no owner or the current thread is not the owner
+    size_t received = take_items(chan, items, n);
+    if (received > 0 || chan->closed) {
+        spin_unlock(&(chan->lock));
         end_protected_zone();
-        return 1;
+        return received;
     }
 
-    // current thread frees the mutex
-    mutex->owner = NULL;
+    // the next sender fills the items in directly
+    chan_transfer_t transfer = { items, n, 0 };
+    wait_in_chan(chan, &(chan->receivers), &transfer);
 
-    // if there are threads waiting for this mutex
-    if (mutex->waiting.size > 0) { 
-        // pass the ownership to the next thread in the waiting list
-        mutex->owner = mutex->waiting.head->ult;
-        delete_ult_first(&(mutex->waiting));
-        printf("[%lu] Mutex Wake up %lu\n", current->id, mutex->owner->id); fflush(NULL);
-        // if there is a thread waiting, WAKE IT UP!
-        mutex->owner->status = RUNNING;
-        mutex->owner->waiting_mutex = NULL;
-        insert_ult_last(&running_ult_list, mutex->owner);
-    }
+    return transfer.done;
+}
 
-    end_protected_zone();
-    
-    return 0;
+int ult_chan_send(ult_chan_t* chan, void* item) {
+    return ult_chan_send_n(chan, &item, 1) == 1 ? 0 : EPIPE;
 }
 
-int ult_cond_init(ult_cond_t* cond) {
-    init_lib();
+int ult_chan_recv(ult_chan_t* chan, void** item) {
+    return ult_chan_recv_n(chan, item, 1) == 1 ? 0 : EPIPE;
+}
 
+int ult_chan_try_send(ult_chan_t* chan, void* item) {
     start_protected_zone();
-        cond_counter += 1;
-        uint64_t id = cond_counter;
-    end_protected_zone();
+    spin_lock(&(chan->lock));
 
-    cond->id = id;
-    init_ult_linked_list(&(cond->waiting));
+    int result = chan->closed ? EPIPE : (put_items(chan, &item, 1) == 1 ? 0 : 1);
 
-    return 0;
+    spin_unlock(&(chan->lock));
+    end_protected_zone();
+
+    return result;
 }
 
-int ult_cond_destroy(ult_cond_t* cond) {
-    init_lib();
+int ult_chan_try_recv(ult_chan_t* chan, void** item) {
+    start_protected_zone();
+    spin_lock(&(chan->lock));
+
+    int result = take_items(chan, item, 1) == 1 ? 0 : (chan->closed ? EPIPE : 1);
+
+    spin_unlock(&(chan->lock));
+    end_protected_zone();
+
+    return result;
+}
 
+int ult_chan_close(ult_chan_t* chan) {
     start_protected_zone();
+    spin_lock(&(chan->lock));
 
-    if (cond->waiting.size != 0) {
+    if (chan->closed) {
+        spin_unlock(&(chan->lock));
         end_protected_zone();
         return 1;
     }
 
-    destroy_ult_list(&(cond->waiting));
+    chan->closed = 1;
 
+    // the waiting receivers get nothing (there is nothing to give them or they wouldn't wait), the senders keep what they didn't hand over
+    ult_t* thread;
+    while ((thread = ult_queue_pop_first(&(chan->receivers.waiting))) != NULL) {
+        wake_chan_waiter(thread);
+    }
+    while ((thread = ult_queue_pop_first(&(chan->senders.waiting))) != NULL) {
+        wake_chan_waiter(thread);
+    }
+
+    spin_unlock(&(chan->lock));
     end_protected_zone();
 
     return 0;
 }
 
-int ult_cond_wait(ult_cond_t* cond, ult_mutex_t* mutex) {
-    init_lib();
-
-    start_protected_zone();
+////////////////////// PARK //////////////////////
 
-    // we cannot use ult_mutex_unlock as it would break the protection zone, 
-    // and it is needed that the mutex unocking and waiting to be done atomically
-    // ult_mutex_unlock(mutex);
+#define PARK_BUCKET_BITS 8
+#define PARK_BUCKETS (1 << PARK_BUCKET_BITS)
 
-    ult_t* current = running_ult_list.head->ult;
+// the threads parked on the addresses that hash to the bucket, in the order they parked
+// the parked threads stay out of the deadlock check (the scheduler lock is never taken here), it takes them as live
+typedef struct park_bucket_t {
+    atomic_flag     lock;       // protects the queue and the park_address of the threads in it
+    ult_queue_t     waiting;
+} park_bucket_t;
 
-    // unlock the mutex atomically with waiting to make sure that no signals are missed
-    if (mutex != NULL && mutex->owner != NULL && mutex->owner->id == current->id) {
-        mutex->owner = NULL;
+static park_bucket_t park_buckets[PARK_BUCKETS];
 
-        if (mutex->waiting.size > 0) { 
-            mutex->owner = mutex->waiting.head->ult;
-            delete_ult_first(&(mutex->waiting));
-            printf("[%lu] Mutex Wake up (cond) %lu\n", current->id, mutex->owner->id); fflush(NULL);
-            mutex->owner->status = RUNNING;
-            mutex->owner->waiting_mutex = NULL;
-            insert_ult_last(&running_ult_list, mutex->owner);
-        }
+static void init_park_table() {
+    for (int i = 0; i < PARK_BUCKETS; i++) {
+        atomic_flag_clear(&(park_buckets[i].lock));
+        init_ult_queue(&(park_buckets[i].waiting));
     }
+}
 
-    insert_ult_last(&(cond->waiting), current);
-    current->status = WAITING;
-    current->waiting_cond = cond;
-    delete_ult_first(&running_ult_list);
+// fibonacci hashing, the words of an object are next to each other and the low bits of the address alone would crowd a few buckets
+static inline park_bucket_t* get_park_bucket(_Atomic uint32_t* address) {
+    return &park_buckets[((uintptr_t) address * 0x9E3779B97F4A7C15ULL) >> (64 - PARK_BUCKET_BITS)];
+}
 
-    printf("[%lu] switched to WAITING at cond var %lu\n", current->id, cond->id); fflush(NULL);
+// the timeout of a parked thread fired, the timer already took it out of the heap so ult_unpark leaves it in the bucket
+static void expire_park(carrier_t* carrier, ult_t* thread) {
+    park_bucket_t* bucket = get_park_bucket(thread->park_address);
 
-    SCHEDULER(current);
+    spin_lock(&(bucket->lock));
 
-    ult_mutex_lock(mutex);
+    // cleared under the bucket lock, ult_unpark can't take the thread for one that was woken up normally
+    thread->timed_wait = 0;
 
-    end_protected_zone();
+    ult_queue_remove(&(bucket->waiting), &(thread->queue_link));
+    thread->park_address = NULL;
+    thread->timed_out = 1;
 
-    return 0;
+    thread->status = RUNNING;
+    push_ready(carrier, thread);
+
+    spin_unlock(&(bucket->lock));
 }
 
-int ult_cond_signal(ult_cond_t* cond) {
-    init_lib();
+static int park(_Atomic uint32_t* address, uint32_t expected, uint64_t deadline) {
+    park_bucket_t* bucket = get_park_bucket(address);
 
     start_protected_zone();
+    spin_lock(&(bucket->lock));
 
-    if (cond->waiting.size == 0) {
+    // ult_unpark takes the bucket lock too, a change of the word followed by ult_unpark can't fall between this check and the sleep
+    if (atomic_load_explicit(address, memory_order_acquire) != expected) {
+        spin_unlock(&(bucket->lock));
         end_protected_zone();
         return 1;
     }
 
-    ult_t* ult_to_start = cond->waiting.head->ult;
-    delete_ult_first(&(cond->waiting));
-    ult_to_start->status = RUNNING;
-    ult_to_start->waiting_cond = NULL;
-    insert_ult_last(&running_ult_list, ult_to_start);
+    ult_t* current = get_current();
 
-    end_protected_zone();
+    start_blocking(current, ULT_BLOCK_PARK);
+    ult_queue_push_last(&(bucket->waiting), &(current->queue_link));
+    current->status = WAITING;
+    current->park_address = address;
+
+    uint8_t earliest = deadline != UINT64_MAX ? arm_wait_timeout(current, deadline) : 0;
+
+    spin_unlock(&(bucket->lock));
+
+    if (earliest) {
+        wake_timer_keeper();
+    }
+
+    SCHEDULER(current, 0);
+
+    if (current->timed_out) {
+        current->timed_out = 0;
+        return ETIMEDOUT;
+    }
 
     return 0;
 }
 
-int ult_cond_broadcast(ult_cond_t* cond) {
-    init_lib();
+int ult_park(_Atomic uint32_t* address, uint32_t expected) {
+    return park(address, expected, UINT64_MAX);
+}
+
+int ult_park_timeout(_Atomic uint32_t* address, uint32_t expected, uint64_t sec, uint64_t nsec) {
+    return park(address, expected, deadline_after(sec, nsec));
+}
+
+uint32_t ult_unpark(_Atomic uint32_t* address, uint32_t n) {
+    park_bucket_t* bucket = get_park_bucket(address);
+    uint32_t woken = 0;
 
     start_protected_zone();
+    spin_lock(&(bucket->lock));
 
-    while (cond->waiting.size != 0) {
-        ult_t* ult_to_start = cond->waiting.head->ult;
-        delete_ult_first(&(cond->waiting));
-        ult_to_start->status = RUNNING;
-        ult_to_start->waiting_cond = NULL;
-        insert_ult_last(&running_ult_list, ult_to_start);
+    // other addresses share the bucket, only their threads are skipped
+    ult_link_t* link = bucket->waiting.head;
+    while (link != NULL && woken < n) {
+        ult_t* thread = link->ult;
+        link = link->next;
+
+        if (thread->park_address != address || !claim_waiter(thread)) {
+            continue;
+        }
+
+        ult_queue_remove(&(bucket->waiting), &(thread->queue_link));
+        thread->park_address = NULL;
+        make_ready(thread);
+        woken += 1;
     }
 
+    spin_unlock(&(bucket->lock));
     end_protected_zone();
 
-    return 0;
+    return woken;
 }
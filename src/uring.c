@@ -0,0 +1,164 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+static int io_uring_setup(uint32_t entries, struct io_uring_params* params) {
+    return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int fd, uint32_t to_submit, uint32_t min_complete, uint32_t flags) {
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+int uring_init(uring_t* ring, uint32_t entries) {
+    struct io_uring_params params;
+
+    memset(ring, 0, sizeof(uring_t));
+    memset(&params, 0, sizeof(params));
+
+    ring->fd = io_uring_setup(entries, &params);
+    if (ring->fd == -1) {
+        return -1;
+    }
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    // newer kernels map both queues with a single mmap
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        goto fail;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    }
+    else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            ring->cq_ring = NULL;
+            goto fail;
+        }
+    }
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe*) mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        goto fail;
+    }
+
+    char* sq = (char*) ring->sq_ring;
+    ring->sq_head    = (_Atomic uint32_t*) (sq + params.sq_off.head);
+    ring->sq_tail    = (_Atomic uint32_t*) (sq + params.sq_off.tail);
+    ring->sq_mask    = *(uint32_t*) (sq + params.sq_off.ring_mask);
+    ring->sq_entries = *(uint32_t*) (sq + params.sq_off.ring_entries);
+    ring->sq_array   = (uint32_t*) (sq + params.sq_off.array);
+    ring->sq_prepared = atomic_load_explicit(ring->sq_tail, memory_order_relaxed);
+
+    char* cq = (char*) ring->cq_ring;
+    ring->cq_head = (_Atomic uint32_t*) (cq + params.cq_off.head);
+    ring->cq_tail = (_Atomic uint32_t*) (cq + params.cq_off.tail);
+    ring->cq_mask = *(uint32_t*) (cq + params.cq_off.ring_mask);
+    ring->cqes    = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+
+    return 0;
+
+fail:
+    {
+        int error = errno;
+        uring_destroy(ring);
+        errno = error;
+    }
+    return -1;
+}
+
+void uring_destroy(uring_t* ring) {
+    if (ring->sqes != NULL) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+
+    if (ring->cq_ring != NULL && ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+
+    if (ring->sq_ring != NULL && ring->sq_ring != MAP_FAILED) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+
+    memset(ring, 0, sizeof(uring_t));
+    ring->fd = -1;
+}
+
+struct io_uring_sqe* uring_get_sqe(uring_t* ring) {
+    uint32_t head = atomic_load_explicit(ring->sq_head, memory_order_acquire);
+
+    if (ring->sq_prepared - head >= ring->sq_entries) {
+        return NULL; // full
+    }
+
+    uint32_t index = ring->sq_prepared & ring->sq_mask;
+    struct io_uring_sqe* sqe = &(ring->sqes[index]);
+
+    // the entries are used in order, the index array is the identity
+    ring->sq_array[index] = index;
+    ring->sq_prepared += 1;
+
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    return sqe;
+}
+
+uint32_t uring_pending(uring_t* ring) {
+    // counted from the kernel's head, the entries a previous submit left in the queue are submitted again
+    return ring->sq_prepared - atomic_load_explicit(ring->sq_head, memory_order_acquire);
+}
+
+int uring_submit(uring_t* ring) {
+    uint32_t to_submit = uring_pending(ring);
+
+    if (to_submit == 0) {
+        return 0;
+    }
+
+    // the kernel reads the entries after it sees the new tail
+    atomic_store_explicit(ring->sq_tail, ring->sq_prepared, memory_order_release);
+
+    int submitted;
+    do {
+        submitted = io_uring_enter(ring->fd, to_submit, 0, 0);
+    } while (submitted == -1 && errno == EINTR);
+
+    return submitted;
+}
+
+struct io_uring_cqe* uring_peek_cqe(uring_t* ring) {
+    uint32_t head = atomic_load_explicit(ring->cq_head, memory_order_relaxed);
+
+    if (head == atomic_load_explicit(ring->cq_tail, memory_order_acquire)) {
+        return NULL;
+    }
+
+    return &(ring->cqes[head & ring->cq_mask]);
+}
+
+void uring_cqe_seen(uring_t* ring) {
+    uint32_t head = atomic_load_explicit(ring->cq_head, memory_order_relaxed);
+    atomic_store_explicit(ring->cq_head, head + 1, memory_order_release);
+}